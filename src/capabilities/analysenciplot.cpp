@@ -17,12 +17,79 @@
  *
  */
 
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <map>
+#include <numeric>
 
 #include "src/tools/general.h"
 
 #include "analysenciplot.h"
 
+NCIGrid::NCIGrid(const NCIPoints& points, double cellsize)
+{
+    if (points.size() == 0)
+        return;
+    m_cell = cellsize > 0 ? cellsize : 1;
+    const auto [xmin, xmax] = std::minmax_element(points.x.begin(), points.x.end());
+    const auto [ymin, ymax] = std::minmax_element(points.y.begin(), points.y.end());
+    m_xmin = *xmin;
+    m_ymin = *ymin;
+    /* limit the number of cells for very small radii, a coarser grid is still correct */
+    const double cells = (*xmax - m_xmin) / m_cell * (*ymax - m_ymin) / m_cell;
+    if (cells > 4.0 * points.size())
+        m_cell *= std::sqrt(cells / (4.0 * points.size()));
+    m_nx = int((*xmax - m_xmin) / m_cell) + 1;
+    m_ny = int((*ymax - m_ymin) / m_cell) + 1;
+
+    /* counting sort of the points into their cells */
+    std::vector<int> cell(points.size());
+    m_start.assign(std::size_t(m_nx) * m_ny + 1, 0);
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        cell[i] = CellX(points.x[i]) * m_ny + CellY(points.y[i]);
+        m_start[cell[i] + 1]++;
+    }
+    std::partial_sum(m_start.begin(), m_start.end(), m_start.begin());
+    std::vector<int> fill(m_start.begin(), m_start.end() - 1);
+    m_x.resize(points.size());
+    m_y.resize(points.size());
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        const int index = fill[cell[i]]++;
+        m_x[index] = points.x[i];
+        m_y[index] = points.y[i];
+    }
+}
+
+bool NCIGrid::HasNeighbour(double x, double y, double radius) const
+{
+    if (m_x.empty())
+        return false;
+    const double r2 = radius * radius;
+    const int range = int(std::ceil(radius / m_cell));
+    const int cx = int(std::floor((x - m_xmin) / m_cell)), cy = int(std::floor((y - m_ymin) / m_cell));
+    for (int i = std::max(0, cx - range); i <= std::min(m_nx - 1, cx + range); ++i) {
+        for (int j = std::max(0, cy - range); j <= std::min(m_ny - 1, cy + range); ++j) {
+            const int c = i * m_ny + j;
+            for (int k = m_start[c]; k < m_start[c + 1]; ++k) {
+                const double dx = m_x[k] - x, dy = m_y[k] - y;
+                if (dx * dx + dy * dy < r2)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+int NCIMatchThread::execute()
+{
+    for (std::size_t i = m_start; i < m_end; ++i)
+        (*m_unique)[i] = !m_grid->HasNeighbour(m_points->x[i], m_points->y[i], m_points->radius[i] / m_scale);
+    return 0;
+}
+
 AnalyseNCIPlot::AnalyseNCIPlot(const json& controller)
     : CurcumaMethod(AnalyseNCIPlotJson, controller, false)
 
@@ -34,11 +101,14 @@ AnalyseNCIPlot::AnalyseNCIPlot(const json& controller)
 
 void AnalyseNCIPlot::start()
 {
-    int scaling = m_bins;
     std::cout << "NCIPlot Analysis - Loading files" << std::endl;
 
     m_NCI1 = LoadFile(m_file1);
     m_NCI2 = LoadFile(m_file2);
+    SetRadius(m_NCI1);
+    SetRadius(m_NCI2);
+
+    std::cout << m_NCI1.size() << " and " << m_NCI2.size() << " points loaded" << std::endl;
 
     std::string file1 = m_file1;
     std::string file2 = m_file2;
@@ -49,145 +119,125 @@ void AnalyseNCIPlot::start()
     file1 = file1 + ".depleted.dat";
     file2 = file2 + ".depleted.dat";
 
-    std::vector<double> distances_1, distances_2;
-    std::map<int, std::map<double, double>::iterator> index_mapper_1, index_mapper_2;
-    for (auto iter = m_NCI1.begin(); iter != m_NCI1.end(); ++iter) {
-        if (index_mapper_1.find(int(iter->first * scaling)) == index_mapper_1.end())
-            index_mapper_1.insert(std::pair<int, std::map<double, double>::iterator>(int(iter->first * scaling), iter));
-
-        auto next = iter;
-        next++;
-        if (next == m_NCI1.end())
-            break;
-
-        distances_1.push_back(sqrt((iter->first - next->first) * (iter->first - next->first) + (iter->second - next->second) * (iter->second - next->second)));
-    }
-    index_mapper_1.insert(std::pair<int, std::map<double, double>::iterator>(index_mapper_1.size(), m_NCI1.end()));
-
-    for (auto iter = m_NCI2.begin(); iter != m_NCI2.end(); ++iter) {
-        if (index_mapper_2.find(int(iter->first * scaling)) == index_mapper_2.end())
-            index_mapper_2.insert(std::pair<int, std::map<double, double>::iterator>(int(iter->first * scaling), iter));
-
-        auto next = iter;
-        next++;
-        if (next == m_NCI2.end())
-            break;
-
-        distances_2.push_back(sqrt((iter->first - next->first) * (iter->first - next->first) + (iter->second - next->second) * (iter->second - next->second)));
-    }
-    index_mapper_2.insert(std::pair<int, std::map<double, double>::iterator>(index_mapper_2.size(), m_NCI2.end()));
-
-    double mean1 = Tools::mean(distances_1);
-    double mean2 = Tools::mean(distances_2);
-
-    std::map<double, double> final, left, right;
-
-    int count = 0;
-
-    for (auto iter_i = m_NCI1.begin(); iter_i != m_NCI1.end(); ++iter_i) {
-        bool match = false;
-
-        int index_start = int(iter_i->first * scaling);
-        while (index_mapper_2.find(index_start) == index_mapper_2.end())
-            index_start--;
-        int index_end = int(iter_i->first * scaling) + 1;
-
-        if (index_end <= m_NCI2.size())
-            break;
-
-        while (index_mapper_2.find(index_end) == index_mapper_2.end())
-            index_end++;
-        if (m_local_distance) {
-            mean1 = getDistance(m_NCI1, index_mapper_2[index_start], index_mapper_2[index_end]);
-            std::cout << mean1 << std::endl;
-        }
-        for (auto iter_j = index_mapper_2[index_start]; iter_j != index_mapper_2[index_end]; ++iter_j) {
-            double d = (sqrt((iter_i->first - iter_j->first) * (iter_i->first - iter_j->first) + (iter_i->second - iter_j->second) * (iter_i->second - iter_j->second)));
-            if (d < mean1 / m_scale_d1) {
-                match = true;
-                count++;
-                break;
-            } else if (d > 1) {
-                match = true;
-                break;
-            }
-        }
-        if (!match) {
-            final.insert(std::pair<double, double>(iter_i->first, iter_i->second));
-            left.insert(std::pair<double, double>(iter_i->first, iter_i->second));
-        }
-    }
-
-    for (auto iter_i = m_NCI2.begin(); iter_i != m_NCI2.end(); ++iter_i) {
-        bool match = false;
-
-        int index_start = int(iter_i->first * scaling);
-        while (index_mapper_1.find(index_start) == index_mapper_1.end())
-            index_start--;
-        int index_end = int(iter_i->first * scaling) + 1;
-
-        if (index_end <= m_NCI1.size())
-            break;
-
-        while (index_mapper_1.find(index_end) == index_mapper_1.end())
-            index_end++;
-
-        if (m_local_distance) {
-            mean2 = getDistance(m_NCI2, index_mapper_1[index_start], index_mapper_1[index_end]);
-        }
-
-        for (auto iter_j = index_mapper_1[index_start]; iter_j != index_mapper_1[index_end]; ++iter_j) {
-            double d = (sqrt((iter_i->first - iter_j->first) * (iter_i->first - iter_j->first) + (iter_i->second - iter_j->second) * (iter_i->second - iter_j->second)));
-            if (d < mean2 / m_scale_d2) {
-                match = true;
-                count++;
-                break;
-            } else if (d > 1) {
-                match = true;
-                break;
-            }
-        }
-        if (!match) {
-            final.insert(std::pair<double, double>(iter_i->first, iter_i->second));
-            right.insert(std::pair<double, double>(iter_i->first, iter_i->second));
-        }
-    }
+    const std::vector<char> left = Unique(m_NCI1, m_NCI2, m_scale_d1);
+    const std::vector<char> right = Unique(m_NCI2, m_NCI1, m_scale_d2);
 
     std::ofstream input;
-    input.open("combined.dat", std::ios::out);
-
-    for (auto i : final)
-        input << i.first << " " << i.second << std::endl;
-    input.close();
-
     input.open(file1, std::ios::out);
-
-    for (auto i : left)
-        input << i.first << " " << i.second << std::endl;
+    for (std::size_t i = 0; i < m_NCI1.size(); ++i)
+        if (left[i])
+            input << m_NCI1.x[i] << " " << m_NCI1.y[i] << "\n";
     input.close();
 
     input.open(file2, std::ios::out);
+    for (std::size_t i = 0; i < m_NCI2.size(); ++i)
+        if (right[i])
+            input << m_NCI2.x[i] << " " << m_NCI2.y[i] << "\n";
+    input.close();
 
-    for (auto i : right)
-        input << i.first << " " << i.second << std::endl;
+    /* both sets are sorted, merge them for the combined plot */
+    input.open("combined.dat", std::ios::out);
+    std::size_t i = 0, j = 0;
+    while (i < m_NCI1.size() || j < m_NCI2.size()) {
+        if (j == m_NCI2.size() || (i < m_NCI1.size() && m_NCI1.x[i] <= m_NCI2.x[j])) {
+            if (left[i])
+                input << m_NCI1.x[i] << " " << m_NCI1.y[i] << "\n";
+            ++i;
+        } else {
+            if (right[j])
+                input << m_NCI2.x[j] << " " << m_NCI2.y[j] << "\n";
+            ++j;
+        }
+    }
     input.close();
     std::cout << "NCIPlot Analysis - Loading files done" << std::endl;
 }
-std::map<double, double> AnalyseNCIPlot::LoadFile(const std::string& file)
+
+NCIPoints AnalyseNCIPlot::LoadFile(const std::string& file) const
 {
-    std::map<double, double> map;
+    std::vector<std::pair<double, double>> points;
     std::ifstream input(file);
-    std::vector<int> ignore_index;
-    int index = 0;
     for (std::string line; getline(input, line);) {
-        index++;
-        StringList list = Tools::SplitString(line, " ");
-        if (list.size() == 0)
+        const char* begin = line.c_str();
+        char* end = nullptr;
+        const double x = std::strtod(begin, &end);
+        if (end == begin)
+            continue;
+        begin = end;
+        const double y = std::strtod(begin, &end);
+        if (end == begin)
             continue;
-        if (std::stod(list[0]) >= -0.07 && std::stod(list[0]) <= 0.07)
-            map.insert(std::pair<double, double>(std::stod(list[0]), std::stod(list[1])));
+        if (x >= -0.07 && x <= 0.07)
+            points.emplace_back(x, y);
+    }
+    /* sorted by sign(lambda2)rho, the first point of an equal abscissa is kept */
+    std::stable_sort(points.begin(), points.end(), [](const std::pair<double, double>& a, const std::pair<double, double>& b) { return a.first < b.first; });
+    points.erase(std::unique(points.begin(), points.end(), [](const std::pair<double, double>& a, const std::pair<double, double>& b) { return a.first == b.first; }), points.end());
+
+    NCIPoints result;
+    result.x.reserve(points.size());
+    result.y.reserve(points.size());
+    for (const auto& point : points) {
+        result.x.push_back(point.first);
+        result.y.push_back(point.second);
+    }
+    return result;
+}
+
+void AnalyseNCIPlot::SetRadius(NCIPoints& points) const
+{
+    const std::size_t size = points.size();
+    std::vector<double> distances(size > 0 ? size - 1 : 0);
+    for (std::size_t i = 0; i + 1 < size; ++i)
+        distances[i] = std::sqrt((points.x[i] - points.x[i + 1]) * (points.x[i] - points.x[i + 1]) + (points.y[i] - points.y[i + 1]) * (points.y[i] - points.y[i + 1]));
+
+    if (!m_local_distance) {
+        points.radius.assign(size, Tools::mean(distances));
+        return;
+    }
+
+    /* mean spacing per bin of width 1/bins, as the index of the previous implementation */
+    std::map<int, std::pair<double, int>> bins;
+    for (std::size_t i = 0; i < distances.size(); ++i) {
+        auto& bin = bins[int(points.x[i] * m_bins)];
+        bin.first += distances[i];
+        bin.second++;
+    }
+    const double mean = Tools::mean(distances);
+    points.radius.resize(size);
+    for (std::size_t i = 0; i < size; ++i) {
+        auto bin = bins.find(int(points.x[i] * m_bins));
+        points.radius[i] = bin == bins.end() ? mean : bin->second.first / bin->second.second;
     }
-    return map;
+}
+
+std::vector<char> AnalyseNCIPlot::Unique(const NCIPoints& first, const NCIPoints& second, double scale) const
+{
+    std::vector<char> unique(first.size(), 1);
+    if (first.size() == 0)
+        return unique;
+
+    const double radius = *std::max_element(first.radius.begin(), first.radius.end()) / scale;
+    const NCIGrid grid(second, radius);
+
+    const int threads = std::max(1, m_threads);
+    const std::size_t chunk = (first.size() + threads - 1) / threads;
+    std::vector<NCIMatchThread*> workers;
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setProgressBar(CxxThreadPool::ProgressBarType::None);
+    pool->setActiveThreadCount(threads);
+    for (std::size_t start = 0; start < first.size(); start += chunk) {
+        NCIMatchThread* thread = new NCIMatchThread(&first, &grid, &unique, scale, start, std::min(first.size(), start + chunk));
+        workers.push_back(thread);
+        pool->addThread(thread);
+    }
+    pool->StaticPool();
+    pool->StartAndWait();
+    pool->clear();
+    delete pool;
+    for (auto* thread : workers)
+        delete thread;
+    return unique;
 }
 
 void AnalyseNCIPlot::LoadControlJson()
@@ -195,19 +245,7 @@ void AnalyseNCIPlot::LoadControlJson()
     m_bins = Json2KeyWord<double>(m_defaults, "bins");
     m_scale_d1 = Json2KeyWord<double>(m_defaults, "scale_d1");
     m_scale_d2 = Json2KeyWord<double>(m_defaults, "scale_d2");
+    m_threads = Json2KeyWord<int>(m_defaults, "threads");
 
     m_local_distance = Json2KeyWord<bool>(m_defaults, "local_distance");
 }
-double AnalyseNCIPlot::getDistance(const std::map<double, double>& map, const std::map<double, double>::iterator& begin, const std::map<double, double>::iterator& end)
-{
-    std::vector<double> distances;
-    for (auto iter = begin; iter != end; ++iter) {
-        auto next = iter;
-        next++;
-        if (next == map.end())
-            break;
-
-        distances.push_back(sqrt((iter->first - next->first) * (iter->first - next->first) + (iter->second - next->second) * (iter->second - next->second)));
-    }
-    return Tools::mean(distances);
-}
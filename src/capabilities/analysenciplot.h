@@ -19,18 +19,69 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
 #include "curcumamethod.h"
 
 static json AnalyseNCIPlotJson{
     { "bins", 1000 },
     { "scale_d1", 1 },
     { "scale_d2", 1 },
-    { "local_distance", false }
+    { "local_distance", false },
+    { "threads", 1 }
+};
+
+/*! \brief NCIPlot points (sign(lambda2)rho, s) in contiguous arrays, sorted by sign(lambda2)rho */
+struct NCIPoints {
+    std::vector<double> x, y;
+    /* match radius of every point, either global or from the local bin spacing */
+    std::vector<double> radius;
+    inline std::size_t size() const { return x.size(); }
+};
+
+/*! \brief Uniform 2D grid over the (sign(lambda2)rho, s) plane, points are stored cell by cell */
+class NCIGrid {
+public:
+    NCIGrid(const NCIPoints& points, double cellsize);
+
+    /*! \brief True if any grid point lies closer than radius to (x, y) */
+    bool HasNeighbour(double x, double y, double radius) const;
+
+private:
+    inline int CellX(double x) const { return std::min(m_nx - 1, std::max(0, int((x - m_xmin) / m_cell))); }
+    inline int CellY(double y) const { return std::min(m_ny - 1, std::max(0, int((y - m_ymin) / m_cell))); }
+
+    std::vector<double> m_x, m_y;
+    std::vector<int> m_start;
+    double m_xmin = 0, m_ymin = 0, m_cell = 1;
+    int m_nx = 1, m_ny = 1;
 };
 
-struct NCIplot {
-    std::map<double, double> m_plot;
-    double m_RDG_max = 0, m_RDG_min = 0;
+/*! \brief Flags all points of one set that have no partner in the grid of the other set */
+class NCIMatchThread : public CxxThread {
+public:
+    NCIMatchThread(const NCIPoints* points, const NCIGrid* grid, std::vector<char>* unique, double scale, std::size_t start, std::size_t end)
+        : m_points(points)
+        , m_grid(grid)
+        , m_unique(unique)
+        , m_scale(scale)
+        , m_start(start)
+        , m_end(end)
+    {
+        setAutoDelete(false);
+    }
+
+    int execute() override;
+
+private:
+    const NCIPoints* m_points;
+    const NCIGrid* m_grid;
+    std::vector<char>* m_unique;
+    double m_scale;
+    std::size_t m_start, m_end;
 };
 
 class AnalyseNCIPlot : public CurcumaMethod {
@@ -46,8 +97,6 @@ public:
     }
 
 private:
-    double getDistance(const std::map<double, double>& map, const std::map<double, double>::iterator& begin, const std::map<double, double>::iterator& end);
-
     /* Lets have this for all modules */
     inline nlohmann::json WriteRestartInformation() override { return json(); }
 
@@ -62,11 +111,18 @@ private:
     /* Read Controller has to be implemented for all */
     void LoadControlJson() override;
 
-    std::map<double, double> LoadFile(const std::string& file);
+    NCIPoints LoadFile(const std::string& file) const;
+
+    /* Mean distance of adjacent points, globally or for every bin of sign(lambda2)rho */
+    void SetRadius(NCIPoints& points) const;
+
+    /* Points of first without a partner in second, evaluated in parallel */
+    std::vector<char> Unique(const NCIPoints& first, const NCIPoints& second, double scale) const;
 
     std::string m_file1, m_file2;
-    std::map<double, double> m_NCI1, m_NCI2;
+    NCIPoints m_NCI1, m_NCI2;
 
     double m_bins = 1000, m_scale_d1 = 1, m_scale_d2 = 1;
+    int m_threads = 1;
     bool m_local_distance = false;
 };
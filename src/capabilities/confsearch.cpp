@@ -21,6 +21,7 @@
 
 #include "src/capabilities/confscan.h"
 #include "src/capabilities/curcumaopt.h"
+#include "src/capabilities/funnel.h"
 #include "src/capabilities/simplemd.h"
 
 #include "src/core/fileiterator.h"
@@ -162,6 +163,31 @@ std::string ConfSearch::PerformOptimisation(const std::string& f, const nlohmann
     result_file.open(file);
     result_file.close();
 
+    json stages = ScreeningFunnel::Stages(m_funnel);
+    if (stages.size()) {
+        /* the funnel replaces the final optimisation, so the default funnel ends with the method of
+         * confsearch, custom stages are taken as they are */
+        if (m_funnel.is_string() && m_funnel.get<std::string>().compare("default") == 0)
+            stages.back()["method"] = m_method;
+        else
+            std::cout << "The funnel stages replace the final optimisation with " << m_method << "." << std::endl;
+
+        std::vector<Molecule> molecules;
+        FileIterator input(file + ".xyz");
+        while (!input.AtEnd())
+            molecules.push_back(input.Next());
+
+        ScreeningFunnel funnel(stages, m_threads, m_charge, m_spin);
+        funnel.setBasename(file + ".funnel");
+        std::vector<Molecule> survivors = funnel.Run(molecules);
+
+        /* same file the optimiser would have written, PerformFilter picks it up */
+        std::ofstream(file + ".opt.xyz").close();
+        for (const auto& molecule : survivors)
+            molecule.appendXYZFile(file + ".opt.xyz");
+        return file;
+    }
+
     CurcumaOpt optimise(parameter, false);
     optimise.setFileName("confsearch.unique.xyz");
     optimise.overrideBasename(file);
@@ -210,4 +236,5 @@ void ConfSearch::LoadControlJson()
     m_threads = Json2KeyWord<int>(m_defaults, "threads");
     m_energy_window = Json2KeyWord<double>(m_defaults, "energy_window");
     m_dT = Json2KeyWord<double>(m_defaults, "dT");
+    m_funnel = Json2KeyWord<json>(m_defaults, "funnel");
 }
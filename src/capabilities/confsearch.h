@@ -89,7 +89,8 @@ static const nlohmann::json ConfSearchJson{
     { "wall_z_min", 0 },
     { "wall_z_max", 0 },
     { "wall_temp", 298.15 },
-    { "wall_beta", 6 }
+    { "wall_beta", 6 },
+    { "funnel", "none" } // staged screening of the unique structures, "default", json file or array of stages
 };
 
 class Molecule;
@@ -130,6 +131,7 @@ private:
 
     StringList m_error_list;
     std::string m_filename, m_method, m_thermostat;
+    json m_funnel = "none";
     bool m_silent = true, m_rattle = true;
     double m_dT = 4;
     std::vector<Molecule*> m_in_stack, m_final_stack;
@@ -111,23 +111,6 @@ void CurcumaMethod::UpdateController(const json& controller)
     LoadControlJson();
 }
 
-bool CurcumaMethod::CheckStop() const
-{
-#ifdef C17
-#ifndef _WIN32
-    return std::filesystem::exists("stop");
-#endif
-    std::ifstream test_file("stop");
-    bool result = test_file.is_open();
-    test_file.close();
-    return result;
-#else
-    std::ifstream test_file("stop");
-    bool result = test_file.is_open();
-    test_file.close();
-    return result;
-#endif
-}
 
 void CurcumaMethod::getBasename(const std::string& filename)
 {
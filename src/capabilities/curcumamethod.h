@@ -20,6 +20,7 @@
 #pragma once
 
 #include "src/tools/general.h"
+#include "src/tools/stopcontrol.h"
 
 #include <string>
 
@@ -49,7 +50,18 @@ public:
 
     virtual void start() = 0; // TODO make pure virtual and move all main action here
 
-    bool CheckStop() const;
+    /*! \brief Stop requested by signal or stop file, only reads an atomic flag */
+    static inline bool CheckStop() { return StopControl::StopRequested(); }
+
+    /*! \brief True once for every checkpoint request (SIGUSR1) since the last call */
+    inline bool CheckpointRequested()
+    {
+        const unsigned int generation = StopControl::CheckpointGeneration();
+        if (generation == m_checkpoint_generation)
+            return false;
+        m_checkpoint_generation = generation;
+        return true;
+    }
 
     std::string Basename() const { return m_basename; }
     void getBasename(const std::string& filename);
@@ -87,4 +99,5 @@ private:
     StringList m_error_list;
 
     std::string m_basename;
+    unsigned int m_checkpoint_generation = StopControl::CheckpointGeneration();
 };
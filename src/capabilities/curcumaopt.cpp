@@ -444,10 +444,7 @@ Molecule CurcumaOpt::LBFGSOptimise(Molecule* initial, const json& controller, st
             + 4 * (solver.isConverged())
             + 8 * (solver.final_grad_norm() < GradNorm);
         perform_optimisation = ((converged & ConvCount) != ConvCount) && (fun.isError() == 0);
-        std::ifstream test_file("stop");
-        bool result = test_file.is_open();
-        test_file.close();
-        if (result) {
+        if (CheckStop()) {
             perform_optimisation = false;
             error = true;
         }
@@ -21,6 +21,7 @@
 
 #include "src/capabilities/confscan.h"
 #include "src/capabilities/curcumaopt.h"
+#include "src/capabilities/funnel.h"
 #include "src/capabilities/optimiser/LevMarDocking.h"
 
 #include "external/CxxThreadPool/include/CxxThreadPool.h"
@@ -59,16 +60,32 @@ void Docking::LoadControlJson()
     m_centroid_max_distance = Json2KeyWord<double>(m_defaults, "CentroidMaxDistance");
     m_centroid_tol_distance = Json2KeyWord<double>(m_defaults, "CentroidTolDis");
     m_centroid_rot_distance = Json2KeyWord<double>(m_defaults, "RotationTolDis");
+    m_torsion_tol_distance = Json2KeyWord<double>(m_defaults, "TorsionTolDis");
     m_energy_threshold = Json2KeyWord<double>(m_defaults, "EnergyThreshold");
 
     m_threads = Json2KeyWord<int>(m_defaults, "threads");
     m_docking_threads = Json2KeyWord<int>(m_defaults, "DockingThreads");
     m_charge = Json2KeyWord<int>(m_defaults, "Charge");
+    m_spin = Json2KeyWord<int>(m_defaults, "Spin");
     m_cycles = Json2KeyWord<int>(m_defaults, "Cycles");
 
     m_RMSDthreads = Json2KeyWord<int>(m_defaults, "RMSDThreads");
     m_RMSDElement = Json2KeyWord<int>(m_defaults, "RMSDElement");
     m_RMSDmethod = Json2KeyWord<std::string>(m_defaults, "RMSDMethod");
+    m_pose_index.setTolerances(m_centroid_tol_distance, m_centroid_rot_distance);
+    m_pose_index.setTorsionTolerance(m_torsion_tol_distance);
+
+    m_sampler = Json2KeyWord<std::string>(m_defaults, "Sampler");
+    m_bh_walkers = Json2KeyWord<int>(m_defaults, "BHWalkers");
+    m_bh_steps = Json2KeyWord<int>(m_defaults, "BHSteps");
+    m_bh_patience = Json2KeyWord<int>(m_defaults, "BHPatience");
+    m_bh_temperature = Json2KeyWord<double>(m_defaults, "BHTemperature");
+    m_bh_translation = Json2KeyWord<double>(m_defaults, "BHTranslation");
+    m_bh_rotation = Json2KeyWord<double>(m_defaults, "BHRotation");
+    m_bh_seed = Json2KeyWord<int>(m_defaults, "BHSeed");
+    m_funnel = Json2KeyWord<json>(m_defaults, "Funnel");
+    m_flexible = Json2KeyWord<bool>(m_defaults, "Flexible");
+    m_clash_scaling = Json2KeyWord<double>(m_defaults, "ClashScaling");
 }
 
 bool Docking::Initialise()
@@ -158,6 +175,11 @@ void Docking::PerformDocking()
 
     std::cout << m_guest_structure.Centroid().transpose() << " = Centroid of Guest" << std::endl;
 
+    if (m_flexible) {
+        m_torsions = RotatableBonds(m_guest_structure);
+        std::cout << m_torsions.size() << " rotatable bonds of the guest are optimised" << std::endl;
+    }
+
     if (m_AutoPos)
         m_initial_anchor = { m_host_structure.Centroid() };
 
@@ -197,6 +219,8 @@ void Docking::PerformDocking()
                 }
                 std::cout << (x / double(m_step_X)) * 100 << "% done." << std::endl;
             }
+        } else if (m_sampler.compare("basinhopping") == 0) {
+            BasinHopping();
         } else {
             std::vector<DockThread*> threads;
             CxxThreadPool* pool = new CxxThreadPool;
@@ -206,8 +230,10 @@ void Docking::PerformDocking()
                     for (int z = 0; z < m_step_Z; ++z) {
                         for (const Position& anchor : m_initial_anchor) {
                             DockThread* thread = new DockThread(m_host_structure, guest);
+                            thread->setPoseIndex(&m_pose_index, m_centroid_max_distance);
                             thread->setPosition(anchor);
                             thread->setRotation(Position{ x * max_X, y * max_Y, z * max_Z });
+                            thread->setTorsions(m_torsions, m_clash_scaling);
                             pool->addThread(thread);
                             threads.push_back(thread);
                         }
@@ -223,46 +249,21 @@ void Docking::PerformDocking()
             for (const auto* t : pool->Finished()) {
                 const DockThread* thread = static_cast<const DockThread*>(t);
                 ++all;
-                Molecule* molecule = new Molecule(m_host_structure);
                 guest = m_guest_structure;
 
-                bool accept = true;
-
-                if (GeometryTools::Distance(thread->InitialPosition(), thread->LastPosition()) > m_centroid_max_distance) {
-                    accept = false;
+                if (thread->Escaped()) {
                     distance++;
                     m_initial_list.push_back(std::pair<Position, Position>(thread->InitialPosition(), thread->InitialRotation()));
                     continue;
                 }
 
-                for (std::size_t i = 0; i < m_anchor_accepted.size(); ++i) {
-                    Position anchor = m_anchor_accepted[i];
-                    Position rotation = m_rotation_accepted[i];
-                    if (GeometryTools::Distance(anchor, thread->LastPosition()) < m_centroid_tol_distance || GeometryTools::Distance(rotation, thread->LastRotation()) < m_centroid_rot_distance)
-                        accept = false;
-                }
-                if (accept == false) {
+                /* duplicates were already rejected by the pose index when the thread finished */
+                if (!thread->Unique()) {
                     excluded++;
                     continue;
                 }
-                m_anchor_accepted.push_back(thread->LastPosition());
-                m_rotation_accepted.push_back(thread->LastRotation());
-
-                Geometry destination = GeometryTools::TranslateAndRotate(stored_guest, initial_centroid, thread->LastPosition(), thread->LastRotation());
-
-                guest.setGeometry(destination);
-                double distance = GeometryTools::Distance(thread->LastPosition(), m_host_structure.Centroid());
-                m_sum_distance += distance;
-                m_docking_list.insert(std::pair<double, Vector>(distance, PositionPair2Vector(std::pair<Position, Position>(thread->LastPosition(), thread->LastRotation()))));
-                result = m_host_structure;
-                for (std::size_t i = 0; i < guest.AtomCount(); ++i) {
-                    molecule->addPair(guest.Atom(i));
-                }
-                molecule->setEnergy(distance);
-                molecule->setCharge(m_charge);
-                m_docking_result.insert(std::pair<double, Molecule*>(all, molecule));
-                if (molecule->GetFragments(frag_scaling).size() == 2)
-                    m_reuse_anchor.push_back(thread->LastPosition());
+
+                AddDockingResult(thread->LastPosition(), thread->LastRotation(), all, thread->LastGuest());
             }
             delete pool;
         }
@@ -276,7 +277,7 @@ void Docking::PerformDocking()
             molecule.appendXYZFile("Docking_Failed.xyz");
         }
 
-        std::cout << m_anchor_accepted.size() << " stored structures. " << std::endl
+        std::cout << m_pose_index.Size() << " stored structures. " << std::endl
                   << excluded << " structures were skipped, due to being duplicate!" << std::endl
                   << all << " checked!" << std::endl;
         guest = m_guest_structure;
@@ -309,11 +310,72 @@ void Docking::PerformDocking()
     }
 }
 
-void Docking::PostOptimise()
+void Docking::AddDockingResult(const Position& position, const Position& rotation, int index, const Matrix& flexible)
 {
-    OptimiseBatch();
+    double frag_scaling = 1.2;
+    Molecule guest = m_guest_structure;
+    Molecule* molecule = new Molecule(m_host_structure);
 
-    CollectStructures();
+    Geometry destination;
+    if (flexible.rows() == m_guest_structure.AtomCount()) {
+        destination = flexible * EulerToQuaternion(rotation).toRotationMatrix().transpose();
+        destination.rowwise() += position.transpose();
+    } else
+        destination = GeometryTools::TranslateAndRotate(m_guest_structure.getGeometry(), m_guest_structure.Centroid(), position, rotation);
+    guest.setGeometry(destination);
+    double distance = GeometryTools::Distance(position, m_host_structure.Centroid());
+    m_sum_distance += distance;
+    m_docking_list.insert(std::pair<double, Vector>(distance, PositionPair2Vector(std::pair<Position, Position>(position, rotation))));
+    for (std::size_t i = 0; i < guest.AtomCount(); ++i) {
+        molecule->addPair(guest.Atom(i));
+    }
+    molecule->setEnergy(distance);
+    molecule->setCharge(m_charge);
+    molecule->setSpin(m_spin);
+    m_docking_result.insert(std::pair<double, Molecule*>(index, molecule));
+    if (molecule->GetFragments(frag_scaling).size() == 2)
+        m_reuse_anchor.push_back(position);
+}
+
+void Docking::BasinHopping()
+{
+    std::vector<BasinHoppingThread*> walkers;
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setActiveThreadCount(m_threads);
+    for (const Position& anchor : m_initial_anchor) {
+        for (int i = 0; i < m_bh_walkers; ++i) {
+            BasinHoppingThread* walker = new BasinHoppingThread(m_host_structure, m_guest_structure, m_current_cycle * m_initial_anchor.size() * m_bh_walkers + walkers.size());
+            walker->setPoseIndex(&m_pose_index, m_centroid_max_distance);
+            walker->setParameter(m_bh_steps, m_bh_patience, m_bh_temperature, m_bh_translation, m_bh_rotation, m_bh_seed);
+            walker->setAnchor(anchor);
+            walker->setTorsions(m_torsions, m_clash_scaling);
+            pool->addThread(walker);
+            walkers.push_back(walker);
+        }
+    }
+    pool->setProgressBar(CxxThreadPool::ProgressBarType::Continously);
+    pool->DynamicPool();
+    pool->StartAndWait();
+
+    int minimisations = 0, minima = 0;
+    for (const auto* walker : walkers) {
+        minimisations += walker->Minimisations();
+        for (const auto& pose : walker->Minima()) {
+            AddDockingResult(pose.position, QuaternionToEuler(pose.orientation), m_docking_result.size() + 1, pose.guest);
+            minima++;
+        }
+    }
+    std::cout << "** Basin hopping: " << walkers.size() << " walkers, " << minimisations << " local optimisations, " << minima << " distinct minima **" << std::endl;
+
+    pool->clear();
+    delete pool;
+    for (auto* walker : walkers)
+        delete walker;
+}
+
+void Docking::PostOptimise()
+{
+    CollectStructures(OptimiseBatch());
 
     if (!m_PostFilter)
         return;
@@ -322,9 +384,11 @@ void Docking::PostOptimise()
     FilterStructures();
 }
 
-void Docking::OptimiseBatch()
+std::vector<Molecule> Docking::OptimiseBatch()
 {
     double frag_scaling = 1.5;
+    if (ScreeningFunnel::Stages(m_funnel).size())
+        return OptimiseFunnel();
     /*
         json GFNFF = CurcumaOptJson;
         GFNFF["printOutput"] = false;
@@ -411,16 +475,30 @@ void Docking::OptimiseBatch()
 
     m_optimise->UpdateController(GFN2);
     m_optimise->start();
+    return *m_optimise->Molecules();
 }
 
-void Docking::CollectStructures()
+std::vector<Molecule> Docking::OptimiseFunnel()
+{
+    ScreeningFunnel funnel(m_funnel, m_threads, m_charge, m_spin);
+    funnel.setBasename("Docking_Funnel");
+
+    std::vector<Molecule> molecules;
+    for (const auto& pair : m_docking_result)
+        molecules.push_back(*pair.second);
+
+    std::cout << "** Screening funnel with " << funnel.StageCount() << " stages for " << molecules.size() << " structures **" << std::endl;
+    return funnel.Run(molecules);
+}
+
+void Docking::CollectStructures(const std::vector<Molecule>& molecules)
 {
     double frag_scaling = 1.5;
     const std::string name = "Final_Result.xyz";
     const std::string excluded = "Excluded_Result.xyz";
     int added = 0, dropped = 0;
 
-    for (const auto& m : *(m_optimise->Molecules())) {
+    for (const auto& m : molecules) {
         m.GetFragments(frag_scaling).size();
         if (m.GetFragments(frag_scaling).size() == 2) {
             double sum = 0;
@@ -31,14 +31,99 @@
 
 #include "external/CxxThreadPool/include/CxxThreadPool.h"
 
+#include <cmath>
 #include <map>
+#include <mutex>
+#include <random>
 #include <thread>
+#include <unordered_map>
 
 #include "json.hpp"
 using json = nlohmann::json;
 
 #include "curcumamethod.h"
 
+/*! \brief Thread-safe index of accepted docking poses
+ *
+ * Poses are stored as guest centroid and unit quaternion. Candidates are only compared against
+ * poses in the neighbouring cells of a uniform grid over the centroids (cell edge = centroid
+ * tolerance), the orientation is compared by the geodesic rotation angle 2 acos(|q1.q2|), so q and
+ * -q are the same orientation. A pose is a duplicate if both centroid and rotation are within the
+ * tolerances and, for flexible guests, every torsion angle is within the torsion tolerance (periodic).
+ */
+class DockingPoseIndex {
+public:
+    inline DockingPoseIndex(double centroid_tolerance = 1e-1, double rotation_tolerance = 1e-1)
+    {
+        setTolerances(centroid_tolerance, rotation_tolerance);
+    }
+
+    /*! \brief rotation tolerance in degree */
+    inline void setTolerances(double centroid_tolerance, double rotation_tolerance)
+    {
+        m_centroid_tolerance = std::max(centroid_tolerance, 1e-6);
+        m_cos_half = cos(std::min(180.0, std::max(0.0, rotation_tolerance)) * pi / 360.0);
+    }
+
+    /*! \brief torsion tolerance in degree */
+    inline void setTorsionTolerance(double torsion_tolerance) { m_torsion_tolerance = std::max(0.0, torsion_tolerance) * pi / 180.0; }
+
+    /*! \brief Add the pose unless an equivalent one is already stored, returns true if it was added
+     * torsions are the dihedral angles (rad) of a flexible guest, empty for rigid docking */
+    inline bool Insert(const Position& centroid, const Eigen::Quaterniond& orientation, const Vector& torsions = Vector())
+    {
+        const Eigen::Quaterniond q = orientation.normalized();
+        const long long cx = Cell(centroid(0)), cy = Cell(centroid(1)), cz = Cell(centroid(2));
+        const double tolerance2 = m_centroid_tolerance * m_centroid_tolerance;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (long long x = cx - 1; x <= cx + 1; ++x)
+            for (long long y = cy - 1; y <= cy + 1; ++y)
+                for (long long z = cz - 1; z <= cz + 1; ++z) {
+                    auto cell = m_grid.find(Key(x, y, z));
+                    if (cell == m_grid.end())
+                        continue;
+                    for (int index : cell->second) {
+                        if ((m_centroids[index] - centroid).squaredNorm() < tolerance2 && std::abs(m_orientations[index].dot(q)) > m_cos_half && SameTorsions(m_torsions[index], torsions))
+                            return false;
+                    }
+                }
+        m_grid[Key(cx, cy, cz)].push_back(m_centroids.size());
+        m_centroids.push_back(centroid);
+        m_orientations.push_back(q);
+        m_torsions.push_back(torsions);
+        return true;
+    }
+
+    inline int Size() const { return m_centroids.size(); }
+
+private:
+    inline bool SameTorsions(const Vector& first, const Vector& second) const
+    {
+        if (first.size() != second.size())
+            return false;
+        for (int k = 0; k < first.size(); ++k) {
+            const double difference = std::fmod(std::abs(first(k) - second(k)), 2 * pi);
+            if (std::min(difference, 2 * pi - difference) > m_torsion_tolerance)
+                return false;
+        }
+        return true;
+    }
+
+    inline long long Cell(double value) const { return std::floor(value / m_centroid_tolerance); }
+    inline static long long Key(long long x, long long y, long long z)
+    {
+        return ((x & 0x1FFFFF) << 42) | ((y & 0x1FFFFF) << 21) | (z & 0x1FFFFF);
+    }
+
+    std::unordered_map<long long, std::vector<int>> m_grid;
+    std::vector<Position> m_centroids;
+    std::vector<Eigen::Quaterniond> m_orientations;
+    std::vector<Vector> m_torsions;
+    double m_centroid_tolerance = 1e-1, m_cos_half = 1, m_torsion_tolerance = pi / 18.0;
+    std::mutex m_mutex;
+};
+
 class DockThread : public CxxThread {
 public:
     inline DockThread(const Molecule& host, const Molecule& guest)
@@ -51,11 +136,32 @@ public:
     inline void setPosition(const Position& position) { m_position = position; }
     inline void setRotation(const Position& rotation) { m_rotation = rotation; }
 
+    /*! \brief Register the result in index as soon as the optimisation finished, poses that moved further than max_distance are not added */
+    inline void setPoseIndex(DockingPoseIndex* index, double max_distance)
+    {
+        m_index = index;
+        m_max_distance = max_distance;
+    }
+
+    /*! \brief Optimise the guest torsions together with the pose */
+    inline void setTorsions(const std::vector<DockingTorsion>& torsions, double clash_scaling)
+    {
+        m_torsions = torsions;
+        m_clash_scaling = clash_scaling;
+    }
+
     inline int execute() override
     {
-        std::pair<Position, Position> pair = OptimiseAnchor(&m_host, m_guest, m_position, m_rotation);
-        m_last_position = pair.first;
-        m_last_rotation = pair.second;
+        RigidDockingOptimiser optimiser(&m_host, m_guest);
+        if (m_torsions.size())
+            optimiser.setTorsions(m_torsions, m_clash_scaling);
+        RigidDockingPose pose = optimiser.Optimise(m_position, EulerToQuaternion(m_rotation));
+        m_last_guest = pose.guest;
+        m_last_position = pose.position;
+        m_last_orientation = pose.orientation;
+        m_last_rotation = QuaternionToEuler(pose.orientation);
+        m_escaped = GeometryTools::Distance(m_position, m_last_position) > m_max_distance;
+        m_unique = !m_escaped && (m_index == nullptr || m_index->Insert(m_last_position, m_last_orientation, optimiser.Torsions() ? optimiser.TorsionAngles(pose.guest) : Vector()));
         return 0;
     }
 
@@ -63,12 +169,132 @@ public:
     inline Position InitialRotation() const { return m_rotation; }
     inline Position LastPosition() const { return m_last_position; }
     inline Position LastRotation() const { return m_last_rotation; }
+    inline Eigen::Quaterniond LastOrientation() const { return m_last_orientation; }
+    /*! \brief Flexible guest coordinates relative to LastPosition (before rotation), empty for rigid docking */
+    inline const Matrix& LastGuest() const { return m_last_guest; }
+    inline bool Escaped() const { return m_escaped; }
+    inline bool Unique() const { return m_unique; }
 
 private:
+    DockingPoseIndex* m_index = nullptr;
+    double m_max_distance = 1e5;
+    bool m_escaped = false, m_unique = true;
     Position m_position, m_rotation, m_last_position, m_last_rotation;
+    Eigen::Quaterniond m_last_orientation = Eigen::Quaterniond::Identity();
+    Matrix m_last_guest;
+    std::vector<DockingTorsion> m_torsions;
+    double m_clash_scaling = 0.75;
     Molecule m_host, m_guest;
 };
 
+/*! \brief Basin-hopping walker over the rigid guest pose
+ *
+ * Every step perturbs the current local minimum (random translation and rotation about a random
+ * axis), minimises the pose with the analytic LM optimiser and accepts it by the Metropolis
+ * criterion on the pseudo-LJ score. Step sizes adapt towards 50 % acceptance. Each walker owns its
+ * RNG stream (seed + walker index) and stops after patience steps without a new distinct minimum.
+ */
+class BasinHoppingThread : public CxxThread {
+public:
+    inline BasinHoppingThread(const Molecule& host, const Molecule& guest, int walker)
+        : m_optimiser(&host, guest)
+        , m_walker(walker)
+    {
+        setAutoDelete(false);
+    }
+
+    inline void setPoseIndex(DockingPoseIndex* index, double max_distance)
+    {
+        m_index = index;
+        m_max_distance = max_distance;
+    }
+
+    inline void setParameter(int steps, int patience, double temperature, double translation, double rotation, unsigned long long seed)
+    {
+        m_steps = steps;
+        m_patience = patience;
+        m_temperature = std::max(temperature, 1e-12);
+        m_translation = translation;
+        m_rotation = rotation * pi / 180.0;
+        m_seed = seed;
+    }
+
+    inline void setAnchor(const Position& anchor) { m_anchor = anchor; }
+
+    /*! \brief Optimise the guest torsions too, every step additionally kicks one random torsion */
+    inline void setTorsions(const std::vector<DockingTorsion>& torsions, double clash_scaling)
+    {
+        if (torsions.size())
+            m_optimiser.setTorsions(torsions, clash_scaling);
+    }
+
+    inline int execute() override
+    {
+        std::mt19937_64 rng(m_seed + 0x9E3779B97F4A7C15ULL * (m_walker + 1));
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::normal_distribution<double> normal(0.0, 1.0);
+        auto random_axis = [&]() {
+            Eigen::Vector3d axis(normal(rng), normal(rng), normal(rng));
+            return Eigen::Vector3d(axis.normalized());
+        };
+
+        Eigen::Quaterniond start(Eigen::AngleAxisd(2 * pi * uniform(rng), random_axis()));
+        RigidDockingPose current = m_optimiser.Optimise(m_anchor, start);
+        m_minimisations = 1;
+        Register(current);
+
+        int accepted = 0, stagnant = 0;
+        for (int step = 1; step <= m_steps && stagnant < m_patience; ++step) {
+            const Position position = current.position + m_translation * uniform(rng) * random_axis();
+            const Eigen::Quaterniond orientation = (Eigen::Quaterniond(Eigen::AngleAxisd(m_rotation * (2 * uniform(rng) - 1), random_axis())) * current.orientation).normalized();
+
+            Matrix conformation = current.guest;
+            if (m_optimiser.Torsions())
+                m_optimiser.RotateTorsion(conformation, std::min(int(uniform(rng) * m_optimiser.Torsions()), m_optimiser.Torsions() - 1), m_rotation * (2 * uniform(rng) - 1));
+
+            RigidDockingPose trial = m_optimiser.Optimise(position, orientation, m_optimiser.Torsions() ? &conformation : nullptr);
+            m_minimisations++;
+            stagnant = Register(trial) ? 0 : stagnant + 1;
+
+            const bool inside = GeometryTools::Distance(m_anchor, trial.position) <= m_max_distance;
+            if (inside && (trial.score <= current.score || uniform(rng) < exp(-(trial.score - current.score) / m_temperature))) {
+                current = trial;
+                accepted++;
+            }
+            if (step % 10 == 0) {
+                const double scale = accepted > 5 ? 1.1 : 0.9;
+                m_translation *= scale;
+                m_rotation = std::min(pi, m_rotation * scale);
+                accepted = 0;
+            }
+        }
+        return 0;
+    }
+
+    inline const std::vector<RigidDockingPose>& Minima() const { return m_minima; }
+    inline int Minimisations() const { return m_minimisations; }
+    inline Position Anchor() const { return m_anchor; }
+
+private:
+    inline bool Register(const RigidDockingPose& pose)
+    {
+        if (GeometryTools::Distance(m_anchor, pose.position) > m_max_distance)
+            return false;
+        if (m_index && !m_index->Insert(pose.position, pose.orientation, m_optimiser.Torsions() ? m_optimiser.TorsionAngles(pose.guest) : Vector()))
+            return false;
+        m_minima.push_back(pose);
+        return true;
+    }
+
+    RigidDockingOptimiser m_optimiser;
+    DockingPoseIndex* m_index = nullptr;
+    std::vector<RigidDockingPose> m_minima;
+    Position m_anchor{ 0, 0, 0 };
+    double m_max_distance = 1e5, m_temperature = 1, m_translation = 1, m_rotation = 0.5;
+    unsigned long long m_seed = 42;
+    int m_walker = 0, m_steps = 200, m_patience = 50, m_minimisations = 0;
+};
+
 static const json DockingJson = {
     { "Pos_X", 0.0 },
     { "Pos_Y", 0.0 },
@@ -87,14 +313,27 @@ static const json DockingJson = {
     { "CentroidMaxDistance", 1e5 },
     { "CentroidTolDis", 1e-1 },
     { "RotationTolDis", 1e-1 },
+    { "TorsionTolDis", 10.0 },
     { "Threads", 1 },
     { "DockingThreads", 1 },
     { "Charge", 0 },
+    { "Spin", 0 },
     { "Cycles", 1 },
     { "RMSDMethod", "hybrid" },
     { "RMSDThreads", 1 },
     { "RMSDElement", 7 },
-    { "EnergyThreshold", 200 }
+    { "EnergyThreshold", 200 },
+    { "Sampler", "grid" },
+    { "BHWalkers", 4 },
+    { "BHSteps", 200 },
+    { "BHPatience", 50 },
+    { "BHTemperature", 1.0 },
+    { "BHTranslation", 1.0 },
+    { "BHRotation", 30.0 },
+    { "BHSeed", 42 },
+    { "Funnel", "none" },
+    { "Flexible", false },
+    { "ClashScaling", 0.75 }
 };
 
 class Docking : public CurcumaMethod {
@@ -106,8 +345,13 @@ public:
 
     void PerformDocking();
 
-    void OptimiseBatch();
-    void CollectStructures();
+    /*! \brief Basin-hopping sampling of the guest pose around all anchors, replaces the Euler grid */
+    void BasinHopping();
+
+    std::vector<Molecule> OptimiseBatch();
+    /*! \brief Staged screening of all docking results (see ScreeningFunnel), used if Funnel is set */
+    std::vector<Molecule> OptimiseFunnel();
+    void CollectStructures(const std::vector<Molecule>& molecules);
     void FilterStructures();
 
     void PostOptimise();
@@ -133,12 +377,16 @@ private:
     /* Lets have all methods read the input/control file */
     void ReadControlFile() override {}
 
+    /* Build the complex for an accepted pose and store it for the post optimisation, flexible holds the guest coordinates of a flexible pose */
+    void AddDockingResult(const Position& position, const Position& rotation, int index, const Matrix& flexible = Matrix());
+
     Molecule m_host_structure, m_guest_structure, m_supramol;
     std::vector<Position> m_initial_anchor = { Position{ 0, 0, 0 } };
     int m_step_X = 1, m_step_Y = 1, m_step_Z = 1;
     std::map<double, Vector> m_docking_list;
     std::vector<std::pair<Position, Position>> m_initial_list;
-    std::vector<Position> m_anchor_accepted, m_rotation_accepted, m_reuse_anchor;
+    std::vector<Position> m_reuse_anchor;
+    DockingPoseIndex m_pose_index;
     std::vector<double> m_fragments_mass;
     bool m_check = false;
     bool m_PostFilter = true, m_PostOptimise = true, m_AutoPos = true, m_NoOpt = false;
@@ -148,16 +396,25 @@ private:
     double m_centroid_max_distance = 1e5;
     double m_centroid_tol_distance = 1e-1;
     double m_centroid_rot_distance = 1e-1;
+    double m_torsion_tol_distance = 10;
     double m_energy_threshold = 200;
     int m_threads = 1;
     int m_docking_threads = 1;
     int m_charge = 0;
+    int m_spin = 0;
     int m_current_cycle = 0;
     int m_cycles = 1;
     int m_RMSDthreads = 1;
     int m_RMSDElement = 7;
     StringList m_files;
-    std::string m_host, m_guest, m_complex, m_RMSDmethod;
+    std::string m_host, m_guest, m_complex, m_RMSDmethod, m_sampler = "grid";
+    json m_funnel = "none";
+    std::vector<DockingTorsion> m_torsions;
+    double m_clash_scaling = 0.75;
+    bool m_flexible = false;
+    int m_bh_walkers = 4, m_bh_steps = 200, m_bh_patience = 50;
+    double m_bh_temperature = 1, m_bh_translation = 1, m_bh_rotation = 30;
+    unsigned long long m_bh_seed = 42;
     CurcumaOpt *m_optimise, *m_singlepoint;
     std::map<double, Molecule*> m_docking_result, m_optimisation_result, m_result_list, m_final_results, m_temp_results;
 };
@@ -0,0 +1,364 @@
+/*
+ * <Free energy ranking of conformer ensembles. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+
+#include <Eigen/Dense>
+
+#include "src/core/elements.h"
+#include "src/core/fileiterator.h"
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
+#include "ensemblethermo.h"
+
+namespace ThermoConstants {
+const double h = 6.62607015e-34; // J s
+const double k = 1.380649e-23; // J/K
+const double c = 2.99792458e10; // cm/s
+const double NA = 6.02214076e23;
+const double Eh = 4.3597447222071e-18; // J
+const double EhMol = Eh * NA; // J/mol
+const double amu = 1.66053906660e-27; // kg
+const double angstrom = 1e-10; // m
+const double p = 101325; // Pa
+const double Bav = 1e-44; // kg m^2, average moment of inertia of the free rotor model
+}
+
+EnsembleThermoThread::EnsembleThermoThread(const std::string& method, const json& controller)
+{
+    setAutoDelete(false);
+    m_calculator = new EnergyCalculator(method, controller);
+}
+
+EnsembleThermoThread::~EnsembleThermoThread()
+{
+    delete m_calculator;
+}
+
+int EnsembleThermoThread::execute()
+{
+    for (int index : m_indices) {
+        EnsembleThermoEntry& entry = m_entries->at(index);
+        /* conformers share the topology, the calculator is set up once and only the geometry changes */
+        if (!m_initialised) {
+            m_calculator->setMolecule(entry.molecule);
+            m_initialised = true;
+        }
+        if (m_hessian) {
+            const Matrix hessian = Hessian(entry.molecule);
+            entry.frequencies = EnsembleThermo::Frequencies(entry.molecule, hessian, entry.imaginary);
+            entry.thermo = true;
+        } else {
+            m_calculator->updateGeometry(entry.molecule.getGeometry());
+            entry.energy = m_calculator->CalculateEnergy(false, false);
+        }
+    }
+    return 0;
+}
+
+Matrix EnsembleThermoThread::Hessian(const Molecule& molecule)
+{
+    const Matrix geometry = molecule.getGeometry();
+    const int atoms = geometry.rows();
+    const double unit = m_calculator->GradientUnit();
+    Matrix hessian = Matrix::Zero(3 * atoms, 3 * atoms);
+    for (int i = 0; i < atoms; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            Matrix displaced = geometry;
+            displaced(i, k) += m_step;
+            m_calculator->updateGeometry(displaced);
+            m_calculator->CalculateEnergy(true, false);
+            const Matrix plus = m_calculator->Gradient();
+
+            displaced(i, k) -= 2 * m_step;
+            m_calculator->updateGeometry(displaced);
+            m_calculator->CalculateEnergy(true, false);
+            const Matrix minus = m_calculator->Gradient();
+
+            for (int j = 0; j < atoms; ++j)
+                for (int l = 0; l < 3; ++l)
+                    hessian(3 * i + k, 3 * j + l) = (plus(j, l) - minus(j, l)) / (2 * m_step) * unit;
+        }
+    }
+    return (hessian + hessian.transpose()) / 2.0;
+}
+
+EnsembleThermo::EnsembleThermo(const json& controller, bool silent)
+    : CurcumaMethod(EnsembleThermoJson, controller, silent)
+{
+    UpdateController(controller);
+}
+
+void EnsembleThermo::LoadControlJson()
+{
+    m_method = Json2KeyWord<std::string>(m_defaults, "method");
+    m_threads = Json2KeyWord<int>(m_defaults, "threads");
+    m_window = Json2KeyWord<double>(m_defaults, "window");
+    m_T = Json2KeyWord<double>(m_defaults, "T");
+    m_freq_cutoff = Json2KeyWord<double>(m_defaults, "freq_cutoff");
+    m_freq_scale = Json2KeyWord<double>(m_defaults, "freq_scale");
+    m_symmetry = Json2KeyWord<int>(m_defaults, "symmetry");
+    m_step = Json2KeyWord<double>(m_defaults, "step");
+    m_singlepoint = Json2KeyWord<bool>(m_defaults, "singlepoint");
+}
+
+void EnsembleThermo::start()
+{
+    FileIterator file(m_filename, true);
+    bool energies = false;
+    while (!file.AtEnd()) {
+        EnsembleThermoEntry entry;
+        entry.molecule = file.Next();
+        entry.energy = entry.molecule.Energy();
+        energies = energies || std::abs(entry.energy) > 1e-8;
+        m_entries.push_back(entry);
+    }
+    if (m_entries.empty())
+        return;
+
+    for (int i = 0; i < std::max(1, m_threads); ++i)
+        m_workers.push_back(new EnsembleThermoThread(m_method, m_defaults));
+
+    std::vector<int> all(m_entries.size());
+    for (std::size_t i = 0; i < all.size(); ++i)
+        all[i] = i;
+    if (m_singlepoint || !energies) {
+        std::cout << "Calculating single point energies of " << m_entries.size() << " structures with " << m_method << std::endl;
+        RunWorkers(all, false);
+    }
+
+    /* the energy window is applied before any Hessian is calculated */
+    double lowest = m_entries[0].energy;
+    for (const auto& entry : m_entries)
+        lowest = std::min(lowest, entry.energy);
+    std::vector<int> window;
+    for (std::size_t i = 0; i < m_entries.size(); ++i)
+        if ((m_entries[i].energy - lowest) * 2625.5 <= m_window)
+            window.push_back(i);
+    std::cout << window.size() << " of " << m_entries.size() << " structures within " << m_window << " kJ/mol, calculating frequencies with " << m_method << std::endl;
+
+    for (auto* worker : m_workers)
+        worker->setStep(m_step);
+    RunWorkers(window, true);
+
+    for (int index : window) {
+        for (double& frequency : m_entries[index].frequencies)
+            frequency *= m_freq_scale;
+        Thermo(m_entries[index], m_T, m_freq_cutoff, m_symmetry);
+    }
+    Populations();
+    PrintResults();
+
+    for (auto* worker : m_workers)
+        delete worker;
+    m_workers.clear();
+}
+
+void EnsembleThermo::RunWorkers(const std::vector<int>& indices, bool hessian)
+{
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setProgressBar(m_silent ? CxxThreadPool::ProgressBarType::None : CxxThreadPool::ProgressBarType::Continously);
+    pool->setActiveThreadCount(m_workers.size());
+    for (auto* worker : m_workers) {
+        worker->clear();
+        worker->setEntries(&m_entries, hessian);
+        pool->addThread(worker);
+    }
+    for (std::size_t i = 0; i < indices.size(); ++i)
+        m_workers[i % m_workers.size()]->addEntry(indices[i]);
+    pool->StaticPool();
+    pool->StartAndWait();
+    pool->clear();
+    delete pool;
+}
+
+std::vector<double> EnsembleThermo::Frequencies(const Molecule& molecule, const Matrix& hessian, int& imaginary)
+{
+    const int atoms = molecule.AtomCount();
+    const int dim = 3 * atoms;
+    const Matrix geometry = molecule.getGeometry();
+
+    Vector sqrtmass(dim);
+    Eigen::RowVector3d com = Eigen::RowVector3d::Zero();
+    double total = 0;
+    for (int i = 0; i < atoms; ++i) {
+        const double mass = Elements::AtomicMass[molecule.Atom(i).first];
+        sqrtmass.segment(3 * i, 3).setConstant(std::sqrt(mass));
+        com += mass * geometry.row(i);
+        total += mass;
+    }
+    com /= total;
+
+    /* translations and rotations in mass-weighted coordinates */
+    Matrix D = Matrix::Zero(dim, 6);
+    for (int i = 0; i < atoms; ++i) {
+        const Eigen::Vector3d r = (geometry.row(i) - com).transpose();
+        for (int k = 0; k < 3; ++k) {
+            D(3 * i + k, k) = sqrtmass(3 * i);
+            const Eigen::Vector3d rotation = Eigen::Vector3d::Unit(k).cross(r) * sqrtmass(3 * i);
+            D.block(3 * i, 3 + k, 3, 1) = rotation;
+        }
+    }
+    Eigen::ColPivHouseholderQR<Matrix> qr(D);
+    qr.setThreshold(1e-6);
+    const int rank = qr.rank();
+    const Matrix Q = Matrix(qr.householderQ()).leftCols(rank);
+    const Matrix P = Matrix::Identity(dim, dim) - Q * Q.transpose();
+
+    const Matrix weighted = sqrtmass.cwiseInverse().asDiagonal() * hessian * sqrtmass.cwiseInverse().asDiagonal();
+    Eigen::SelfAdjointEigenSolver<Matrix> solver(P * weighted * P);
+
+    /* sqrt(Eh / (Angstrom^2 amu)) in s^-1, divided by 2 pi c */
+    const double conversion = std::sqrt(ThermoConstants::Eh / (ThermoConstants::angstrom * ThermoConstants::angstrom * ThermoConstants::amu)) / (2 * pi * ThermoConstants::c);
+
+    std::vector<double> frequencies;
+    imaginary = 0;
+    for (int i = 0; i < dim; ++i) {
+        /* skip the projected translations and rotations */
+        if ((Q.transpose() * solver.eigenvectors().col(i)).squaredNorm() > 0.5)
+            continue;
+        const double value = solver.eigenvalues()(i);
+        if (value < 0) {
+            imaginary++;
+            frequencies.push_back(-std::sqrt(-value) * conversion);
+        } else
+            frequencies.push_back(std::sqrt(value) * conversion);
+    }
+    return frequencies;
+}
+
+void EnsembleThermo::Thermo(EnsembleThermoEntry& entry, double T, double cutoff, int symmetry)
+{
+    using namespace ThermoConstants;
+    const double kT = k * T;
+    double zpe = 0, hvib = 0, svib = 0;
+    for (double frequency : entry.frequencies) {
+        /* imaginary and near zero modes do not contribute */
+        if (frequency < 1)
+            continue;
+        const double nu = frequency * c;
+        const double x = h * nu / kT;
+        zpe += 0.5 * h * nu * NA;
+        hvib += h * nu * NA / std::expm1(x);
+        const double harmonic = R * (x / std::expm1(x) - std::log1p(-std::exp(-x)));
+
+        const double mu = h / (8 * pi * pi * nu);
+        const double reduced = mu * Bav / (mu + Bav);
+        const double rotor = R * (0.5 + std::log(std::sqrt(8 * pi * pi * pi * reduced * kT / (h * h))));
+
+        const double weight = 1.0 / (1.0 + std::pow(cutoff / frequency, 4));
+        svib += weight * harmonic + (1 - weight) * rotor;
+    }
+
+    const Matrix geometry = entry.molecule.getGeometry();
+    double mass = 0;
+    Eigen::RowVector3d com = Eigen::RowVector3d::Zero();
+    for (int i = 0; i < geometry.rows(); ++i) {
+        const double m = Elements::AtomicMass[entry.molecule.Atom(i).first];
+        mass += m;
+        com += m * geometry.row(i);
+    }
+    com /= mass;
+
+    const double htrans = 2.5 * R * T;
+    const double strans = R * (std::log(std::pow(2 * pi * mass * amu * kT / (h * h), 1.5) * kT / p) + 2.5);
+
+    Eigen::Matrix3d inertia = Eigen::Matrix3d::Zero();
+    for (int i = 0; i < geometry.rows(); ++i) {
+        const double m = Elements::AtomicMass[entry.molecule.Atom(i).first];
+        const Eigen::Vector3d r = (geometry.row(i) - com).transpose();
+        inertia += m * (r.squaredNorm() * Eigen::Matrix3d::Identity() - r * r.transpose());
+    }
+    const Eigen::Vector3d moments = Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d>(inertia).eigenvalues() * amu * angstrom * angstrom;
+    double hrot = 0, srot = 0;
+    if (geometry.rows() > 1) {
+        if (moments(0) < 1e-3 * amu * angstrom * angstrom) {
+            hrot = R * T;
+            srot = R * (std::log(8 * pi * pi * moments(2) * kT / (symmetry * h * h)) + 1);
+        } else {
+            hrot = 1.5 * R * T;
+            double q = std::sqrt(pi) / symmetry;
+            for (int i = 0; i < 3; ++i)
+                q *= std::sqrt(8 * pi * pi * moments(i) * kT / (h * h));
+            srot = R * (std::log(q) + 1.5);
+        }
+    }
+
+    entry.zpe = zpe / EhMol;
+    entry.enthalpy = entry.energy + (zpe + hvib + htrans + hrot) / EhMol;
+    entry.entropy = (svib + strans + srot) / EhMol;
+    entry.free_energy = entry.enthalpy - T * entry.entropy;
+}
+
+void EnsembleThermo::Populations()
+{
+    /* p_i = exp(-G_i/kT) / sum_j exp(-G_j/kT), evaluated as exp(a_i - logsumexp(a)) */
+    const double beta = 1 / (kb_Eh * m_T);
+    double max = -std::numeric_limits<double>::max();
+    for (const auto& entry : m_entries)
+        if (entry.thermo)
+            max = std::max(max, -beta * entry.free_energy);
+    double sum = 0;
+    for (const auto& entry : m_entries)
+        if (entry.thermo)
+            sum += std::exp(-beta * entry.free_energy - max);
+    const double lse = max + std::log(sum);
+
+    m_conformational_entropy = 0;
+    for (auto& entry : m_entries) {
+        entry.population = entry.thermo ? std::exp(-beta * entry.free_energy - lse) : 0;
+        if (entry.population > 0)
+            m_conformational_entropy -= R * entry.population * std::log(entry.population);
+    }
+    m_ensemble_free_energy = -lse / beta;
+}
+
+void EnsembleThermo::PrintResults() const
+{
+    std::vector<int> order;
+    for (std::size_t i = 0; i < m_entries.size(); ++i)
+        if (m_entries[i].thermo)
+            order.push_back(i);
+    std::sort(order.begin(), order.end(), [this](int a, int b) { return m_entries[a].free_energy < m_entries[b].free_energy; });
+
+    const double emin = m_entries[order[0]].energy;
+    double gmin = m_entries[order[0]].free_energy;
+    for (int index : order)
+        gmin = std::min(gmin, m_entries[index].free_energy);
+
+    std::ofstream output(Basename() + ".thermo.dat");
+    output << "# index E[Eh] ZPE[Eh] H[Eh] S[Eh/K] G[Eh] dE[kJ/mol] dG[kJ/mol] population imaginary" << std::endl;
+    printf("\n  #  |      E [Eh]     |    ZPE [Eh] |      G [Eh]      | dE [kJ/mol] | dG [kJ/mol] | pop. [%%] | imag\n");
+    for (int index : order) {
+        const auto& entry = m_entries[index];
+        const double dE = (entry.energy - emin) * 2625.5;
+        const double dG = (entry.free_energy - gmin) * 2625.5;
+        printf("%4i | %15.8f | %11.6f | %16.8f | %11.2f | %11.2f | %8.2f | %i\n", index + 1, entry.energy, entry.zpe, entry.free_energy, dE, dG, entry.population * 100, entry.imaginary);
+        output << index + 1 << " " << std::setprecision(10) << entry.energy << " " << entry.zpe << " " << entry.enthalpy << " " << entry.entropy << " " << entry.free_energy << " " << dE << " " << dG << " " << entry.population << " " << entry.imaginary << std::endl;
+    }
+    std::cout << std::endl
+              << "Ensemble free energy " << std::setprecision(10) << m_ensemble_free_energy << " Eh at " << m_T << " K" << std::endl;
+    std::cout << "Conformational entropy " << m_conformational_entropy << " J/(mol K) = " << -m_conformational_entropy * m_T / 1000 << " kJ/mol" << std::endl;
+}
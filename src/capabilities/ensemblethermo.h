@@ -0,0 +1,134 @@
+/*
+ * <Free energy ranking of conformer ensembles. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "src/core/energycalculator.h"
+#include "src/core/molecule.h"
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
+#include "curcumamethod.h"
+
+static const json EnsembleThermoJson{
+    { "method", "uff" },
+    { "threads", 1 },
+    { "window", 10.0 },
+    { "T", 298.15 },
+    { "freq_cutoff", 100.0 },
+    { "freq_scale", 1.0 },
+    { "symmetry", 1 },
+    { "step", 5e-3 },
+    { "singlepoint", false }
+};
+
+/*! \brief Thermochemistry of a single conformer, energies in Eh, entropy in Eh/K */
+struct EnsembleThermoEntry {
+    Molecule molecule;
+    std::vector<double> frequencies;
+    double energy = 0, zpe = 0, enthalpy = 0, entropy = 0, free_energy = 0, population = 0;
+    int imaginary = 0;
+    bool thermo = false;
+};
+
+/*! \brief Worker owning one EnergyCalculator, evaluates energies or semi-numerical Hessians for its conformers */
+class EnsembleThermoThread : public CxxThread {
+public:
+    EnsembleThermoThread(const std::string& method, const json& controller);
+    ~EnsembleThermoThread();
+
+    int execute() override;
+
+    inline void clear() { m_indices.clear(); }
+    inline void addEntry(int index) { m_indices.push_back(index); }
+
+    /*! \brief Entries to work on, with hessian = false only the energy is calculated */
+    void setEntries(std::vector<EnsembleThermoEntry>* entries, bool hessian)
+    {
+        m_entries = entries;
+        m_hessian = hessian;
+    }
+
+    /*! \brief Finite displacement of the semi-numerical Hessian in Angstrom */
+    void setStep(double step) { m_step = step; }
+
+private:
+    Matrix Hessian(const Molecule& molecule);
+
+    EnergyCalculator* m_calculator;
+    std::vector<EnsembleThermoEntry>* m_entries = nullptr;
+    std::vector<int> m_indices;
+    double m_step = 5e-3;
+    bool m_hessian = false, m_initialised = false;
+};
+
+class EnsembleThermo : public CurcumaMethod {
+public:
+    EnsembleThermo(const json& controller = EnsembleThermoJson, bool silent = true);
+
+    void setFileName(const std::string& filename)
+    {
+        m_filename = filename;
+        getBasename(filename);
+    }
+
+    void start() override;
+
+    /*! \brief Harmonic frequencies in cm^-1 from a cartesian Hessian in Eh/Angstrom^2, translation and rotation projected out */
+    static std::vector<double> Frequencies(const Molecule& molecule, const Matrix& hessian, int& imaginary);
+
+    /*! \brief RRHO thermochemistry with Grimme's free rotor interpolation of the vibrational entropy below cutoff (cm^-1) */
+    static void Thermo(EnsembleThermoEntry& entry, double T, double cutoff, int symmetry);
+
+    const std::vector<EnsembleThermoEntry>& Entries() const { return m_entries; }
+
+private:
+    /* Lets have this for all modules */
+    inline nlohmann::json WriteRestartInformation() override { return json(); }
+
+    /* Lets have this for all modules */
+    inline bool LoadRestartInformation() override { return true; }
+
+    inline StringList MethodName() const override { return { std::string("Thermo") }; }
+
+    /* Lets have all methods read the input/control file */
+    void ReadControlFile() override{};
+
+    /* Read Controller has to be implemented for all */
+    void LoadControlJson() override;
+
+    /* Distribute the given entries over the workers and run them */
+    void RunWorkers(const std::vector<int>& indices, bool hessian);
+
+    /* Boltzmann populations from the free energies, log-sum-exp for stability */
+    void Populations();
+
+    void PrintResults() const;
+
+    std::string m_filename, m_method = "uff";
+    std::vector<EnsembleThermoEntry> m_entries;
+    std::vector<EnsembleThermoThread*> m_workers;
+    double m_window = 10, m_T = 298.15, m_freq_cutoff = 100, m_freq_scale = 1, m_step = 5e-3;
+    double m_ensemble_free_energy = 0, m_conformational_entropy = 0;
+    int m_threads = 1, m_symmetry = 1;
+    bool m_singlepoint = false;
+};
@@ -0,0 +1,142 @@
+/*
+ * <Multi-level screening funnel for structure ensembles. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/capabilities/curcumaopt.h"
+#include "src/capabilities/rmsd.h"
+
+#include "src/core/global.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+#include "funnel.h"
+
+ScreeningFunnel::ScreeningFunnel(const json& stages, int threads, int charge, int spin)
+    : m_threads(threads)
+    , m_charge(charge)
+    , m_spin(spin)
+{
+    json list = Stages(stages);
+    for (const auto& stage : list)
+        m_stages.push_back(MergeJson(FunnelStageJson, stage));
+}
+
+json ScreeningFunnel::DefaultStages()
+{
+    return json::array({ { { "method", "uff" }, { "opt", false }, { "window", 400.0 } },
+        { { "method", "uff" }, { "opt", true }, { "dE", 1.0 }, { "GradNorm", 1e-3 }, { "window", 200.0 }, { "rmsd", 0.1 } },
+        { { "method", "gfnff" }, { "opt", true }, { "dE", 1.0 }, { "GradNorm", 1e-3 }, { "window", 100.0 }, { "rmsd", 0.25 } },
+        { { "method", "gfn2" }, { "opt", true }, { "window", 50.0 }, { "rmsd", 0.25 } } });
+}
+
+json ScreeningFunnel::Stages(const json& definition)
+{
+    if (definition.is_array())
+        return definition;
+    if (!definition.is_string())
+        return json::array();
+    const std::string name = definition.get<std::string>();
+    if (name.compare("none") == 0 || name.empty())
+        return json::array();
+    if (name.compare("default") == 0)
+        return DefaultStages();
+
+    json stages;
+    std::ifstream file(name);
+    try {
+        file >> stages;
+    } catch (json::parse_error& e) {
+        std::cerr << "Could not read funnel stages from " << name << ": " << e.what() << std::endl;
+        return json::array();
+    }
+    if (stages.is_object() && stages.contains("stages"))
+        stages = stages["stages"];
+    return stages.is_array() ? stages : json::array();
+}
+
+std::vector<Molecule> ScreeningFunnel::Run(const std::vector<Molecule>& molecules)
+{
+    std::vector<Molecule> survivors = molecules;
+    for (int i = 0; i < m_stages.size() && survivors.size(); ++i) {
+        const json& stage = m_stages[i];
+        std::cout << "** Funnel stage " << i + 1 << " of " << m_stages.size() << ": " << stage["method"].get<std::string>() << (stage["opt"].get<bool>() ? " optimisation" : " single point") << " of " << survivors.size() << " structures **" << std::endl;
+        std::vector<Molecule> result = RunStage(stage, i, survivors);
+        survivors = Prune(stage, result);
+        std::cout << "** " << survivors.size() << " of " << result.size() << " structures within " << stage["window"].get<double>() << " kJ/mol pass stage " << i + 1 << " **" << std::endl;
+    }
+    return survivors;
+}
+
+std::vector<Molecule> ScreeningFunnel::RunStage(const json& stage, int index, const std::vector<Molecule>& molecules)
+{
+    const std::string method = stage["method"];
+    json opt = CurcumaOptJson;
+    opt["method"] = method;
+    opt["SinglePoint"] = !stage["opt"].get<bool>();
+    opt["dE"] = stage["dE"];
+    opt["GradNorm"] = stage["GradNorm"];
+    opt["ConvCount"] = stage["ConvCount"];
+    opt["MaxIter"] = stage["MaxIter"];
+    /* xtb's GFN-FF is not thread-safe */
+    opt["Threads"] = method.compare("gfnff") == 0 ? 1 : m_threads;
+    opt["writeXYZ"] = false;
+    opt["printOutput"] = false;
+
+    CurcumaOpt optimise(opt, true);
+    optimise.overrideBasename(m_basename + "_stage" + std::to_string(index + 1));
+    /* CurcumaOpt only applies charge and spin to structures read from file */
+    for (Molecule molecule : molecules) {
+        molecule.setCharge(m_charge);
+        molecule.setSpin(m_spin);
+        optimise.addMolecule(molecule);
+    }
+    optimise.start();
+    return *optimise.Molecules();
+}
+
+std::vector<Molecule> ScreeningFunnel::Prune(const json& stage, std::vector<Molecule>& molecules) const
+{
+    const double window = stage["window"].get<double>() / 2625.5;
+    const double rmsd = stage["rmsd"].get<double>();
+
+    molecules.erase(std::remove_if(molecules.begin(), molecules.end(), [](const Molecule& m) { return std::isnan(m.Energy()) || std::isinf(m.Energy()); }), molecules.end());
+    std::stable_sort(molecules.begin(), molecules.end(), [](const Molecule& a, const Molecule& b) { return a.Energy() < b.Energy(); });
+
+    std::vector<Molecule> survivors;
+    if (molecules.empty())
+        return survivors;
+
+    const double best = molecules.front().Energy();
+    json control = RMSDJson;
+    control["reorder"] = false;
+    control["silent"] = true;
+    RMSDDriver driver(control, true);
+    for (const auto& molecule : molecules) {
+        if (molecule.Energy() - best > window)
+            break;
+        bool duplicate = false;
+        for (int i = 0; i < survivors.size() && rmsd > 0 && !duplicate; ++i)
+            duplicate = survivors[i].AtomCount() == molecule.AtomCount() && driver.CalculateRMSD(survivors[i], molecule) < rmsd;
+        if (!duplicate)
+            survivors.push_back(molecule);
+    }
+    return survivors;
+}
@@ -0,0 +1,72 @@
+/*
+ * <Multi-level screening funnel for structure ensembles. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "src/core/molecule.h"
+
+#include "json.hpp"
+using json = nlohmann::json;
+
+/* Defaults of a single funnel stage, window in kJ/mol relative to the best structure of the stage,
+ * rmsd = 0 disables the duplicate check */
+static const json FunnelStageJson{
+    { "method", "uff" },
+    { "opt", true },
+    { "dE", 0.1 },
+    { "GradNorm", 1e-4 },
+    { "ConvCount", 11 },
+    { "MaxIter", 5000 },
+    { "window", 100.0 },
+    { "rmsd", 0.0 }
+};
+
+/*! \brief Ordered list of increasingly expensive stages over an ensemble
+ *
+ * Every stage runs a single point or optimisation on all survivors in parallel (CurcumaOpt), then
+ * drops structures outside the energy window of the stage and, optionally, structures closer than
+ * the rmsd threshold to a lower lying survivor. Only the remaining structures reach the next stage.
+ */
+class ScreeningFunnel {
+public:
+    ScreeningFunnel(const json& stages, int threads = 1, int charge = 0, int spin = 0);
+
+    /*! \brief Stages from a json array, a json file or the keyword "default", "none" gives no stages */
+    static json Stages(const json& definition);
+
+    /*! \brief UFF single point, UFF opt, GFN-FF opt, GFN2 opt */
+    static json DefaultStages();
+
+    inline void setBasename(const std::string& basename) { m_basename = basename; }
+    inline int StageCount() const { return m_stages.size(); }
+
+    /*! \brief Run all stages, returns the survivors sorted by energy */
+    std::vector<Molecule> Run(const std::vector<Molecule>& molecules);
+
+private:
+    std::vector<Molecule> RunStage(const json& stage, int index, const std::vector<Molecule>& molecules);
+    std::vector<Molecule> Prune(const json& stage, std::vector<Molecule>& molecules) const;
+
+    std::vector<json> m_stages;
+    std::string m_basename = "funnel";
+    int m_threads = 1, m_charge = 0, m_spin = 0;
+};
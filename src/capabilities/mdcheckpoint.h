@@ -0,0 +1,234 @@
+/*
+ * <Binary checkpoints for molecular dynamics. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/* File layout: magic (8 bytes), version (uint32), payload, FNV-1a 64 checksum of everything before it.
+ * Numbers are stored as raw bytes of the machine, so checkpoints are exact but not portable between
+ * architectures of different endianness. */
+namespace MDCheckpoint {
+
+static const char Magic[8] = { 'C', 'U', 'R', 'C', 'M', 'D', 'C', 'K' };
+static const uint32_t Version = 1;
+
+inline uint64_t Checksum(const char* data, std::size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+class Writer {
+public:
+    Writer()
+    {
+        m_data.insert(m_data.end(), Magic, Magic + sizeof(Magic));
+        Put(Version);
+    }
+
+    template <typename T>
+    inline void Put(const T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values can be stored");
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        m_data.insert(m_data.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <typename T>
+    inline void Put(const std::vector<T>& values)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values can be stored");
+        Put(static_cast<uint64_t>(values.size()));
+        const char* bytes = reinterpret_cast<const char*>(values.data());
+        m_data.insert(m_data.end(), bytes, bytes + values.size() * sizeof(T));
+    }
+
+    /*! \brief Appends the checksum and hands out the buffer */
+    inline std::vector<char> Finish()
+    {
+        Put(Checksum(m_data.data(), m_data.size()));
+        return std::move(m_data);
+    }
+
+private:
+    std::vector<char> m_data;
+};
+
+class Reader {
+public:
+    /*! \brief Checks magic, version and checksum, Valid() is false otherwise */
+    explicit Reader(std::vector<char> data)
+        : m_data(std::move(data))
+    {
+        uint32_t version = 0;
+        uint64_t checksum = 0;
+        if (m_data.size() < sizeof(Magic) + sizeof(version) + sizeof(checksum) || std::memcmp(m_data.data(), Magic, sizeof(Magic)) != 0)
+            return;
+        const std::size_t end = m_data.size() - sizeof(checksum);
+        std::memcpy(&checksum, m_data.data() + end, sizeof(checksum));
+        if (checksum != Checksum(m_data.data(), end))
+            return;
+        m_position = sizeof(Magic);
+        m_end = end;
+        m_valid = Get(version) && version == Version;
+    }
+
+    inline bool Valid() const { return m_valid; }
+
+    template <typename T>
+    inline bool Get(T& value)
+    {
+        if (m_position + sizeof(T) > m_end)
+            return m_valid = false;
+        std::memcpy(&value, m_data.data() + m_position, sizeof(T));
+        m_position += sizeof(T);
+        return true;
+    }
+
+    template <typename T>
+    inline bool Get(std::vector<T>& values)
+    {
+        uint64_t size = 0;
+        if (!Get(size) || m_position + size * sizeof(T) > m_end)
+            return m_valid = false;
+        values.resize(size);
+        std::memcpy(values.data(), m_data.data() + m_position, size * sizeof(T));
+        m_position += size * sizeof(T);
+        return true;
+    }
+
+private:
+    std::vector<char> m_data;
+    std::size_t m_position = 0, m_end = 0;
+    bool m_valid = false;
+};
+
+inline std::vector<char> ReadFile(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+        return std::vector<char>();
+    return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/*! \brief Writes to filename.tmp and renames it, so an existing checkpoint is never left half written */
+inline bool WriteFile(const std::string& filename, const std::vector<char>& data)
+{
+    const std::string temporary = filename + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+            return false;
+        file.write(data.data(), data.size());
+        file.flush();
+        if (!file.good())
+            return false;
+    }
+#ifdef _WIN32
+    std::remove(filename.c_str());
+#endif
+    return std::rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+/*! \brief Background thread writing checkpoints, a new checkpoint replaces one that is still waiting */
+class AsyncWriter {
+public:
+    AsyncWriter()
+        : m_thread([this]() { Run(); })
+    {
+    }
+
+    ~AsyncWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_condition.notify_all();
+        m_thread.join();
+    }
+
+    inline void Write(const std::string& filename, std::vector<char> data)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_filename = filename;
+            m_pending = std::move(data);
+            m_waiting = true;
+        }
+        m_condition.notify_all();
+    }
+
+    /*! \brief Blocks until the queued checkpoint is on disk */
+    inline void Wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this]() { return !m_waiting && !m_busy; });
+    }
+
+    inline bool Failed() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_failed;
+    }
+
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_condition.wait(lock, [this]() { return m_waiting || m_quit; });
+            if (!m_waiting)
+                return;
+            std::vector<char> data = std::move(m_pending);
+            const std::string filename = m_filename;
+            m_waiting = false;
+            m_busy = true;
+            lock.unlock();
+            const bool written = WriteFile(filename, data);
+            lock.lock();
+            m_failed |= !written;
+            m_busy = false;
+            m_condition.notify_all();
+        }
+    }
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::vector<char> m_pending;
+    std::string m_filename;
+    bool m_waiting = false, m_busy = false, m_quit = false, m_failed = false;
+    std::thread m_thread;
+};
+}
@@ -0,0 +1,501 @@
+/*
+ * <Nudged elastic band and string method reaction paths. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include <fmt/core.h>
+
+#include "src/capabilities/optimiser/NEBAlignment.h"
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
+#include "neb.h"
+
+namespace {
+Matrix ToGeometry(const Vector& coordinates)
+{
+    const int atoms = coordinates.size() / 3;
+    Matrix geometry(atoms, 3);
+    for (int i = 0; i < atoms; ++i)
+        for (int k = 0; k < 3; ++k)
+            geometry(i, k) = coordinates(3 * i + k);
+    return geometry;
+}
+
+Vector ToCoordinates(const Matrix& geometry)
+{
+    Vector coordinates(3 * geometry.rows());
+    for (int i = 0; i < geometry.rows(); ++i)
+        for (int k = 0; k < 3; ++k)
+            coordinates(3 * i + k) = geometry(i, k);
+    return coordinates;
+}
+}
+
+NEBImageThread::NEBImageThread(const std::string& method, const json& controller, const Molecule& molecule)
+{
+    setAutoDelete(false);
+    m_calculator = new EnergyCalculator(method, controller);
+    m_calculator->setMolecule(molecule);
+}
+
+NEBImageThread::~NEBImageThread()
+{
+    delete m_calculator;
+}
+
+int NEBImageThread::execute()
+{
+    m_nan = false;
+    for (int index : m_indices) {
+        m_calculator->updateGeometry(ToGeometry(m_images->at(index)));
+        m_energies->at(index) = m_calculator->CalculateEnergy(true, false);
+        m_gradients->at(index) = ToCoordinates(m_calculator->Gradient()) * m_calculator->GradientUnit();
+        m_nan = m_nan || m_calculator->HasNan() || std::isnan(m_energies->at(index));
+    }
+    return 0;
+}
+
+NEB::NEB(const json& controller, bool silent)
+    : CurcumaMethod(NEBJson, controller, silent)
+{
+    UpdateController(controller);
+}
+
+NEB::~NEB()
+{
+    for (auto* worker : m_workers)
+        delete worker;
+}
+
+void NEB::LoadControlJson()
+{
+    m_method = Json2KeyWord<std::string>(m_defaults, "method");
+    m_threads = Json2KeyWord<int>(m_defaults, "threads");
+    m_charge = Json2KeyWord<int>(m_defaults, "Charge");
+    m_spin = Json2KeyWord<int>(m_defaults, "Spin");
+    m_image_count = std::max(1, Json2KeyWord<int>(m_defaults, "images"));
+    m_align = Json2KeyWord<bool>(m_defaults, "align");
+    m_interpolation = Json2KeyWord<std::string>(m_defaults, "interpolation");
+    m_idpp_iter = Json2KeyWord<int>(m_defaults, "idpp_iter");
+    m_idpp_fmax = Json2KeyWord<double>(m_defaults, "idpp_fmax");
+    m_spring = Json2KeyWord<double>(m_defaults, "spring");
+    m_climbing = Json2KeyWord<bool>(m_defaults, "climbing");
+    m_climb_threshold = Json2KeyWord<double>(m_defaults, "climb_threshold");
+    m_string = Json2KeyWord<bool>(m_defaults, "string");
+    m_optimiser = Json2KeyWord<std::string>(m_defaults, "optimiser");
+    m_maxiter = Json2KeyWord<int>(m_defaults, "MaxIter");
+    m_fmax = Json2KeyWord<double>(m_defaults, "fmax");
+    m_maxstep = Json2KeyWord<double>(m_defaults, "maxstep");
+    m_fire_dt = Json2KeyWord<double>(m_defaults, "fire_dt");
+    m_fire_dtmax = Json2KeyWord<double>(m_defaults, "fire_dtmax");
+    m_lbfgs_m = Json2KeyWord<int>(m_defaults, "lbfgs_m");
+}
+
+bool NEB::Initialise()
+{
+    if (m_first.AtomCount() == 0 || m_first.AtomCount() != m_second.AtomCount()) {
+        AppendError("NEB needs two structures with the same number of atoms.");
+        return false;
+    }
+    for (int i = 0; i < m_first.AtomCount(); ++i) {
+        if (m_first.Atom(i).first != m_second.Atom(i).first) {
+            AppendError("Atom order of the two structures differs, please prepare them with -nebprep first.");
+            return false;
+        }
+    }
+    m_first.setCharge(m_charge);
+    m_first.setSpin(m_spin);
+    m_second.setCharge(m_charge);
+    m_second.setSpin(m_spin);
+
+    if (m_align) {
+        auto aligned = AlignNEBEndpoints(m_first, m_second);
+        m_first.setGeometry(aligned.first.getGeometry());
+        m_second.setGeometry(aligned.second.getGeometry());
+    }
+
+    const Vector first = ToCoordinates(m_first.getGeometry());
+    const Vector second = ToCoordinates(m_second.getGeometry());
+    m_images = LinearPath(first, second, m_image_count);
+
+    /* end points are evaluated once with the first batch of images */
+    m_energies = std::vector<double>(m_images.size(), 0);
+    m_energies.front() = m_energies.back() = std::numeric_limits<double>::quiet_NaN();
+    return true;
+}
+
+std::vector<Vector> NEB::LinearPath(const Vector& first, const Vector& second, int images)
+{
+    std::vector<Vector> path;
+    for (int i = 0; i <= images + 1; ++i)
+        path.push_back(first + (second - first) * double(i) / double(images + 1));
+    return path;
+}
+
+void NEB::start()
+{
+    if (m_images.empty() && !Initialise())
+        return;
+
+    if (m_interpolation.compare("idpp") == 0) {
+        std::cout << "** IDPP interpolation of " << m_image_count << " images **" << std::endl;
+        IDPP();
+    }
+
+    const int threads = std::max(1, std::min(m_threads, m_image_count));
+    for (int i = 0; i < threads; ++i)
+        m_workers.push_back(new NEBImageThread(m_method, m_defaults, m_first));
+
+    std::cout << "** " << (m_string ? "String method" : "Nudged elastic band") << " with " << m_image_count << " images at " << m_method << " level, " << threads << " thread(s) **" << std::endl;
+
+    auto evaluate = [this](const std::vector<Vector>& images, std::vector<double>& energies, std::vector<Vector>& gradients) {
+        return EvaluateImages(images, energies, gradients);
+    };
+    m_converged = OptimiseBand(evaluate, m_maxiter, m_fmax, m_climbing, !m_silent);
+    if (!m_converged)
+        std::cout << "Band not converged within " << m_maxiter << " iterations." << std::endl;
+
+    PrintPath();
+    WritePath();
+}
+
+bool NEB::EvaluateImages(const std::vector<Vector>& images, std::vector<double>& energies, std::vector<Vector>& gradients)
+{
+    std::vector<int> indices;
+    for (int i = 0; i < images.size(); ++i)
+        if ((i > 0 && i + 1 < images.size()) || std::isnan(energies[i]))
+            indices.push_back(i);
+
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setProgressBar(CxxThreadPool::ProgressBarType::None);
+    pool->setActiveThreadCount(m_workers.size());
+    for (auto* worker : m_workers) {
+        worker->clear();
+        worker->setBand(&images, &energies, &gradients);
+        pool->addThread(worker);
+    }
+    for (std::size_t i = 0; i < indices.size(); ++i)
+        m_workers[i % m_workers.size()]->addImage(indices[i]);
+    pool->StaticPool();
+    pool->StartAndWait();
+    pool->clear();
+    delete pool;
+
+    for (const auto* worker : m_workers) {
+        if (worker->HasNan()) {
+            AppendError("Energy calculation of an image failed (NaN).");
+            return false;
+        }
+    }
+    return true;
+}
+
+void NEB::IDPP()
+{
+    auto evaluate = [this](const std::vector<Vector>& images, std::vector<double>& energies, std::vector<Vector>& gradients) {
+        return EvaluateIDPP(images, energies, gradients);
+    };
+    std::vector<double> energies = m_energies;
+    m_energies = std::vector<double>(m_images.size(), 0);
+    OptimiseBand(evaluate, m_idpp_iter, m_idpp_fmax, false, false);
+    m_energies = energies;
+}
+
+bool NEB::EvaluateIDPP(const std::vector<Vector>& images, std::vector<double>& energies, std::vector<Vector>& gradients) const
+{
+    /* S = sum_ij (d_ij - d_ij(t))^2 / d_ij^4 with pair distances interpolated linearly between the end points */
+    const int atoms = m_first.AtomCount();
+    const int count = images.size();
+    const Vector& first = images.front();
+    const Vector& last = images.back();
+    for (int image = 1; image + 1 < count; ++image) {
+        const double t = double(image) / double(count - 1);
+        const Vector& x = images[image];
+        Vector gradient = Vector::Zero(x.size());
+        double energy = 0;
+        for (int i = 0; i < atoms; ++i) {
+            for (int j = i + 1; j < atoms; ++j) {
+                const double d0 = (first.segment<3>(3 * i) - first.segment<3>(3 * j)).norm();
+                const double d1 = (last.segment<3>(3 * i) - last.segment<3>(3 * j)).norm();
+                const Eigen::Vector3d r = x.segment<3>(3 * i) - x.segment<3>(3 * j);
+                const double d = r.norm();
+                const double diff = d - (d0 + t * (d1 - d0));
+                const double d4 = d * d * d * d;
+                energy += diff * diff / d4;
+                const double dSdd = 2 * diff / d4 - 4 * diff * diff / (d4 * d);
+                gradient.segment<3>(3 * i) += dSdd * r / d;
+                gradient.segment<3>(3 * j) -= dSdd * r / d;
+            }
+        }
+        energies[image] = energy;
+        gradients[image] = gradient;
+    }
+    return true;
+}
+
+bool NEB::OptimiseBand(const Evaluator& evaluate, int maxiter, double fmax, bool climbing, bool verbose)
+{
+    const int count = m_images.size();
+    const int dim = m_images.front().size();
+    const int size = (count - 2) * dim;
+    const bool lbfgs = m_optimiser.compare("lbfgs") == 0;
+
+    std::vector<double> energies = m_energies;
+    std::vector<Vector> gradients(count, Vector::Zero(dim));
+    if (!evaluate(m_images, energies, gradients))
+        return false;
+
+    auto flatten = [count, dim, size](const std::vector<Vector>& band) {
+        Vector flat(size);
+        for (int i = 1; i + 1 < count; ++i)
+            flat.segment((i - 1) * dim, dim) = band[i];
+        return flat;
+    };
+
+    /* FIRE */
+    Vector velocity = Vector::Zero(size);
+    double dt = m_fire_dt, alpha = 0.1;
+    int positive = 0;
+
+    /* L-BFGS on the band forces, without line search since they are not the gradient of a single function */
+    std::vector<Vector> s_history, y_history;
+    Vector previous_x, previous_f;
+
+    int climb = -1;
+    bool converged = false;
+    for (int iteration = 0; iteration < maxiter; ++iteration) {
+        if (climbing && climb == -1) {
+            std::vector<Vector> forces = BandForces(m_images, energies, gradients, -1);
+            if (MaxAtomForce(forces) < m_climb_threshold) {
+                climb = std::max_element(energies.begin() + 1, energies.end() - 1) - energies.begin();
+                velocity.setZero();
+                s_history.clear();
+                y_history.clear();
+                if (verbose)
+                    std::cout << "Image " << climb << " starts climbing." << std::endl;
+            }
+        } else if (climb != -1)
+            climb = std::max_element(energies.begin() + 1, energies.end() - 1) - energies.begin();
+
+        const std::vector<Vector> forces = BandForces(m_images, energies, gradients, climb);
+        const Vector force = flatten(forces);
+        const double max_force = MaxAtomForce(forces);
+        if (verbose) {
+            const double barrier = *std::max_element(energies.begin() + 1, energies.end() - 1) - energies.front();
+            std::cout << fmt::format("{0: >5} {1: >12.4f} kJ/mol {2: >12.6f} Eh/A", iteration, barrier * 2625.5, max_force) << std::endl;
+        }
+        if (max_force < fmax && (!climbing || climb != -1)) {
+            converged = true;
+            break;
+        }
+        if (CheckStop())
+            break;
+
+        const Vector x = flatten(m_images);
+        Vector step;
+        if (lbfgs) {
+            if (previous_x.size()) {
+                const Vector s = x - previous_x;
+                const Vector y = previous_f - force;
+                if (s.dot(y) > 1e-12) {
+                    s_history.push_back(s);
+                    y_history.push_back(y);
+                    if (s_history.size() > m_lbfgs_m) {
+                        s_history.erase(s_history.begin());
+                        y_history.erase(y_history.begin());
+                    }
+                }
+            }
+            /* two-loop recursion, initial curvature of 2.5 Eh/Angstrom^2 (ASE's 70 eV/Angstrom^2) */
+            Vector q = -force;
+            const int m = s_history.size();
+            std::vector<double> a(m), rho(m);
+            for (int i = m - 1; i >= 0; --i) {
+                rho[i] = 1.0 / y_history[i].dot(s_history[i]);
+                a[i] = rho[i] * s_history[i].dot(q);
+                q -= a[i] * y_history[i];
+            }
+            const double h0 = m ? s_history.back().dot(y_history.back()) / y_history.back().squaredNorm() : 1 / 2.5;
+            Vector z = h0 * q;
+            for (int i = 0; i < m; ++i) {
+                const double b = rho[i] * y_history[i].dot(z);
+                z += s_history[i] * (a[i] - b);
+            }
+            step = -z;
+            if (step.dot(force) <= 0) {
+                s_history.clear();
+                y_history.clear();
+                step = force / 2.5;
+            }
+            previous_x = x;
+            previous_f = force;
+        } else {
+            const double power = force.dot(velocity);
+            if (power > 0) {
+                velocity = (1 - alpha) * velocity + alpha * force.normalized() * velocity.norm();
+                if (positive > 5) {
+                    dt = std::min(dt * 1.1, m_fire_dtmax);
+                    alpha *= 0.99;
+                }
+                ++positive;
+            } else {
+                velocity.setZero();
+                alpha = 0.1;
+                dt *= 0.5;
+                positive = 0;
+            }
+            velocity += dt * force;
+            step = dt * velocity;
+        }
+
+        double longest = 0;
+        for (int i = 0; i < size / 3; ++i)
+            longest = std::max(longest, step.segment<3>(3 * i).norm());
+        if (longest > m_maxstep)
+            step *= m_maxstep / longest;
+
+        for (int i = 1; i + 1 < count; ++i)
+            m_images[i] += step.segment((i - 1) * dim, dim);
+        if (m_string)
+            Reparametrise(m_images, climb);
+
+        if (!evaluate(m_images, energies, gradients))
+            break;
+    }
+    m_energies = energies;
+    m_climbing_image = climb;
+    return converged;
+}
+
+Vector NEB::Tangent(const std::vector<Vector>& images, const std::vector<double>& energies, int index) const
+{
+    const Vector plus = images[index + 1] - images[index];
+    const Vector minus = images[index] - images[index - 1];
+    const double e = energies[index], e_plus = energies[index + 1], e_minus = energies[index - 1];
+    Vector tangent;
+    if (e_plus > e && e > e_minus)
+        tangent = plus;
+    else if (e_plus < e && e < e_minus)
+        tangent = minus;
+    else {
+        const double dmax = std::max(std::abs(e_plus - e), std::abs(e_minus - e));
+        const double dmin = std::min(std::abs(e_plus - e), std::abs(e_minus - e));
+        if (e_plus > e_minus)
+            tangent = plus * dmax + minus * dmin;
+        else
+            tangent = plus * dmin + minus * dmax;
+    }
+    const double norm = tangent.norm();
+    return norm > 1e-12 ? Vector(tangent / norm) : Vector(plus.normalized());
+}
+
+std::vector<Vector> NEB::BandForces(const std::vector<Vector>& images, const std::vector<double>& energies, const std::vector<Vector>& gradients, int climb) const
+{
+    std::vector<Vector> forces(images.size(), Vector::Zero(images.front().size()));
+    for (int i = 1; i + 1 < images.size(); ++i) {
+        const Vector tangent = Tangent(images, energies, i);
+        const double parallel = gradients[i].dot(tangent);
+        if (i == climb)
+            forces[i] = -gradients[i] + 2 * parallel * tangent;
+        else {
+            forces[i] = -gradients[i] + parallel * tangent;
+            if (!m_string)
+                forces[i] += m_spring * ((images[i + 1] - images[i]).norm() - (images[i] - images[i - 1]).norm()) * tangent;
+        }
+    }
+    return forces;
+}
+
+void NEB::Reparametrise(std::vector<Vector>& images, int fixed) const
+{
+    /* the climbing image stays in place, the images on both sides are spaced evenly up to it */
+    std::vector<int> anchors = { 0 };
+    if (fixed > 0 && fixed + 1 < images.size())
+        anchors.push_back(fixed);
+    anchors.push_back(images.size() - 1);
+
+    const std::vector<Vector> old = images;
+    for (int a = 0; a + 1 < anchors.size(); ++a) {
+        const int begin = anchors[a], end = anchors[a + 1];
+        std::vector<double> length = { 0 };
+        for (int i = begin + 1; i <= end; ++i)
+            length.push_back(length.back() + (old[i] - old[i - 1]).norm());
+        int segment = 0;
+        for (int i = begin + 1; i < end; ++i) {
+            const double target = length.back() * double(i - begin) / double(end - begin);
+            while (segment + 2 < length.size() && length[segment + 1] < target)
+                ++segment;
+            const double span = length[segment + 1] - length[segment];
+            const double t = span > 1e-12 ? (target - length[segment]) / span : 0;
+            images[i] = old[begin + segment] + t * (old[begin + segment + 1] - old[begin + segment]);
+        }
+    }
+}
+
+double NEB::MaxAtomForce(const std::vector<Vector>& forces)
+{
+    double max = 0;
+    for (const auto& force : forces)
+        for (int i = 0; i < force.size() / 3; ++i)
+            max = std::max(max, force.segment<3>(3 * i).norm());
+    return max;
+}
+
+std::vector<Molecule> NEB::Path() const
+{
+    std::vector<Molecule> path;
+    for (int i = 0; i < m_images.size(); ++i) {
+        Molecule molecule(m_first);
+        molecule.setGeometry(ToGeometry(m_images[i]));
+        molecule.setEnergy(m_energies[i]);
+        path.push_back(molecule);
+    }
+    return path;
+}
+
+void NEB::PrintPath() const
+{
+    std::cout << std::endl
+              << "Image    s (A)      Energy (Eh)    dE (kJ/mol)" << std::endl;
+    double s = 0;
+    for (int i = 0; i < m_images.size(); ++i) {
+        if (i)
+            s += (m_images[i] - m_images[i - 1]).norm();
+        std::cout << fmt::format("{0: >5} {1: >8.3f} {2: >16.8f} {3: >12.3f}{4}", i, s, m_energies[i], (m_energies[i] - m_energies.front()) * 2625.5, i == m_climbing_image ? "  climbing image" : "") << std::endl;
+    }
+    const double top = *std::max_element(m_energies.begin() + 1, m_energies.end() - 1);
+    std::cout << fmt::format("Barrier forward {0:.3f} kJ/mol, backward {1:.3f} kJ/mol", (top - m_energies.front()) * 2625.5, (top - m_energies.back()) * 2625.5) << std::endl;
+}
+
+void NEB::WritePath() const
+{
+    const std::string basename = Basename().empty() ? std::string("neb") : Basename();
+    const std::vector<Molecule> path = Path();
+    std::ofstream(basename + ".neb.xyz").close();
+    for (const auto& molecule : path)
+        molecule.appendXYZFile(basename + ".neb.xyz");
+
+    const int top = std::max_element(m_energies.begin() + 1, m_energies.end() - 1) - m_energies.begin();
+    path[top].writeXYZFile(basename + ".neb.ts.xyz");
+}
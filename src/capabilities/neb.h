@@ -0,0 +1,169 @@
+/*
+ * <Nudged elastic band and string method reaction paths. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "src/core/energycalculator.h"
+#include "src/core/molecule.h"
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
+#include "curcumamethod.h"
+
+/* forces and fmax in Eh/Angstrom, spring in Eh/Angstrom^2, maxstep in Angstrom per atom */
+static const json NEBJson{
+    { "method", "uff" },
+    { "threads", 1 },
+    { "Charge", 0 },
+    { "Spin", 0 },
+    { "images", 8 },
+    { "align", false }, // rigid fragment alignment of the end points before interpolation
+    { "interpolation", "idpp" }, // linear or idpp
+    { "idpp_iter", 500 },
+    { "idpp_fmax", 1e-2 },
+    { "spring", 0.1 },
+    { "climbing", true },
+    { "climb_threshold", 2e-2 },
+    { "string", false },
+    { "optimiser", "fire" }, // fire or lbfgs
+    { "MaxIter", 500 },
+    { "fmax", 1e-3 },
+    { "maxstep", 0.2 },
+    { "fire_dt", 0.5 },
+    { "fire_dtmax", 2.0 },
+    { "lbfgs_m", 10 }
+};
+
+/*! \brief Worker owning one EnergyCalculator, evaluates energy and gradient of its images */
+class NEBImageThread : public CxxThread {
+public:
+    NEBImageThread(const std::string& method, const json& controller, const Molecule& molecule);
+    ~NEBImageThread();
+
+    int execute() override;
+
+    inline void clear() { m_indices.clear(); }
+    inline void addImage(int index) { m_indices.push_back(index); }
+
+    /*! \brief Coordinates of all images (3N each), results are written to energies and gradients (Eh/Angstrom) */
+    void setBand(const std::vector<Vector>* images, std::vector<double>* energies, std::vector<Vector>* gradients)
+    {
+        m_images = images;
+        m_energies = energies;
+        m_gradients = gradients;
+    }
+
+    inline bool HasNan() const { return m_nan; }
+
+private:
+    EnergyCalculator* m_calculator;
+    const std::vector<Vector>* m_images = nullptr;
+    std::vector<double>* m_energies = nullptr;
+    std::vector<Vector>* m_gradients = nullptr;
+    std::vector<int> m_indices;
+    bool m_nan = false;
+};
+
+/*! \brief Reaction path between two structures with identical atom order
+ *
+ * The band is interpolated linearly or by the image dependent pair potential (IDPP) and relaxed with
+ * FIRE or L-BFGS on the projected NEB forces, all images of one iteration are evaluated concurrently.
+ * With climbing the highest image climbs to the saddle point once the band is roughly converged. The
+ * string method drops the springs and redistributes the images to equal arc length after every step.
+ */
+class NEB : public CurcumaMethod {
+public:
+    NEB(const json& controller = NEBJson, bool silent = true);
+    ~NEB();
+
+    inline void setStructures(const Molecule& first, const Molecule& second)
+    {
+        m_first = first;
+        m_second = second;
+    }
+
+    bool Initialise() override;
+
+    void start() override;
+
+    /*! \brief Images including both end points, energies in Eh */
+    std::vector<Molecule> Path() const;
+
+    inline int ClimbingImage() const { return m_climbing_image; }
+    inline bool Converged() const { return m_converged; }
+
+    /*! \brief Linear interpolation, images intermediate structures between first and second */
+    static std::vector<Vector> LinearPath(const Vector& first, const Vector& second, int images);
+
+private:
+    typedef std::function<bool(const std::vector<Vector>&, std::vector<double>&, std::vector<Vector>&)> Evaluator;
+
+    /* Lets have this for all modules */
+    inline nlohmann::json WriteRestartInformation() override { return json(); }
+
+    /* Lets have this for all modules */
+    inline bool LoadRestartInformation() override { return true; }
+
+    inline StringList MethodName() const override { return { std::string("NEB") }; }
+
+    /* Lets have all methods read the input/control file */
+    void ReadControlFile() override{};
+
+    /* Read Controller has to be implemented for all */
+    void LoadControlJson() override;
+
+    /* Relax the band along the interpolated pair distances, energies and gradients of the IDPP objective */
+    void IDPP();
+    bool EvaluateIDPP(const std::vector<Vector>& images, std::vector<double>& energies, std::vector<Vector>& gradients) const;
+
+    /* Energies and gradients of the intermediate images with the EnergyCalculator workers */
+    bool EvaluateImages(const std::vector<Vector>& images, std::vector<double>& energies, std::vector<Vector>& gradients);
+
+    /* Relax the intermediate images of m_images on the given surface, returns true if converged */
+    bool OptimiseBand(const Evaluator& evaluate, int maxiter, double fmax, bool climbing, bool verbose);
+
+    /* NEB (or string) forces on the intermediate images, climb is the index of the climbing image or -1 */
+    std::vector<Vector> BandForces(const std::vector<Vector>& images, const std::vector<double>& energies, const std::vector<Vector>& gradients, int climb) const;
+
+    /* Improved tangent of Henkelman and Jonsson */
+    Vector Tangent(const std::vector<Vector>& images, const std::vector<double>& energies, int index) const;
+
+    /* Redistribute the intermediate images to equal arc length along the piecewise linear path, fixed image stays */
+    void Reparametrise(std::vector<Vector>& images, int fixed) const;
+
+    /* Largest force on a single atom */
+    static double MaxAtomForce(const std::vector<Vector>& forces);
+
+    void PrintPath() const;
+    void WritePath() const;
+
+    Molecule m_first, m_second;
+    std::vector<Vector> m_images;
+    std::vector<double> m_energies;
+    std::vector<NEBImageThread*> m_workers;
+    std::string m_method = "uff", m_interpolation = "idpp", m_optimiser = "fire";
+    double m_spring = 0.1, m_climb_threshold = 2e-2, m_fmax = 1e-3, m_maxstep = 0.2, m_fire_dt = 0.5, m_fire_dtmax = 2.0, m_idpp_fmax = 1e-2;
+    int m_threads = 1, m_charge = 0, m_spin = 0, m_image_count = 8, m_maxiter = 500, m_idpp_iter = 500, m_lbfgs_m = 10;
+    int m_climbing_image = -1;
+    bool m_climbing = true, m_string = false, m_converged = false, m_align = false;
+};
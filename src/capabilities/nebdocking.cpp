@@ -17,7 +17,7 @@
  *
  */
 
-#include "src/capabilities/optimiser/LevMarNEBDocking.h"
+#include "src/capabilities/optimiser/NEBAlignment.h"
 
 #include "src/capabilities/rmsd.h"
 
@@ -58,7 +58,7 @@ void NEBDocking::Prepare()
 std::pair<Molecule, Molecule> NEBDocking::DockForNEB(const Molecule& first, const Molecule& second)
 {
     std::pair<Molecule, Molecule> result;
-    result = OptimiseAtoms(first, second);
+    result = AlignNEBEndpoints(first, second);
 
     result.first.writeXYZFile("neb_first.xyz");
     result.second.writeXYZFile("neb_second.xyz");
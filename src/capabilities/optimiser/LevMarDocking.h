@@ -56,81 +56,383 @@ struct Functor {
     int values() const { return m_values; }
 };
 
-struct MyFunctor : Functor<double> {
-    inline MyFunctor(int inputs, int values)
-        : Functor(inputs, values)
-        , no_parameter(inputs)
-        , no_points(values)
+/*! \brief Rigid guest pose, translation of the guest centroid and orientation as unit quaternion */
+struct RigidDockingPose {
+    Position position{ 0, 0, 0 };
+    Eigen::Quaterniond orientation = Eigen::Quaterniond::Identity();
+    double score = 0;
+    int iterations = 0;
+    /* guest coordinates relative to position before rotation, only set if torsions were optimised */
+    Matrix guest;
+};
+
+/*! \brief Rotatable guest bond a-b, moving are the atoms on the side of b, the dihedral is c-a-b-d */
+struct DockingTorsion {
+    int a = 0, b = 0, c = 0, d = 0;
+    std::vector<int> moving;
+};
+
+/*! \brief Rotatable bonds of the guest
+ *
+ * Bonds are taken from covalent radii (scaling 1.2). A bond is rotatable if it is not part of a
+ * ring, both atoms carry further substituents and it is not shorter than 95 % of the single bond
+ * length (excludes double, aromatic and amide bonds). Rotors that only move hydrogen atoms are
+ * skipped, the smaller side of the bond is the moving one.
+ */
+inline std::vector<DockingTorsion> RotatableBonds(const Molecule& guest)
+{
+    const int atoms = guest.AtomCount();
+    std::vector<std::vector<int>> neighbours(atoms);
+    std::vector<std::pair<int, int>> bonds;
+    for (int i = 0; i < atoms; ++i)
+        for (int j = i + 1; j < atoms; ++j) {
+            const double single = Elements::CovalentRadius[guest.Atom(i).first] + Elements::CovalentRadius[guest.Atom(j).first];
+            const double distance = (guest.Atom(i).second - guest.Atom(j).second).norm();
+            if (distance < 1.2 * single) {
+                neighbours[i].push_back(j);
+                neighbours[j].push_back(i);
+                if (distance > 0.95 * single)
+                    bonds.push_back({ i, j });
+            }
+        }
+
+    std::vector<DockingTorsion> torsions;
+    for (const auto& bond : bonds) {
+        int a = bond.first, b = bond.second;
+        if (neighbours[a].size() < 2 || neighbours[b].size() < 2)
+            continue;
+        /* atoms reachable from b without crossing the bond, reaching a means the bond is in a ring */
+        std::vector<char> visited(atoms, 0);
+        std::vector<int> side = { b }, stack = { b };
+        visited[a] = visited[b] = 1;
+        bool ring = false;
+        while (!stack.empty() && !ring) {
+            const int current = stack.back();
+            stack.pop_back();
+            for (int next : neighbours[current]) {
+                if (next == a && current != b)
+                    ring = true;
+                if (visited[next])
+                    continue;
+                visited[next] = 1;
+                side.push_back(next);
+                stack.push_back(next);
+            }
+        }
+        if (ring)
+            continue;
+        if (2 * side.size() > atoms) {
+            std::swap(a, b);
+            std::vector<int> other;
+            for (int i = 0; i < atoms; ++i)
+                if (!visited[i] || i == b)
+                    other.push_back(i);
+            side = other;
+        }
+        bool heavy = false;
+        for (int i : side)
+            heavy = heavy || (i != b && neighbours[i].size() > 1);
+        if (!heavy)
+            continue;
+        /* reference atoms of the dihedral, preferably non-terminal */
+        auto reference = [&neighbours](int atom, int exclude) {
+            int best = -1;
+            for (int i : neighbours[atom])
+                if (i != exclude && (best == -1 || neighbours[i].size() > neighbours[best].size()))
+                    best = i;
+            return best;
+        };
+        DockingTorsion torsion;
+        torsion.a = a;
+        torsion.b = b;
+        torsion.c = reference(a, b);
+        torsion.d = reference(b, a);
+        for (int i : side)
+            if (i != b)
+                torsion.moving.push_back(i);
+        torsions.push_back(torsion);
+    }
+    return torsions;
+}
+
+/*! \brief Dihedral angles c-a-b-d (rad) of all torsions in the guest coordinates */
+inline Vector TorsionAngles(const std::vector<DockingTorsion>& torsions, const Matrix& guest)
+{
+    Vector angles(torsions.size());
+    for (int k = 0; k < torsions.size(); ++k) {
+        const Eigen::Vector3d b1 = (guest.row(torsions[k].a) - guest.row(torsions[k].c)).transpose();
+        const Eigen::Vector3d b2 = (guest.row(torsions[k].b) - guest.row(torsions[k].a)).transpose();
+        const Eigen::Vector3d b3 = (guest.row(torsions[k].d) - guest.row(torsions[k].b)).transpose();
+        const Eigen::Vector3d n1 = b1.cross(b2), n2 = b2.cross(b3);
+        angles(k) = atan2(b2.norm() * b1.dot(n2), n1.dot(n2));
+    }
+    return angles;
+}
+
+/*! \brief Convert the Euler angles (degree) of GeometryTools::TranslateAndRotate into the rotation acting on column vectors */
+inline Eigen::Quaterniond EulerToQuaternion(const Position& rotation)
+{
+    Eigen::Matrix3d rot = GeometryTools::RotationX(rotation(0)) * GeometryTools::RotationY(rotation(1)) * GeometryTools::RotationZ(rotation(2));
+    return Eigen::Quaterniond(Eigen::Matrix3d(rot.transpose())).normalized();
+}
+
+/*! \brief Inverse of EulerToQuaternion, returns angles in degree */
+inline Position QuaternionToEuler(const Eigen::Quaterniond& orientation)
+{
+    const Eigen::Matrix3d rot = orientation.toRotationMatrix().transpose();
+    const double b = asin(std::max(-1.0, std::min(1.0, rot(0, 2))));
+    double a, c;
+    if (std::abs(rot(0, 2)) < 1 - 1e-12) {
+        a = atan2(-rot(1, 2), rot(2, 2));
+        c = atan2(-rot(0, 1), rot(0, 0));
+    } else {
+        a = atan2(rot(2, 1), rot(1, 1));
+        c = 0;
+    }
+    return Position{ a * 180 / pi, b * 180 / pi, c * 180 / pi };
+}
+
+/*! \brief Levenberg-Marquardt on the rigid guest pose with an analytic Jacobian
+ *
+ * The residuals are the pseudo-LJ interaction energies of every host atom with the guest. The
+ * pose is translation plus unit quaternion, every step is taken as translation and rotation vector
+ * (exponential map) around the current orientation, so there is no gimbal lock. Residuals and the
+ * 6 column Jacobian are evaluated in one pass over all host-guest pairs into preallocated buffers.
+ *
+ * With torsions the guest becomes flexible: every rotatable bond adds a column (rotation of the
+ * moving atoms about the current bond axis) and intra-guest pairs, whose distance depends on a
+ * torsion, add clash residuals 10 * max(0, s (r_vdW,i + r_vdW,j) - r_ij).
+ */
+class RigidDockingOptimiser {
+public:
+    inline RigidDockingOptimiser(const Molecule* host, const Molecule& guest)
+    {
+        m_host = Matrix(host->AtomCount(), 3);
+        m_host_radius = Vector(host->AtomCount());
+        for (int i = 0; i < host->AtomCount(); ++i) {
+            m_host.row(i) = host->Atom(i).second.transpose();
+            m_host_radius(i) = Elements::VanDerWaalsRadius[host->Atom(i).first];
+        }
+        const Position centroid = guest.Centroid();
+        m_guest = Matrix(guest.AtomCount(), 3);
+        m_guest_radius = Vector(guest.AtomCount());
+        for (int j = 0; j < guest.AtomCount(); ++j) {
+            m_guest.row(j) = (guest.Atom(j).second - centroid).transpose();
+            m_guest_radius(j) = Elements::VanDerWaalsRadius[guest.Atom(j).first];
+        }
+        m_rotated = Matrix(guest.AtomCount(), 3);
+        m_residual = Vector(host->AtomCount());
+        m_jacobian = Matrix(host->AtomCount(), 6);
+    }
+
+    inline void setMaxIterations(int iterations) { m_max_iterations = iterations; }
+
+    /*! \brief Optimise the given torsions together with the pose, clash_scaling scales the van der Waals radii of intra-guest pairs */
+    inline void setTorsions(const std::vector<DockingTorsion>& torsions, double clash_scaling = 0.75)
+    {
+        const int atoms = m_guest.rows();
+        m_torsions = torsions;
+        m_member = std::vector<std::vector<char>>(torsions.size(), std::vector<char>(atoms, 0));
+        for (int k = 0; k < torsions.size(); ++k)
+            for (int j : torsions[k].moving)
+                m_member[k][j] = 1;
+        m_clash_pairs.clear();
+        m_clash_distance.clear();
+        for (int p = 0; p < atoms; ++p)
+            for (int q = p + 1; q < atoms; ++q) {
+                bool flexible = false;
+                for (int k = 0; k < torsions.size() && !flexible; ++k)
+                    flexible = m_member[k][p] != m_member[k][q] && p != torsions[k].b && q != torsions[k].b && p != torsions[k].a && q != torsions[k].a;
+                if (!flexible)
+                    continue;
+                m_clash_pairs.push_back({ p, q });
+                m_clash_distance.push_back(clash_scaling * (m_guest_radius(p) + m_guest_radius(q)));
+            }
+        m_atom_gradient = Matrix(atoms, 3);
+        m_atom_torque = Matrix(atoms, 3);
+        m_residual = Vector(m_host.rows() + m_clash_pairs.size());
+        m_jacobian = Matrix(m_residual.size(), 6 + m_torsions.size());
+    }
+
+    inline int Torsions() const { return m_torsions.size(); }
+    inline Vector TorsionAngles(const Matrix& guest) const { return ::TorsionAngles(m_torsions, guest); }
+    inline int Residuals() const { return m_residual.size(); }
+
+    /*! \brief Rotate the moving atoms of torsion k by angle (rad) about the current bond axis */
+    inline void RotateTorsion(Matrix& guest, int k, double angle) const
+    {
+        const DockingTorsion& torsion = m_torsions[k];
+        const Eigen::Vector3d origin = guest.row(torsion.a).transpose();
+        const Eigen::Vector3d axis = (guest.row(torsion.b).transpose() - origin).normalized();
+        const Eigen::Matrix3d rotation = Eigen::AngleAxisd(angle, axis).toRotationMatrix();
+        for (int j : torsion.moving)
+            guest.row(j) = (rotation * (guest.row(j).transpose() - origin) + origin).transpose();
+    }
+
+    /*! \brief Evaluate residuals (and Jacobian) for position and orientation, returns the sum of squares */
+    inline double Evaluate(const Position& position, const Eigen::Quaterniond& orientation, Vector& residual, Matrix* jacobian)
     {
+        return Evaluate(position, orientation, m_guest, residual, jacobian);
     }
-    inline ~MyFunctor() {}
-    inline int operator()(const Eigen::VectorXd& position, Eigen::VectorXd& fvec) const
+
+    /*! \brief Evaluate residuals (and Jacobian) for the guest coordinates (relative to position) in the given pose */
+    inline double Evaluate(const Position& position, const Eigen::Quaterniond& orientation, const Matrix& guest, Vector& residual, Matrix* jacobian)
     {
-        Molecule guest = m_guest;
-        guest.setGeometry(
-            GeometryTools::TranslateAndRotate(
-                guest.getGeometry(),
-                guest.Centroid(),
-                Position{ position(0), position(1), position(2) },
-                Position{ position(3), position(4), position(5) }));
-
-        for (int i = 0; i < m_host->AtomCount(); ++i) {
-            fvec(i) = 0;
-            for (int j = 0; j < guest.AtomCount(); ++j) {
-                fvec(i) += PseudoFF::LJPotential(m_host->Atom(i), guest.Atom(j)); // + PseudoFF::DistancePenalty(m_host->Atom(i), guest.Atom(j));
+        const Eigen::Matrix3d R = orientation.toRotationMatrix();
+        const bool flexible = !m_torsions.empty();
+        m_rotated.noalias() = guest * R.transpose();
+        residual.setZero();
+        if (jacobian)
+            jacobian->setZero();
+        for (int i = 0; i < m_host.rows(); ++i) {
+            const Eigen::Vector3d host = m_host.row(i).transpose() - position;
+            Eigen::Vector3d force = Eigen::Vector3d::Zero(), torque = Eigen::Vector3d::Zero();
+            for (int j = 0; j < m_rotated.rows(); ++j) {
+                const Eigen::Vector3d r = m_rotated.row(j).transpose();
+                const Eigen::Vector3d d = r - host;
+                const double distance2 = d.squaredNorm();
+                const double sigma = m_host_radius(i) + m_guest_radius(j);
+                const double s2 = sigma * sigma / distance2;
+                const double s6 = s2 * s2 * s2;
+                residual(i) += s6 * (s6 - 2);
+                if (jacobian) {
+                    /* dV/dd / d */
+                    const Eigen::Vector3d g = -12 * s6 * (s6 - 1) / distance2 * d;
+                    force += g;
+                    torque += r.cross(g);
+                    if (flexible) {
+                        m_atom_gradient.row(j) = g.transpose();
+                        m_atom_torque.row(j) = r.cross(g).transpose();
+                    }
+                }
+            }
+            if (jacobian) {
+                jacobian->block(i, 0, 1, 3) = force.transpose();
+                jacobian->block(i, 3, 1, 3) = torque.transpose();
+                /* rotating the moving atoms about the bond axis (unit vector u through point a) */
+                for (int k = 0; flexible && k < m_torsions.size(); ++k) {
+                    const Eigen::Vector3d a = m_rotated.row(m_torsions[k].a).transpose();
+                    const Eigen::Vector3d u = (m_rotated.row(m_torsions[k].b).transpose() - a).normalized();
+                    Eigen::Vector3d F = Eigen::Vector3d::Zero(), T = Eigen::Vector3d::Zero();
+                    for (int j : m_torsions[k].moving) {
+                        F += m_atom_gradient.row(j).transpose();
+                        T += m_atom_torque.row(j).transpose();
+                    }
+                    (*jacobian)(i, 6 + k) = u.dot(T - a.cross(F));
+                }
             }
         }
-
-        return 0;
+        const int offset = m_host.rows();
+        for (int c = 0; c < m_clash_pairs.size(); ++c) {
+            const int p = m_clash_pairs[c].first, q = m_clash_pairs[c].second;
+            const Eigen::Vector3d d = guest.row(p).transpose() - guest.row(q).transpose();
+            const double distance = d.norm();
+            const double overlap = m_clash_distance[c] - distance;
+            if (overlap <= 0)
+                continue;
+            residual(offset + c) = m_clash_weight * overlap;
+            if (!jacobian)
+                continue;
+            const Eigen::Vector3d e = d / distance;
+            for (int k = 0; k < m_torsions.size(); ++k) {
+                if (m_member[k][p] == m_member[k][q])
+                    continue;
+                const Eigen::Vector3d a = guest.row(m_torsions[k].a).transpose();
+                const Eigen::Vector3d u = (guest.row(m_torsions[k].b).transpose() - a).normalized();
+                const int moving = m_member[k][p] ? p : q;
+                const double sign = m_member[k][p] ? 1 : -1;
+                const Eigen::Vector3d x = guest.row(moving).transpose();
+                const Eigen::Vector3d velocity = u.cross(x - a);
+                (*jacobian)(offset + c, 6 + k) = -m_clash_weight * sign * e.dot(velocity);
+            }
+        }
+        return residual.squaredNorm();
     }
-    int no_parameter;
-    int no_points;
-    const Molecule* m_host;
 
-    Molecule m_guest;
+    inline RigidDockingPose Optimise(const Position& anchor, const Eigen::Quaterniond& orientation, const Matrix* guest = nullptr)
+    {
+        RigidDockingPose pose;
+        pose.position = anchor;
+        pose.orientation = orientation.normalized();
+        const int parameter = 6 + m_torsions.size();
+        Matrix current = guest && guest->rows() == m_guest.rows() ? *guest : m_guest;
+        Matrix trial_guest = current;
 
-    int inputs() const { return no_parameter; }
-    int values() const { return no_points; }
-};
+        Vector trial_residual(m_residual.size());
+        Matrix trial_jacobian(m_jacobian.rows(), parameter);
+        double cost = Evaluate(pose.position, pose.orientation, current, m_residual, &m_jacobian);
+        double lambda = 1e-3;
+        bool converged = false;
+        int iter = 0;
+        for (; iter < m_max_iterations && !converged; ++iter) {
+            const Matrix JtJ = m_jacobian.transpose() * m_jacobian;
+            const Vector Jtf = m_jacobian.transpose() * m_residual;
+            if (Jtf.norm() < 1e-10)
+                break;
 
-struct MyFunctorNumericalDiff : Eigen::NumericalDiff<MyFunctor> {
+            bool accepted = false;
+            Vector step;
+            for (int attempt = 0; attempt < 20 && !accepted; ++attempt) {
+                Matrix A = JtJ;
+                A.diagonal() += lambda * (JtJ.diagonal().array() + 1e-12).matrix();
+                step = -A.ldlt().solve(Jtf);
+
+                const Position position = pose.position + step.head<3>();
+                const Eigen::Vector3d omega = step.segment<3>(3);
+                Eigen::Quaterniond rotation = pose.orientation;
+                if (omega.norm() > 0)
+                    rotation = (Eigen::Quaterniond(Eigen::AngleAxisd(omega.norm(), omega.normalized())) * pose.orientation).normalized();
+                if (parameter > 6) {
+                    trial_guest = current;
+                    for (int k = 0; k < m_torsions.size(); ++k)
+                        RotateTorsion(trial_guest, k, step(6 + k));
+                }
+
+                const double trial_cost = Evaluate(position, rotation, parameter > 6 ? trial_guest : current, trial_residual, &trial_jacobian);
+                if (trial_cost < cost) {
+                    accepted = true;
+                    pose.position = position;
+                    pose.orientation = rotation;
+                    if (parameter > 6)
+                        current.swap(trial_guest);
+                    m_residual.swap(trial_residual);
+                    m_jacobian.swap(trial_jacobian);
+                    const double gain = cost - trial_cost;
+                    cost = trial_cost;
+                    lambda = std::max(lambda / 3.0, 1e-12);
+                    converged = gain < 1e-12 * std::max(1.0, cost);
+                } else
+                    lambda *= 4;
+            }
+            if (!accepted || step.norm() < 1e-6)
+                break;
+        }
+        pose.score = m_residual.head(m_host.rows()).sum() + m_residual.tail(m_residual.size() - m_host.rows()).squaredNorm();
+        pose.iterations = iter;
+        if (parameter > 6)
+            pose.guest = current;
+        return pose;
+    }
+
+private:
+    Matrix m_host, m_guest, m_rotated, m_jacobian, m_atom_gradient, m_atom_torque;
+    Vector m_host_radius, m_guest_radius, m_residual;
+    std::vector<DockingTorsion> m_torsions;
+    std::vector<std::vector<char>> m_member;
+    std::vector<std::pair<int, int>> m_clash_pairs;
+    std::vector<double> m_clash_distance;
+    double m_clash_weight = 10;
+    int m_max_iterations = 3000;
 };
 
-inline std::pair<Position, Position> OptimiseAnchor(const Molecule* host, const Molecule& guest, Position anchor, Position rotation)
+inline RigidDockingPose OptimisePose(const Molecule* host, const Molecule& guest, const Position& anchor, const Eigen::Quaterniond& orientation)
 {
-    Vector parameter = PositionPair2Vector(anchor, rotation);
-
-    MyFunctor functor(6, host->AtomCount());
-    functor.m_host = host;
-    functor.m_guest = guest;
-    Eigen::NumericalDiff<MyFunctor> numDiff(functor);
-    Eigen::LevenbergMarquardt<Eigen::NumericalDiff<MyFunctor>> lm(numDiff);
-    int iter = 0;
-
-    /*
-    lm.parameters.factor = config["LevMar_Factor"].toInt(); //step bound for the diagonal shift, is this related to damping parameter, lambda?
-    lm.parameters.maxfev = config["LevMar_MaxFEv"].toDouble(); //max number of function evaluations
-    lm.parameters.xtol = config["LevMar_Xtol"].toDouble(); //tolerance for the norm of the solution vector
-    lm.parameters.ftol = config["LevMar_Ftol"].toDouble(); //tolerance for the norm of the vector function
-    lm.parameters.gtol = config["LevMar_Gtol"].toDouble(); // tolerance for the norm of the gradient of the error vector
-    lm.parameters.epsfcn = config["LevMar_epsfcn"].toDouble(); //error precision
-    */
-
-    Eigen::LevenbergMarquardtSpace::Status status = lm.minimizeInit(parameter);
-
-    int MaxIter = 3000;
-    Vector old_param = parameter;
-    // std::cout << parameter.transpose() << std::endl;
-    for (; iter < MaxIter /*&& ((qAbs(error_0 - error_2) > ErrorConvergence) || norm > DeltaParameter)*/; ++iter) {
-        status = lm.minimizeOneStep(parameter);
-
-        if ((old_param - parameter).norm() < 1e-5)
-            break;
-
-        old_param = parameter;
-    }
-    // std::cout << parameter.transpose() << std::endl;
-    // std::cout << "took " << iter << " optimisation steps." << std::endl;
+    RigidDockingOptimiser optimiser(host, guest);
+    return optimiser.Optimise(anchor, orientation);
+}
 
-    return Vector2PositionPair(parameter);
+inline std::pair<Position, Position> OptimiseAnchor(const Molecule* host, const Molecule& guest, Position anchor, Position rotation)
+{
+    RigidDockingPose pose = OptimisePose(host, guest, anchor, EulerToQuaternion(rotation));
+    return std::pair<Position, Position>(pose.position, QuaternionToEuler(pose.orientation));
 }
@@ -0,0 +1,254 @@
+/*
+ * <Linear least-squares QMDFF FC Fit. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "src/core/global.h"
+#include "src/core/qmdff_par.h"
+
+/* Stretch and bend terms of QMDFF are linear in kAB and kabc, so the force field hessian is
+ * H(k) = sum_t k_t H_t with H_t the hessian of term t at unit force constant. The H_t are small
+ * dense blocks (6x6 for bonds, 9x9 for angles) evaluated analytically once at the reference
+ * geometry, the fit against the reference hessian is then a plain (non-negative) linear
+ * least-squares problem. */
+
+/*! \brief Hessian (6x6, atoms a, b) of the QMDFF stretch term with kAB = 1 */
+inline Matrix QMDFFStretchHessian(const Eigen::Vector3d& a, const Eigen::Vector3d& b, double reAB, double exponent)
+{
+    Matrix hessian = Matrix::Zero(6, 6);
+    const Eigen::Vector3d vec = a - b;
+    const double r = vec.norm();
+    const Eigen::Vector3d u = vec / r;
+
+    const double ratio_a = pow(reAB / r, exponent);
+    const double ratio_h = pow(reAB / r, exponent * 0.5);
+    const double d1 = exponent / r * (ratio_h - ratio_a);
+    const double d2 = exponent / (r * r) * ((exponent + 1) * ratio_a - (exponent * 0.5 + 1) * ratio_h);
+
+    const Eigen::Matrix3d uu = u * u.transpose();
+    const Eigen::Matrix3d block = d2 * uu + d1 / r * (Eigen::Matrix3d::Identity() - uu);
+    if (!block.allFinite())
+        return hessian;
+
+    hessian.block(0, 0, 3, 3) = block;
+    hessian.block(3, 3, 3, 3) = block;
+    hessian.block(0, 3, 3, 3) = -block;
+    hessian.block(3, 0, 3, 3) = -block;
+    return hessian;
+}
+
+/*! \brief Hessian (9x9, atoms a, b, c) of the QMDFF bend term around a with kabc = 1,
+ * cos(thetae) is taken exactly as QMDFFThread::AngleBend evaluates it */
+inline Matrix QMDFFBendHessian(const Eigen::Vector3d& a, const Eigen::Vector3d& b, const Eigen::Vector3d& c, double thetae, double reAB, double reAC)
+{
+    Matrix hessian = Matrix::Zero(9, 9);
+    const Eigen::Vector3d v1 = a - b;
+    const Eigen::Vector3d v2 = a - c;
+    const double n1 = v1.norm(), n2 = v2.norm();
+    const Eigen::Vector3d u1 = v1 / n1, u2 = v2 / n2;
+    const Eigen::Matrix3d I = Eigen::Matrix3d::Identity();
+
+    /* internal coordinates q = (rAB, rAC, cos theta) */
+    const double cost = v1.dot(v2) / (n1 * n2);
+    const double cose = cos(thetae);
+
+    const double fAB = 1 + pow(n1 / reAB, 4), fAC = 1 + pow(n2 / reAC, 4);
+    const double dfAB = 4 * pow(n1, 3) / pow(reAB, 4), dfAC = 4 * pow(n2, 3) / pow(reAC, 4);
+    const double d2fAB = 12 * n1 * n1 / pow(reAB, 4), d2fAC = 12 * n2 * n2 / pow(reAC, 4);
+
+    const double damp = 1 / (fAB * fAC);
+    const double damp_ab = -dfAB / (fAB * fAB * fAC);
+    const double damp_ac = -dfAC / (fAC * fAC * fAB);
+    const double damp_abab = (2 * dfAB * dfAB / (fAB * fAB * fAB) - d2fAB / (fAB * fAB)) / fAC;
+    const double damp_acac = (2 * dfAC * dfAC / (fAC * fAC * fAC) - d2fAC / (fAC * fAC)) / fAB;
+    const double damp_abac = dfAB * dfAC / (fAB * fAB * fAC * fAC);
+
+    const double s = (cose - cost) * (cose - cost);
+    const double s_c = -2 * (cose - cost);
+    const double s_cc = 2;
+
+    Eigen::Vector3d g_q(damp_ab * s, damp_ac * s, damp * s_c);
+    Eigen::Matrix3d h_q;
+    h_q << damp_abab * s, damp_abac * s, damp_ab * s_c,
+        damp_abac * s, damp_acac * s, damp_ac * s_c,
+        damp_ab * s_c, damp_ac * s_c, damp * s_cc;
+
+    /* first and second derivatives of q with respect to (v1, v2) */
+    Matrix jacobian = Matrix::Zero(3, 6);
+    jacobian.block(0, 0, 1, 3) = u1.transpose();
+    jacobian.block(1, 3, 1, 3) = u2.transpose();
+    const Eigen::Vector3d dc1 = v2 / (n1 * n2) - cost * v1 / (n1 * n1);
+    const Eigen::Vector3d dc2 = v1 / (n1 * n2) - cost * v2 / (n2 * n2);
+    jacobian.block(2, 0, 1, 3) = dc1.transpose();
+    jacobian.block(2, 3, 1, 3) = dc2.transpose();
+
+    Matrix second = Matrix::Zero(6, 6);
+    second.block(0, 0, 3, 3) = g_q(0) * (I - u1 * u1.transpose()) / n1;
+    second.block(3, 3, 3, 3) = g_q(1) * (I - u2 * u2.transpose()) / n2;
+
+    Matrix cos_v = Matrix::Zero(6, 6);
+    cos_v.block(0, 0, 3, 3) = -v2 * v1.transpose() / (n1 * n1 * n1 * n2) - v1 * dc1.transpose() / (n1 * n1) - cost * (I / (n1 * n1) - 2 * v1 * v1.transpose() / pow(n1, 4));
+    cos_v.block(3, 3, 3, 3) = -v1 * v2.transpose() / (n1 * n2 * n2 * n2) - v2 * dc2.transpose() / (n2 * n2) - cost * (I / (n2 * n2) - 2 * v2 * v2.transpose() / pow(n2, 4));
+    cos_v.block(0, 3, 3, 3) = I / (n1 * n2) - v2 * v2.transpose() / (n1 * n2 * n2 * n2) - v1 * dc2.transpose() / (n1 * n1);
+    cos_v.block(3, 0, 3, 3) = cos_v.block(0, 3, 3, 3).transpose();
+    second += g_q(2) * (cos_v + cos_v.transpose()) / 2.0;
+
+    const Matrix hessian_v = jacobian.transpose() * h_q * jacobian + second;
+
+    /* v1 = a - b, v2 = a - c */
+    Matrix map = Matrix::Zero(6, 9);
+    map.block(0, 0, 3, 3) = I;
+    map.block(0, 3, 3, 3) = -I;
+    map.block(3, 0, 3, 3) = I;
+    map.block(3, 6, 3, 3) = -I;
+    hessian = map.transpose() * hessian_v * map;
+    if (!hessian.allFinite())
+        return Matrix::Zero(9, 9);
+    return hessian;
+}
+
+/*! \brief Lawson-Hanson active set NNLS on the normal equations G x = h */
+inline Vector SolveNNLS(const Matrix& G, const Vector& h, int maxiter = 0)
+{
+    const int n = h.size();
+    if (maxiter <= 0)
+        maxiter = 3 * n + 10;
+    const double tolerance = 1e-12 * std::max(1.0, h.cwiseAbs().maxCoeff());
+    Vector x = Vector::Zero(n);
+    std::vector<bool> passive(n, false);
+
+    auto solve_passive = [&](Vector& z) {
+        std::vector<int> index;
+        for (int i = 0; i < n; ++i)
+            if (passive[i])
+                index.push_back(i);
+        z = Vector::Zero(n);
+        if (index.empty())
+            return;
+        Matrix Gp(index.size(), index.size());
+        Vector hp(index.size());
+        for (int i = 0; i < index.size(); ++i) {
+            hp(i) = h(index[i]);
+            for (int j = 0; j < index.size(); ++j)
+                Gp(i, j) = G(index[i], index[j]);
+        }
+        Vector zp = Gp.ldlt().solve(hp);
+        for (int i = 0; i < index.size(); ++i)
+            z(index[i]) = zp(i);
+    };
+
+    for (int iter = 0; iter < maxiter; ++iter) {
+        Vector w = h - G * x;
+        int next = -1;
+        double best = tolerance;
+        for (int i = 0; i < n; ++i)
+            if (!passive[i] && w(i) > best) {
+                best = w(i);
+                next = i;
+            }
+        if (next == -1)
+            break;
+        passive[next] = true;
+
+        Vector z;
+        solve_passive(z);
+        while (true) {
+            double alpha = 2;
+            for (int i = 0; i < n; ++i)
+                if (passive[i] && z(i) <= 0)
+                    alpha = std::min(alpha, x(i) / (x(i) - z(i)));
+            if (alpha > 1)
+                break;
+            x += alpha * (z - x);
+            for (int i = 0; i < n; ++i)
+                if (passive[i] && x(i) <= tolerance) {
+                    passive[i] = false;
+                    x(i) = 0;
+                }
+            solve_passive(z);
+        }
+        x = z;
+    }
+    return x;
+}
+
+/*! \brief Fit bond (kAB) and angle (kabc) force constants to hessian - const_hessian
+ *
+ * Rows of the least-squares problem are the upper triangle of the 3N x 3N hessian, columns are the
+ * unit force constant hessians of all terms. regularisation adds a Tikhonov term lambda |k|^2,
+ * nonnegative switches from the plain normal equations to NNLS.
+ */
+inline Vector LinearFitFC(const Matrix& geometry, const Matrix& hessian, const Matrix& const_hessian, const std::vector<QMDFFBond>& bonds, const std::vector<QMDFFAngle>& angles, double regularisation, bool nonnegative, double angle_scaling = 1)
+{
+    const int dim = hessian.rows();
+    const int terms = bonds.size() + angles.size();
+    auto row = [dim](int p, int q) -> int {
+        if (p > q)
+            std::swap(p, q);
+        return p * dim - p * (p - 1) / 2 + (q - p);
+    };
+    const int rows = dim * (dim + 1) / 2;
+
+    Vector target(rows);
+    for (int p = 0; p < dim; ++p)
+        for (int q = p; q < dim; ++q)
+            target(row(p, q)) = hessian(p, q) - const_hessian(p, q);
+
+    std::vector<Eigen::Triplet<double>> triplets;
+    auto add_block = [&](int column, const Matrix& block, const std::vector<int>& atoms) {
+        for (int i = 0; i < block.rows(); ++i) {
+            const int p = 3 * atoms[i / 3] + i % 3;
+            for (int j = 0; j < block.cols(); ++j) {
+                const int q = 3 * atoms[j / 3] + j % 3;
+                if (p <= q && block(i, j) != 0)
+                    triplets.emplace_back(row(p, q), column, block(i, j));
+            }
+        }
+    };
+
+    int column = 0;
+    for (const auto& bond : bonds) {
+        add_block(column, QMDFFStretchHessian(geometry.row(bond.a), geometry.row(bond.b), bond.reAB, bond.exponA), { bond.a, bond.b });
+        ++column;
+    }
+    for (const auto& angle : angles) {
+        add_block(column, angle_scaling * QMDFFBendHessian(geometry.row(angle.a), geometry.row(angle.b), geometry.row(angle.c), angle.thetae, angle.reAB, angle.reAC), { angle.a, angle.b, angle.c });
+        ++column;
+    }
+
+    Eigen::SparseMatrix<double> A(rows, terms);
+    A.setFromTriplets(triplets.begin(), triplets.end());
+
+    Matrix G = Matrix(A.transpose() * A);
+    Vector h = A.transpose() * target;
+    G.diagonal().array() += regularisation;
+
+    Vector fc = nonnegative ? SolveNNLS(G, h) : Vector(G.ldlt().solve(h));
+
+    const double residual = target.squaredNorm() - 2 * fc.dot(h) + fc.dot(G * fc);
+    std::cout << "Linear force constant fit: " << terms << " terms, " << triplets.size() << " hessian entries, residual norm " << sqrt(std::max(0.0, residual)) << " (reference " << target.norm() << ")" << std::endl;
+    return fc;
+}
@@ -0,0 +1,248 @@
+/*
+ * <Rigid fragment alignment of NEB end points with analytic gradients. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <LBFGS.h>
+
+#include <cmath>
+#include <iostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "src/core/elements.h"
+#include "src/core/global.h"
+#include "src/core/molecule.h"
+
+/* Every fragment (except the first one) of both end points moves as rigid body, x = c + t + R(w)(x0 - c) with
+ * the rotation vector w. The objective is
+ *   sum_i |a_i - b_i|^2 + penalty * sum_pairs max(0, scaling * (rcov_p + rcov_q) - d_pq)^2
+ * where the pairs are atoms of different fragments of the same end point. Pairs are taken from a Verlet list,
+ * which is rebuilt once an atom moved more than half the skin. */
+class NEBAlignmentFunctor {
+public:
+    NEBAlignmentFunctor(const Molecule& first, const Molecule& second, bool protons, double scaling, double penalty)
+        : m_scaling(scaling)
+        , m_penalty(penalty)
+    {
+        m_endpoints[0].Load(first);
+        m_endpoints[1].Load(second);
+        for (int i = 0; i < first.AtomCount(); ++i)
+            m_weights.push_back(protons || first.Atom(i).first != 1 ? 1.0 : 0.0);
+        double radius = 0;
+        for (int i = 0; i < first.AtomCount(); ++i)
+            radius = std::max(radius, Elements::CovalentRadius[first.Atom(i).first]);
+        m_cutoff = 2 * radius * scaling + m_skin;
+    }
+
+    inline int Parameters() const { return 6 * (m_endpoints[0].Movable() + m_endpoints[1].Movable()); }
+
+    double operator()(const Eigen::VectorXd& x, Eigen::VectorXd& grad)
+    {
+        const int offset = 6 * m_endpoints[0].Movable();
+        m_endpoints[0].Place(x.head(offset));
+        m_endpoints[1].Place(x.tail(x.size() - offset));
+
+        const int atoms = m_weights.size();
+        Geometry gradient[2] = { Geometry::Zero(atoms, 3), Geometry::Zero(atoms, 3) };
+        double fx = 0;
+        for (int i = 0; i < atoms; ++i) {
+            const Eigen::RowVector3d delta = m_endpoints[0].positions.row(i) - m_endpoints[1].positions.row(i);
+            fx += m_weights[i] * delta.squaredNorm();
+            gradient[0].row(i) += 2 * m_weights[i] * delta;
+            gradient[1].row(i) -= 2 * m_weights[i] * delta;
+        }
+        for (int e = 0; e < 2; ++e) {
+            Endpoint& endpoint = m_endpoints[e];
+            if (endpoint.NeedsUpdate(m_skin))
+                endpoint.UpdatePairs(m_cutoff);
+            for (const auto& pair : endpoint.pairs) {
+                const int p = pair.first, q = pair.second;
+                const Eigen::RowVector3d delta = endpoint.positions.row(p) - endpoint.positions.row(q);
+                const double distance = delta.norm();
+                const double minimum = m_scaling * (Elements::CovalentRadius[endpoint.elements[p]] + Elements::CovalentRadius[endpoint.elements[q]]);
+                if (distance >= minimum || distance < 1e-8)
+                    continue;
+                const double overlap = minimum - distance;
+                fx += m_penalty * overlap * overlap;
+                const Eigen::RowVector3d force = -2 * m_penalty * overlap / distance * delta;
+                gradient[e].row(p) += force;
+                gradient[e].row(q) -= force;
+            }
+        }
+        grad.head(offset) = m_endpoints[0].Chain(gradient[0]);
+        grad.tail(x.size() - offset) = m_endpoints[1].Chain(gradient[1]);
+        return fx;
+    }
+
+    inline const Geometry& Positions(int endpoint) const { return m_endpoints[endpoint].positions; }
+
+private:
+    struct Endpoint {
+        void Load(const Molecule& molecule)
+        {
+            reference = molecule.getGeometry();
+            positions = reference;
+            last_update = reference;
+            for (int i = 0; i < molecule.AtomCount(); ++i)
+                elements.push_back(molecule.Atom(i).first);
+            fragments = molecule.GetFragments();
+            fragment_of = std::vector<int>(molecule.AtomCount(), 0);
+            for (int f = 0; f < fragments.size(); ++f) {
+                Eigen::RowVector3d centroid = Eigen::RowVector3d::Zero();
+                for (int i : fragments[f]) {
+                    fragment_of[i] = f;
+                    centroid += reference.row(i);
+                }
+                centroids.push_back(centroid / std::max<std::size_t>(1, fragments[f].size()));
+            }
+            rotations = std::vector<Eigen::Matrix3d>(fragments.size(), Eigen::Matrix3d::Identity());
+            jacobians = rotations;
+        }
+
+        inline int Movable() const { return std::max<int>(0, fragments.size() - 1); }
+
+        /* fragment 0 stays in place, fragment f > 0 uses parameters 6(f - 1) .. 6f - 1 (translation, rotation vector) */
+        void Place(const Eigen::VectorXd& parameter)
+        {
+            for (int f = 1; f < fragments.size(); ++f) {
+                const Eigen::Vector3d translation = parameter.segment<3>(6 * (f - 1));
+                const Eigen::Vector3d omega = parameter.segment<3>(6 * (f - 1) + 3);
+                const double angle = omega.norm();
+                Eigen::Matrix3d skew;
+                skew << 0, -omega(2), omega(1), omega(2), 0, -omega(0), -omega(1), omega(0), 0;
+                if (angle > 1e-8) {
+                    rotations[f] = Eigen::AngleAxisd(angle, omega / angle).toRotationMatrix();
+                    /* right Jacobian of SO(3) */
+                    jacobians[f] = Eigen::Matrix3d::Identity() - (1 - std::cos(angle)) / (angle * angle) * skew + (angle - std::sin(angle)) / (angle * angle * angle) * skew * skew;
+                } else {
+                    rotations[f] = Eigen::Matrix3d::Identity() + skew;
+                    jacobians[f] = Eigen::Matrix3d::Identity() - 0.5 * skew;
+                }
+                for (int i : fragments[f])
+                    positions.row(i) = centroids[f] + translation.transpose() + (reference.row(i) - centroids[f]) * rotations[f].transpose();
+            }
+        }
+
+        /* dE/dt = sum g_i, dE/dw = J_r^T sum (x0_i - c) x (R^T g_i) */
+        Eigen::VectorXd Chain(const Geometry& gradient) const
+        {
+            Eigen::VectorXd result = Eigen::VectorXd::Zero(6 * Movable());
+            for (int f = 1; f < fragments.size(); ++f) {
+                Eigen::Vector3d translation = Eigen::Vector3d::Zero(), torque = Eigen::Vector3d::Zero();
+                for (int i : fragments[f]) {
+                    const Eigen::Vector3d g = gradient.row(i).transpose();
+                    const Eigen::Vector3d arm = (reference.row(i) - centroids[f]).transpose();
+                    translation += g;
+                    torque += arm.cross(rotations[f].transpose() * g);
+                }
+                result.segment<3>(6 * (f - 1)) = translation;
+                result.segment<3>(6 * (f - 1) + 3) = jacobians[f].transpose() * torque;
+            }
+            return result;
+        }
+
+        inline bool NeedsUpdate(double skin) const
+        {
+            if (pairs.empty() && !built)
+                return true;
+            return (positions - last_update).rowwise().squaredNorm().maxCoeff() > 0.25 * skin * skin;
+        }
+
+        /* cell list over all atoms, only pairs of different fragments are kept */
+        void UpdatePairs(double cutoff)
+        {
+            pairs.clear();
+            built = true;
+            last_update = positions;
+            std::unordered_map<long long, std::vector<int>> cells;
+            auto key = [](long long x, long long y, long long z) { return ((x & 0x1FFFFF) << 42) | ((y & 0x1FFFFF) << 21) | (z & 0x1FFFFF); };
+            auto cell = [cutoff](double v) { return static_cast<long long>(std::floor(v / cutoff)); };
+            for (int i = 0; i < positions.rows(); ++i)
+                cells[key(cell(positions(i, 0)), cell(positions(i, 1)), cell(positions(i, 2)))].push_back(i);
+            const double cutoff2 = cutoff * cutoff;
+            for (int i = 0; i < positions.rows(); ++i) {
+                const long long cx = cell(positions(i, 0)), cy = cell(positions(i, 1)), cz = cell(positions(i, 2));
+                for (long long x = cx - 1; x <= cx + 1; ++x)
+                    for (long long y = cy - 1; y <= cy + 1; ++y)
+                        for (long long z = cz - 1; z <= cz + 1; ++z) {
+                            auto found = cells.find(key(x, y, z));
+                            if (found == cells.end())
+                                continue;
+                            for (int j : found->second)
+                                if (j > i && fragment_of[i] != fragment_of[j] && (positions.row(i) - positions.row(j)).squaredNorm() < cutoff2)
+                                    pairs.emplace_back(i, j);
+                        }
+            }
+        }
+
+        Geometry reference, positions, last_update;
+        std::vector<int> elements, fragment_of;
+        std::vector<std::vector<int>> fragments;
+        std::vector<Eigen::RowVector3d> centroids;
+        std::vector<Eigen::Matrix3d> rotations, jacobians;
+        std::vector<std::pair<int, int>> pairs;
+        bool built = false;
+    };
+
+    Endpoint m_endpoints[2];
+    std::vector<double> m_weights;
+    double m_scaling = 1.5, m_penalty = 10, m_cutoff = 5, m_skin = 1.0;
+};
+
+/*! \brief Rigid-body alignment of the fragments of both end points, replaces the LevMar/NumericalDiff translation fit */
+inline std::pair<Molecule, Molecule> AlignNEBEndpoints(const Molecule& first, const Molecule& second, bool protons = false, double scaling = 1.5, double penalty = 10, int maxiter = 1000)
+{
+    using namespace LBFGSpp;
+
+    NEBAlignmentFunctor functor(first, second, protons, scaling, penalty);
+    std::pair<Molecule, Molecule> result(first, second);
+    if (functor.Parameters() == 0 || first.AtomCount() != second.AtomCount())
+        return result;
+
+    LBFGSParam<double> param;
+    param.epsilon = 1e-6;
+    LBFGSSolver<double> solver(param);
+    Vector parameter = Vector::Zero(functor.Parameters());
+    double fx;
+    int converged = solver.InitializeSingleSteps(functor, parameter, fx);
+    Vector old_parameter = parameter;
+    for (int iteration = 0; iteration < maxiter && !converged; ++iteration) {
+        try {
+            solver.SingleStep(functor, parameter, fx);
+        } catch (const std::logic_error& error_result) {
+            break;
+        } catch (const std::runtime_error& error_result) {
+            break;
+        }
+        if (solver.isConverged() || (old_parameter - parameter).norm() < 1e-6)
+            break;
+        old_parameter = parameter;
+    }
+    /* evaluate the final parameter once more, the solver may have stopped after a trial step */
+    Vector gradient(parameter.size());
+    functor(parameter, gradient);
+    result.first.setGeometry(functor.Positions(0));
+    result.second.setGeometry(functor.Positions(1));
+    return result;
+}
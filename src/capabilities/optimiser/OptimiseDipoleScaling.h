@@ -24,6 +24,9 @@
 #include <unsupported/Eigen/NonLinearOptimization>
 
 #include <iostream>
+#include <vector>
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
 
 #include "src/capabilities/optimiser/LevMarDocking.h"
 #include "src/core/elements.h"
@@ -92,7 +95,7 @@ struct OptDipoleFunctorNumericalDiff : Eigen::NumericalDiff<OptDipoleFunctor> {
 inline Vector OptimiseDipoleScaling(const std::vector<Molecule>& conformers, Vector scaling)
 {
 
-    OptDipoleFunctor functor(6,conformers.size());
+    OptDipoleFunctor functor(scaling.size(), conformers.size());
     functor.m_conformers = conformers;
     Eigen::NumericalDiff<OptDipoleFunctor> numDiff(functor);
     Eigen::LevenbergMarquardt<Eigen::NumericalDiff<OptDipoleFunctor>> lm(numDiff);
@@ -126,37 +129,176 @@ inline Vector OptimiseDipoleScaling(const std::vector<Molecule>& conformers, Vec
 }
 
 
-inline Matrix DipoleScalingCalculation(const std::vector<Molecule>& conformers){
-    std::vector<Position> y;
-    std::vector<Geometry> F;
-    auto para_size = conformers[0].AtomCount();
-    auto conformer_size = conformers.size();
-    Matrix FTF(para_size, para_size);
-    Vector FTy(para_size);
-    for (const auto & conformer : conformers) {
-        y.push_back(conformer.getDipole());//TODO Einheit überprüfen
-        F.push_back(conformer.ChargeDistribution());
-    }
+/* The dipole model is linear in the atomic scaling factors: mu_c = sum_j s_j q_j r_j, so every conformer c
+ * contributes three rows (x, y, z) of the design matrix F(3c + k, j) = q_j r_j(k) and the targets y(3c + k) = mu_c(k).
+ * r_j is taken relative to the centre of mass like in CalculateDipoleMoment, otherwise the fit of scaled charges
+ * that do not sum to zero would depend on the position of the molecule.
+ * F is assembled once (in parallel blocks of conformers) and s solves min |W^1/2 (F s - y)|^2 + ridge |s - 1|^2,
+ * the ridge term pulls the factors towards the unscaled charges. */
 
-    for (int i = 0; i < para_size; ++i){
-        for (int j = 0; j < para_size; ++j){
-            for (auto & k : F)
-                FTF(i, j) += k(i, 0) * k(j, 0) + k(i, 1) * k(j, 1) + k(i, 2) * k(j, 2);
-        }
+/* q_j (r_j - r_com), the rows of the design matrix of one conformer */
+inline Geometry CentredChargeDistribution(const Molecule& molecule)
+{
+    Geometry distribution = molecule.ChargeDistribution();
+    const std::vector<double> charges = molecule.getPartialCharges();
+    if (charges.size() != distribution.rows())
+        return distribution;
+    const Position centre = molecule.MassCentroid();
+    for (int i = 0; i < distribution.rows(); ++i)
+        distribution.row(i) -= charges[i] * centre.transpose();
+    return distribution;
+}
+
+class DipoleDesignThread : public CxxThread {
+public:
+    DipoleDesignThread(const std::vector<Molecule>& conformers, const std::vector<double>& weights, Matrix& design, Vector& target, int begin, int end)
+        : m_conformers(conformers)
+        , m_weights(weights)
+        , m_design(design)
+        , m_target(target)
+        , m_begin(begin)
+        , m_end(end)
+    {
+        setAutoDelete(false);
     }
 
-    for (int j = 0; j < para_size; ++j) {
-        for (int i = 0; i < conformer_size; ++i){
-            FTy(j) += y[i](0) * F[i](j, 0) + y[i](1) * F[i](j, 1) + y[i](2) * F[i](j, 2);
+    int execute() override
+    {
+        for (int c = m_begin; c < m_end; ++c) {
+            const double weight = m_weights.size() > c ? std::sqrt(m_weights[c]) : 1.0;
+            const Geometry distribution = CentredChargeDistribution(m_conformers[c]);
+            const Position dipole = m_conformers[c].getDipole();
+            for (int k = 0; k < 3; ++k) {
+                m_design.row(3 * c + k) = weight * distribution.col(k).transpose();
+                m_target(3 * c + k) = weight * dipole(k);
+            }
         }
+        return 0;
     }
 
+private:
+    const std::vector<Molecule>& m_conformers;
+    const std::vector<double>& m_weights;
+    Matrix& m_design;
+    Vector& m_target;
+    int m_begin, m_end;
+};
 
-    Matrix Theta(para_size,1);
+struct DipoleScalingFit {
+    Vector scaling;
+    double rmse = 0; /* root mean square of |mu_fit - mu_ref| over the conformers */
+    double mae = 0;
+    double max_error = 0;
+    double r2 = 0; /* coefficient of determination over all dipole components */
+    double unscaled_rmse = 0; /* same with all factors 1 */
+    double cv_rmse = -1; /* k-fold cross validation, -1 if not done */
+    int folds = 0;
+};
 
-    Theta = FTF.inverse() * FTy;
-    
+/*! \brief Weighted (ridge) least squares of the dipole scaling factors, optional k-fold cross validation
+ *
+ * The full fit uses a column pivoting QR of the (augmented) design matrix. For cross validation the Gram
+ * matrix of every fold is accumulated once, the training system of a fold is the total minus that fold.
+ */
+inline DipoleScalingFit FitDipoleScaling(const std::vector<Molecule>& conformers, double ridge = 0, int folds = 0, int threads = 1, const std::vector<double>& weights = std::vector<double>())
+{
+    DipoleScalingFit fit;
+    if (conformers.empty())
+        return fit;
+    const int parameter = conformers[0].AtomCount();
+    const int count = conformers.size();
+    for (const auto& conformer : conformers)
+        if (conformer.AtomCount() != parameter) {
+            std::cerr << "All conformers need the same number of atoms for the dipole scaling fit." << std::endl;
+            return fit;
+        }
+
+    Matrix design(3 * count, parameter);
+    Vector target(3 * count);
+    threads = std::max(1, std::min(threads, count));
+    std::vector<DipoleDesignThread*> workers;
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setProgressBar(CxxThreadPool::ProgressBarType::None);
+    pool->setActiveThreadCount(threads);
+    const int block = (count + threads - 1) / threads;
+    for (int begin = 0; begin < count; begin += block) {
+        DipoleDesignThread* worker = new DipoleDesignThread(conformers, weights, design, target, begin, std::min(count, begin + block));
+        pool->addThread(worker);
+        workers.push_back(worker);
+    }
+    pool->StaticPool();
+    pool->StartAndWait();
+    pool->clear();
+    delete pool;
+    for (auto* worker : workers)
+        delete worker;
+
+    const Vector ones = Vector::Ones(parameter);
+    if (ridge > 0) {
+        Matrix augmented(3 * count + parameter, parameter);
+        Vector rhs(3 * count + parameter);
+        augmented << design, std::sqrt(ridge) * Matrix::Identity(parameter, parameter);
+        rhs << target, std::sqrt(ridge) * ones;
+        fit.scaling = augmented.colPivHouseholderQr().solve(rhs);
+    } else
+        fit.scaling = design.colPivHouseholderQr().solve(target);
+
+    /* statistics on the unweighted dipoles */
+    double sum_squares = 0, sum_unscaled = 0, residual = 0, total = 0, mean = 0;
+    for (const auto& conformer : conformers)
+        mean += conformer.getDipole().sum();
+    mean /= 3.0 * count;
+    for (const auto& conformer : conformers) {
+        const Geometry distribution = CentredChargeDistribution(conformer);
+        const Position reference = conformer.getDipole();
+        const Position fitted = distribution.transpose() * fit.scaling;
+        const Position unscaled = distribution.colwise().sum().transpose();
+        const double error = (fitted - reference).norm();
+        sum_squares += error * error;
+        sum_unscaled += (unscaled - reference).squaredNorm();
+        fit.mae += error;
+        fit.max_error = std::max(fit.max_error, error);
+        residual += error * error;
+        total += (reference.array() - mean).square().sum();
+    }
+    fit.rmse = std::sqrt(sum_squares / count);
+    fit.unscaled_rmse = std::sqrt(sum_unscaled / count);
+    fit.mae /= count;
+    fit.r2 = total > 0 ? 1 - residual / total : 1;
+
+    if (folds > 1 && count >= folds) {
+        std::vector<Matrix> gram(folds, Matrix::Zero(parameter, parameter));
+        std::vector<Vector> projection(folds, Vector::Zero(parameter));
+        for (int c = 0; c < count; ++c) {
+            const auto rows = design.middleRows(3 * c, 3);
+            gram[c % folds].noalias() += rows.transpose() * rows;
+            projection[c % folds].noalias() += rows.transpose() * target.segment(3 * c, 3);
+        }
+        Matrix gram_total = Matrix::Zero(parameter, parameter);
+        Vector projection_total = Vector::Zero(parameter);
+        for (int f = 0; f < folds; ++f) {
+            gram_total += gram[f];
+            projection_total += projection[f];
+        }
+        double cv = 0;
+        for (int f = 0; f < folds; ++f) {
+            Matrix system = gram_total - gram[f];
+            Vector rhs = projection_total - projection[f];
+            /* a tiny ridge keeps folds solvable if the training set alone is rank deficient */
+            const double lambda = std::max(ridge, 1e-10 * system.diagonal().cwiseAbs().maxCoeff());
+            system.diagonal().array() += lambda;
+            rhs += lambda * ones;
+            const Vector scaling = system.ldlt().solve(rhs);
+            for (int c = f; c < count; c += folds)
+                cv += (CentredChargeDistribution(conformers[c]).transpose() * scaling - conformers[c].getDipole()).squaredNorm();
+        }
+        fit.cv_rmse = std::sqrt(cv / count);
+        fit.folds = folds;
+    }
+    return fit;
+}
 
-    //inv(F.t@F)@(F.t@y);
-    return Theta;
-}
\ No newline at end of file
+inline Matrix DipoleScalingCalculation(const std::vector<Molecule>& conformers)
+{
+    return FitDipoleScaling(conformers).scaling;
+}
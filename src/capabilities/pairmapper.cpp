@@ -17,15 +17,18 @@
  *
  */
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <map>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "src/core/elements.h"
+#include "src/core/fileiterator.h"
 #include "src/core/molecule.h"
 
 #include "src/tools/general.h"
@@ -33,6 +36,136 @@
 
 #include "pairmapper.h"
 
+/* Uniform cell list over a subset of atoms, neighbours are searched in the adjacent cells only */
+struct PairMapperCells {
+    PairMapperCells(const Matrix& geometry, const std::vector<int>& atoms, double cellsize)
+        : m_geometry(geometry)
+        , m_cell(cellsize)
+    {
+        if (atoms.empty())
+            return;
+        m_min = geometry.row(atoms[0]);
+        Eigen::RowVector3d max = m_min;
+        for (int a : atoms) {
+            m_min = m_min.cwiseMin(geometry.row(a));
+            max = max.cwiseMax(geometry.row(a));
+        }
+        for (int k = 0; k < 3; ++k)
+            m_n[k] = int((max(k) - m_min(k)) / m_cell) + 1;
+
+        std::vector<int> cells(atoms.size());
+        m_start.assign(std::size_t(m_n[0]) * m_n[1] * m_n[2] + 1, 0);
+        for (std::size_t i = 0; i < atoms.size(); ++i) {
+            const Eigen::RowVector3d pos = geometry.row(atoms[i]);
+            cells[i] = Cell(Index(pos, 0), Index(pos, 1), Index(pos, 2));
+            m_start[cells[i] + 1]++;
+        }
+        for (std::size_t c = 1; c < m_start.size(); ++c)
+            m_start[c] += m_start[c - 1];
+        std::vector<int> fill(m_start.begin(), m_start.end() - 1);
+        m_sorted.resize(atoms.size());
+        for (std::size_t i = 0; i < atoms.size(); ++i)
+            m_sorted[fill[cells[i]]++] = atoms[i];
+    }
+
+    /* Calls function(atom, squared distance) for all atoms in the cells around pos */
+    template <typename Function>
+    void Neighbours(const Eigen::RowVector3d& pos, Function function) const
+    {
+        if (m_sorted.empty())
+            return;
+        const int cx = Index(pos, 0), cy = Index(pos, 1), cz = Index(pos, 2);
+        for (int x = std::max(0, cx - 1); x <= std::min(m_n[0] - 1, cx + 1); ++x)
+            for (int y = std::max(0, cy - 1); y <= std::min(m_n[1] - 1, cy + 1); ++y)
+                for (int z = std::max(0, cz - 1); z <= std::min(m_n[2] - 1, cz + 1); ++z) {
+                    const int c = Cell(x, y, z);
+                    for (int k = m_start[c]; k < m_start[c + 1]; ++k)
+                        function(m_sorted[k], (m_geometry.row(m_sorted[k]) - pos).squaredNorm());
+                }
+    }
+
+private:
+    inline int Cell(int x, int y, int z) const { return (x * m_n[1] + y) * m_n[2] + z; }
+    inline int Index(const Eigen::RowVector3d& pos, int k) const { return int(std::floor((pos(k) - m_min(k)) / m_cell)); }
+
+    const Matrix& m_geometry;
+    Eigen::RowVector3d m_min;
+    std::vector<int> m_start, m_sorted;
+    double m_cell;
+    int m_n[3] = { 1, 1, 1 };
+};
+
+int PairMapperThread::execute()
+{
+    for (int i = m_start; i < m_end; ++i) {
+        if (m_intra)
+            Scan(m_frames->at(i));
+        else
+            Discover(m_frames->at(i).geometry);
+    }
+    return 0;
+}
+
+void PairMapperThread::Discover(const Matrix& geometry)
+{
+    const PairMapperTopology& top = *m_topology;
+    const double cutoff2 = top.cutoff * top.cutoff;
+    const PairMapperCells cells(geometry, top.acceptors, top.cutoff);
+
+    for (int h : top.donors) {
+        cells.Neighbours(geometry.row(h), [&](int a, double d2) {
+            if (d2 >= cutoff2)
+                return;
+            const std::pair<int, int> pair(std::min(a, h), std::max(a, h));
+            if (top.fragment[a] != top.fragment[h])
+                m_found_inter.insert(pair);
+            else if (std::sqrt(d2) > (top.radius[a] + top.radius[h]) * top.scaling)
+                m_found_intra.insert(pair);
+        });
+    }
+}
+
+void PairMapperThread::Scan(PairMapperFrame& frame) const
+{
+    const Matrix& geometry = frame.geometry;
+    auto distance = [&geometry](const std::pair<int, int>& p) { return (geometry.row(p.first) - geometry.row(p.second)).norm(); };
+
+    std::ostringstream intra, inter, user, centroid;
+    for (const std::pair<int, int>& p : *m_intra)
+        intra << distance(p) << "    ";
+    intra << "\n";
+
+    for (const std::pair<int, int>& p : *m_inter)
+        inter << distance(p) << "    ";
+    inter << "\n";
+
+    frame.user_values.clear();
+    for (const std::pair<int, int>& p : *m_user) {
+        const double d = distance(p);
+        user << d << "    ";
+        frame.user_values.push_back(d);
+    }
+    user << "\n";
+
+    const auto& fragments = m_topology->fragments;
+    std::vector<Eigen::RowVector3d> centroids;
+    for (const auto& fragment : fragments) {
+        Eigen::RowVector3d c = Eigen::RowVector3d::Zero();
+        for (int atom : fragment)
+            c += geometry.row(atom);
+        centroids.push_back(c / double(fragment.size()));
+    }
+    for (std::size_t i = 0; i < centroids.size(); ++i)
+        for (std::size_t j = i + 1; j < centroids.size(); ++j)
+            centroid << (centroids[i] - centroids[j]).norm() << "    ";
+    centroid << "\n";
+
+    frame.intra = intra.str();
+    frame.inter = inter.str();
+    frame.user = user.str();
+    frame.centroid = centroid.str();
+}
+
 PairMapper::PairMapper()
 {
 }
@@ -49,34 +182,30 @@ void PairMapper::FindPairs()
     m_centroid_file.open(outfile + "_centroid.dat");
     m_pair_file.open(outfile + "_pairs.dat");
 
-    std::ifstream input(m_filename);
-    std::vector<std::string> lines;
-    int atoms = 0;
-    int index = 0;
-    int i = 0;
-    bool xyzfile = std::string(m_filename).find(".xyz") != std::string::npos || std::string(m_filename).find(".trj") != std::string::npos;
-    Molecule mol(atoms, 0);
-    for (std::string line; getline(input, line);) {
-        if (index == 0 && xyzfile) {
-            atoms = stoi(line);
-            mol = Molecule(atoms, 0);
-        }
-        if (xyzfile) {
-            if (i > 1) {
-                mol.setXYZ(line, i - 2);
-            }
-            if (i - 1 == atoms) {
-                InitialisePairs(&mol);
-                i = -1;
-                mol = Molecule(atoms, 0);
-            }
-            ++i;
-        } else {
-            mol.setAtom(line, i);
-        }
-        index++;
+    const int threads = std::max(1, m_threads);
+    std::vector<PairMapperThread*> workers;
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setProgressBar(CxxThreadPool::ProgressBarType::None);
+    pool->setActiveThreadCount(threads);
+    for (int i = 0; i < threads; ++i) {
+        workers.push_back(new PairMapperThread(&m_topology));
+        pool->addThread(workers.back());
     }
 
+    /* first pass, candidates are collected per thread and merged afterwards */
+    {
+        FileIterator file(m_filename, true);
+        while (ProcessBlock(file, workers, pool, false))
+            ;
+    }
+    std::set<std::pair<int, int>> intra, inter;
+    for (auto* worker : workers) {
+        intra.insert(worker->IntraPairs().begin(), worker->IntraPairs().end());
+        inter.insert(worker->InterPairs().begin(), worker->InterPairs().end());
+    }
+    m_intra_pairs.assign(intra.begin(), intra.end());
+    m_inter_pairs.assign(inter.begin(), inter.end());
+
     m_intermol_file << "# ";
     for (const std::pair<int, int>& p : m_inter_pairs) {
         m_intermol_file << "(" << std::setprecision(6) << p.first + 1 << "-" << p.second + 1 << ")   ";
@@ -100,28 +229,18 @@ void PairMapper::FindPairs()
     }
     m_user_file << std::endl;
 
-    std::ifstream input2(m_filename);
-
-    for (std::string line; getline(input2, line);) {
-        if (index == 0 && xyzfile) {
-            atoms = stoi(line);
-            mol = Molecule(atoms, 0);
-        }
-        if (xyzfile) {
-            if (i > 1) {
-                mol.setXYZ(line, i - 2);
-            }
-            if (i - 1 == atoms) {
-                ScanPairs(&mol);
-                i = -1;
-                mol = Molecule(atoms, 0);
-            }
-            ++i;
-        } else {
-            mol.setAtom(line, i);
-        }
-        index++;
+    /* second pass, distances of the known pairs */
+    for (auto* worker : workers)
+        worker->setPairs(&m_intra_pairs, &m_inter_pairs, &m_user_pairs);
+    {
+        FileIterator file(m_filename, true);
+        while (ProcessBlock(file, workers, pool, true))
+            ;
     }
+    pool->clear();
+    delete pool;
+    for (auto* worker : workers)
+        delete worker;
 
     Statistic();
 
@@ -131,93 +250,88 @@ void PairMapper::FindPairs()
     m_user_file.close();
 }
 
-void PairMapper::InitialisePairs(const Molecule* molecule)
+bool PairMapper::ProcessBlock(FileIterator& file, std::vector<PairMapperThread*>& workers, CxxThreadPool* pool, bool scan)
 {
-    for (std::size_t i = 0; i < molecule->AtomCount(); ++i) {
-        const int element_A = molecule->Atom(i).first;
-        for (std::size_t j = i + 1; j < molecule->AtomCount(); ++j) {
-            const int element_B = molecule->Atom(j).first;
-            for (const std::pair<int, int>& pair : m_element_pairs) {
-                if ((element_A == pair.first && element_B == pair.second) || (element_B == pair.first && element_A == pair.second))
-                    addPair(std::pair<int, int>(i, j));
-            }
+    std::vector<PairMapperFrame> frames;
+    while (!file.AtEnd() && frames.size() < m_blocksize) {
+        Molecule molecule = file.Next();
+        if (m_topology.elements.empty())
+            InitialiseTopology(molecule);
+        if (molecule.AtomCount() != m_topology.elements.size()) {
+            std::cout << "Warning: skipping frame with " << molecule.AtomCount() << " atoms, the topology has " << m_topology.elements.size() << " atoms." << std::endl;
+            continue;
         }
+        frames.emplace_back();
+        frames.back().geometry = molecule.getGeometry();
     }
+    if (frames.empty())
+        return false;
 
-    if (m_proton_blacklist.size() == 0) {
-        BlackListProtons(molecule);
+    const int chunk = (frames.size() + workers.size() - 1) / workers.size();
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        const int begin = std::min(int(frames.size()), int(i) * chunk);
+        workers[i]->setFrames(&frames, begin, std::min(int(frames.size()), begin + chunk));
     }
-
-    std::vector<std::vector<int>> f = molecule->GetFragments();
-
-    for (std::size_t i = 0; i < f.size(); ++i) {
-        for (std::size_t k = 0; k < f[i].size(); ++k) {
-            for (std::size_t l = k + 1; l < f[i].size(); ++l) {
-                int a = f[i][k];
-                int b = f[i][l];
-                if ((std::find(m_proton_blacklist.begin(), m_proton_blacklist.end(), a) != m_proton_blacklist.end()) || (std::find(m_proton_blacklist.begin(), m_proton_blacklist.end(), b) != m_proton_blacklist.end()))
-                    continue;
-                double distance = molecule->CalculateDistance(a, b);
-                if (distance < m_cutoff && distance > (Elements::CovalentRadius[molecule->Atom(a).first] + Elements::CovalentRadius[molecule->Atom(b).first]) * m_scaling) {
-                    if ((molecule->Atom(a).first == 1 && (molecule->Atom(b).first == 7 || molecule->Atom(b).first == 8)) || ((molecule->Atom(a).first == 7 || molecule->Atom(a).first == 8) && molecule->Atom(b).first == 1)) {
-                        addPair(std::pair<double, double>(a, b), m_intra_pairs);
-                    }
-                }
-            }
-        }
-    }
-
-    for (std::size_t i = 0; i < f.size(); ++i) {
-        for (std::size_t j = i + 1; j < f.size(); ++j) {
-            for (int a : f[i]) {
-                for (int b : f[j]) {
-                    if ((std::find(m_proton_blacklist.begin(), m_proton_blacklist.end(), a) != m_proton_blacklist.end()) || (std::find(m_proton_blacklist.begin(), m_proton_blacklist.end(), b) != m_proton_blacklist.end()))
-                        continue;
-
-                    double distance = GeometryTools::Distance(molecule->Atom(a).second, molecule->Atom(b).second); //molecule->Distance(a, b);
-                    if (distance < m_cutoff) {
-                        if ((molecule->Atom(a).first == 1 && (molecule->Atom(b).first == 7 || molecule->Atom(b).first == 8)) || ((molecule->Atom(a).first == 7 || molecule->Atom(a).first == 8) && molecule->Atom(b).first == 1)) {
-                            addPair(std::pair<double, double>(a, b), m_inter_pairs);
-                        }
-                    }
-                }
-            }
+    pool->Reset();
+    pool->StaticPool();
+    pool->StartAndWait();
+
+    if (scan) {
+        for (const auto& frame : frames) {
+            m_intramol_file << frame.intra;
+            m_intermol_file << frame.inter;
+            m_user_file << frame.user;
+            m_centroid_file << frame.centroid;
+            for (std::size_t i = 0; i < frame.user_values.size(); ++i)
+                m_user_vector[i].push_back(frame.user_values[i]);
         }
     }
+    return true;
 }
 
-void PairMapper::ScanPairs(const Molecule* molecule)
+void PairMapper::InitialiseTopology(const Molecule& molecule)
 {
-    for (const std::pair<int, int>& p : m_intra_pairs) {
-        m_intramol_file << molecule->CalculateDistance(p.first, p.second) << "    ";
+    m_topology.cutoff = m_cutoff;
+    m_topology.scaling = m_scaling;
+    m_topology.elements = molecule.Atoms();
+    for (int element : m_topology.elements)
+        m_topology.radius.push_back(Elements::CovalentRadius[element]);
+
+    /* requested element pairs are tracked for all matching atoms regardless of their distance,
+     * they follow the explicitly requested pairs */
+    std::set<int> requested;
+    for (const std::pair<int, int>& pair : m_topology.element_pairs) {
+        requested.insert(pair.first);
+        requested.insert(pair.second);
     }
-    m_intramol_file << std::endl;
+    std::vector<int> atoms;
+    for (std::size_t i = 0; i < m_topology.elements.size(); ++i)
+        if (requested.count(m_topology.elements[i]))
+            atoms.push_back(i);
+    std::set<std::pair<int, int>> known(m_user_pairs.begin(), m_user_pairs.end());
+    for (std::size_t k = 0; k < atoms.size(); ++k)
+        for (std::size_t l = k + 1; l < atoms.size(); ++l) {
+            const int a = atoms[k], b = atoms[l];
+            const int ea = m_topology.elements[a], eb = m_topology.elements[b];
+            if (m_topology.element_pairs.count({ std::min(ea, eb), std::max(ea, eb) }) && known.insert({ a, b }).second)
+                m_user_pairs.push_back({ a, b });
+        }
 
-    for (const std::pair<int, int>& p : m_inter_pairs) {
-        m_intermol_file << molecule->CalculateDistance(p.first, p.second) << "    ";
-    }
-    m_intermol_file << std::endl;
+    BlackListProtons(molecule);
 
-    int index = 0;
-    for (const std::pair<int, int>& p : m_user_pairs) {
-        m_user_file << molecule->CalculateDistance(p.first, p.second) << "    ";
-        m_user_vector[index].push_back(molecule->CalculateDistance(p.first, p.second));
-        index++;
+    for (std::size_t i = 0; i < m_topology.elements.size(); ++i) {
+        if (m_topology.elements[i] == 7 || m_topology.elements[i] == 8)
+            m_topology.acceptors.push_back(i);
+        else if (m_topology.elements[i] == 1 && !m_topology.blacklist[i])
+            m_topology.donors.push_back(i);
     }
-    m_user_file << std::endl;
 
-    std::vector<std::vector<int>> f = molecule->GetFragments();
-    for (std::size_t i = 0; i < molecule->GetFragments().size(); ++i) {
-        for (std::size_t j = i + 1; j < molecule->GetFragments().size(); ++j) {
-            Geometry geom1 = molecule->getGeometryByFragment(i);
-            Geometry geom2 = molecule->getGeometryByFragment(j);
-            double distance = GeometryTools::Distance(GeometryTools::Centroid(geom1), GeometryTools::Centroid(geom2));
-            m_centroid_file << distance << "    ";
-        }
-    }
-    m_centroid_file << std::endl;
+    m_topology.fragments = molecule.GetFragments();
+    m_topology.fragment.assign(m_topology.elements.size(), -1);
+    for (std::size_t i = 0; i < m_topology.fragments.size(); ++i)
+        for (int atom : m_topology.fragments[i])
+            m_topology.fragment[atom] = i;
 }
-
 void PairMapper::Statistic()
 {
     std::vector<double> mean, median, stdev, entropy;
@@ -264,39 +378,38 @@ void PairMapper::Statistic()
 
 void PairMapper::addPair(std::pair<int, int> pair, std::vector<std::pair<int, int>>& pairs)
 {
-    bool exist = false;
     if (pair.second < pair.first) {
         int first = pair.first;
         pair.first = pair.second;
         pair.second = first;
     }
 
-    for (const std::pair<int, int>& p : pairs)
-        if (pair == p) {
-            exist = true;
-            break;
-        }
-
-    if (!exist)
+    if (std::find(pairs.begin(), pairs.end(), pair) == pairs.end())
         pairs.push_back(pair);
 }
 
-void PairMapper::BlackListProtons(const Molecule* molecule)
+void PairMapper::BlackListProtons(const Molecule& molecule)
 {
-    for (std::size_t i = 0; i < molecule->AtomCount(); ++i) {
-        if (molecule->Atom(i).first != 1)
+    /* protons bound to carbon are no hydrogen bond donors, the nearest neighbour is searched in a cell list */
+    const Matrix geometry = molecule.getGeometry();
+    std::vector<int> atoms(molecule.AtomCount());
+    for (std::size_t i = 0; i < atoms.size(); ++i)
+        atoms[i] = i;
+    const PairMapperCells cells(geometry, atoms, m_cutoff);
+
+    m_topology.blacklist.assign(molecule.AtomCount(), 0);
+    for (std::size_t i = 0; i < molecule.AtomCount(); ++i) {
+        if (molecule.Atom(i).first != 1)
             continue;
         double distance = 1e8;
         int element = 0;
-        for (std::size_t j = 0; j < molecule->AtomCount(); ++j) {
-            if (i == j)
-                continue;
-            double d = molecule->CalculateDistance(i, j);
-            if (d < distance)
-                element = molecule->Atom(j).first;
-            distance = std::min(d, distance);
-        }
+        cells.Neighbours(geometry.row(i), [&](int j, double d) {
+            if (j != i && d < distance) {
+                element = molecule.Atom(j).first;
+                distance = d;
+            }
+        });
         if (element == 6)
-            m_proton_blacklist.push_back(i);
+            m_topology.blacklist[i] = 1;
     }
 }
@@ -19,35 +19,103 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
-
 #include "src/core/molecule.h"
 
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
+class FileIterator;
+
+/*! \brief A single trajectory frame and the output rows produced for it */
+struct PairMapperFrame {
+    Matrix geometry;
+    std::string intra, inter, user, centroid;
+    std::vector<double> user_values;
+};
+
+/*! \brief Fixed topology shared by all workers, set up once from the first frame */
+struct PairMapperTopology {
+    std::vector<int> elements, fragment, donors, acceptors;
+    std::set<std::pair<int, int>> element_pairs;
+    std::vector<char> blacklist;
+    std::vector<std::vector<int>> fragments;
+    std::vector<double> radius;
+    double cutoff = 2.5, scaling = 1.3;
+};
+
+/*! \brief Worker for a range of frames, either discovers hydrogen bond candidates via a cell list
+ * or writes the distances of the known pairs */
+class PairMapperThread : public CxxThread {
+public:
+    PairMapperThread(const PairMapperTopology* topology)
+        : m_topology(topology)
+    {
+        setAutoDelete(false);
+    }
+
+    int execute() override;
+
+    void setFrames(std::vector<PairMapperFrame>* frames, int start, int end)
+    {
+        m_frames = frames;
+        m_start = start;
+        m_end = end;
+    }
+
+    /*! \brief Without pairs the thread discovers candidates, otherwise it scans the given pairs */
+    void setPairs(const std::vector<std::pair<int, int>>* intra, const std::vector<std::pair<int, int>>* inter, const std::vector<std::pair<int, int>>* user)
+    {
+        m_intra = intra;
+        m_inter = inter;
+        m_user = user;
+    }
+
+    const std::set<std::pair<int, int>>& IntraPairs() const { return m_found_intra; }
+    const std::set<std::pair<int, int>>& InterPairs() const { return m_found_inter; }
+
+private:
+    void Discover(const Matrix& geometry);
+    void Scan(PairMapperFrame& frame) const;
+
+    const PairMapperTopology* m_topology;
+    std::vector<PairMapperFrame>* m_frames = nullptr;
+    const std::vector<std::pair<int, int>>*m_intra = nullptr, *m_inter = nullptr, *m_user = nullptr;
+    std::set<std::pair<int, int>> m_found_intra, m_found_inter;
+    int m_start = 0, m_end = 0;
+};
+
 class PairMapper {
 public:
     PairMapper();
     void setFile(const std::string& filename) { m_filename = filename; }
+    inline void setThreads(int threads) { m_threads = threads; }
     void FindPairs();
     inline void addPair(std::pair<int, int> pair) { addPair(pair, m_user_pairs); }
-    inline void addElementPair(std::pair<int, int> pair) { addPair(pair, m_element_pairs); }
+    inline void addElementPair(std::pair<int, int> pair) { m_topology.element_pairs.insert({ std::min(pair.first, pair.second), std::max(pair.first, pair.second) }); }
     void Statistic();
 
 private:
-    void InitialisePairs(const Molecule* molecule);
-    void ScanPairs(const Molecule* molecule);
-    void BlackListProtons(const Molecule* molecule);
+    void InitialiseTopology(const Molecule& molecule);
+    void BlackListProtons(const Molecule& molecule);
     void addPair(std::pair<int, int> pair, std::vector<std::pair<int, int>>& pairs);
+
+    /* Read up to m_blocksize frames and run the workers on them, returns false at the end of the file */
+    bool ProcessBlock(FileIterator& file, std::vector<PairMapperThread*>& workers, CxxThreadPool* pool, bool scan);
+
     std::string m_filename;
-    std::vector<std::pair<int, int>> m_intra_pairs, m_inter_pairs, m_user_pairs, m_element_pairs;
-    std::vector<int> m_proton_blacklist;
+    std::vector<std::pair<int, int>> m_intra_pairs, m_inter_pairs, m_user_pairs;
+    PairMapperTopology m_topology;
     bool m_intramolecular = false, m_intermolecule = true;
     double m_cutoff = 2.5, m_scaling = 1.3;
+    int m_threads = 1, m_blocksize = 256;
     std::ofstream m_intermol_file, m_intramol_file, m_centroid_file, m_user_file, m_pair_file;
     std::vector<std::vector<double>> m_user_vector;
 };
@@ -1,5 +1,5 @@
 /*
- * <Abstract Curcuma Method, please try to subclass from that!>
+ * <Clash-aware oligomer and polymer builder. >
  * Copyright (C) 2023 Conrad Hübler <Conrad.Huebler@gmx.net>
  *
  * This program is free software: you can redistribute it and/or modify
@@ -17,114 +17,355 @@
  *
  */
 
-#include "src/global_config.h"
+#include "src/core/elements.h"
+#include "src/core/energycalculator.h"
+#include "src/core/global.h"
 
 #include "src/tools/general.h"
 
 #include <fstream>
 #include <iostream>
-#include <stdio.h>
-
-#ifdef C17
-#ifndef _WIN32
-#include <filesystem>
-namespace fs = std::filesystem;
-#endif
-#endif
-#include "polybuild.h".h "
-
-PolyBuilder::PolyBuilder(const json& defaults, const json& controller, bool silent)
-    : m_defaults(defaults)
+
+#include <Eigen/Geometry>
+
+#include "polybuild.h"
+
+/* first atom on the bond path from -> to, leave atoms are not part of the backbone */
+static int BackboneNeighbour(const PolyBuildMonomer& monomer, int from, int to, int fallback)
+{
+    if (from == to)
+        return fallback;
+    const int atoms = monomer.elements.size();
+    std::vector<int> previous(atoms, -1);
+    std::vector<int> queue = { to };
+    previous[to] = to;
+    for (int k = 0; k < queue.size(); ++k) {
+        const int i = queue[k];
+        for (int j = 0; j < atoms; ++j) {
+            if (previous[j] != -1 || j == monomer.head_leave || j == monomer.tail_leave)
+                continue;
+            const double limit = 1.2 * (Elements::CovalentRadius[monomer.elements[i]] + Elements::CovalentRadius[monomer.elements[j]]);
+            if ((monomer.positions[i] - monomer.positions[j]).squaredNorm() > limit * limit)
+                continue;
+            previous[j] = i;
+            if (j == from)
+                return i;
+            queue.push_back(j);
+        }
+    }
+    return fallback;
+}
+
+/* dihedral a-b-c-d in rad, zero if three of the atoms are collinear */
+static double Dihedral(const Position& a, const Position& b, const Position& c, const Position& d)
+{
+    const Eigen::Vector3d b1 = b - a, b2 = c - b, b3 = d - c;
+    const Eigen::Vector3d n1 = b1.cross(b2), n2 = b2.cross(b3);
+    if (n1.squaredNorm() < 1e-12 || n2.squaredNorm() < 1e-12)
+        return 0;
+    return std::atan2(b2.norm() * b1.dot(n2), n1.dot(n2));
+}
+
+PolyBuildThread::PolyBuildThread(const PolyBuildMonomer& monomer, const json& controller, int chain)
+    : m_monomer(monomer)
     , m_controller(controller)
-    , m_silent(silent)
 {
-    // m_curcuma_progress.open("curcuma_progress", std::ios::out);
+    setAutoDelete(false);
+    m_target = std::max(1, Json2KeyWord<int>(controller, "units"));
+    m_jitter = Json2KeyWord<double>(controller, "torsion_jitter") * pi / 180.0;
+    m_attempts = Json2KeyWord<int>(controller, "attempts");
+    m_max_backtrack = Json2KeyWord<int>(controller, "backtrack");
+    m_clash_scaling = Json2KeyWord<double>(controller, "clash_scaling");
+    m_relax = Json2KeyWord<bool>(controller, "relax");
+    m_relax_steps = Json2KeyWord<int>(controller, "relax_steps");
+    for (double torsion : Json2KeyWord<json>(controller, "torsions").get<std::vector<double>>())
+        m_torsions.push_back(torsion * pi / 180.0);
+    m_rng.seed(Json2KeyWord<unsigned long long>(controller, "seed") + 0x9E3779B97F4A7C15ULL * (chain + 1));
+
+    double radius = 0;
+    for (int element : m_monomer.elements)
+        radius = std::max(radius, Elements::VanDerWaalsRadius[element]);
+    m_hash.setCellSize(std::max(2 * m_clash_scaling * radius, 0.5));
 }
 
-CurcumaMethod::~CurcumaMethod()
+int PolyBuildThread::execute()
 {
+    /* the first unit keeps its head leave atom as chain end */
+    Unit first;
+    for (int i = 0; i < m_monomer.elements.size(); ++i) {
+        m_elements.push_back(m_monomer.elements[i]);
+        m_positions.push_back(m_monomer.positions[i]);
+        m_alive.push_back(1);
+        m_hash.Insert(i, m_monomer.positions[i]);
+    }
+    first.tail = m_monomer.tail;
+    first.tail_leave = m_monomer.tail_leave;
+    first.head_leave = m_monomer.head_leave;
+    m_units.push_back(first);
+
+    while (m_units.size() < m_target) {
+        if (AddUnit())
+            continue;
+        if (m_units.size() == 1 || ++m_backtracks > m_max_backtrack)
+            break;
+        RemoveUnit();
+    }
+    m_success = m_units.size() == m_target;
+
+    m_chain = Molecule();
+    for (int i = 0; i < m_positions.size(); ++i)
+        if (m_alive[i])
+            m_chain.addPair({ m_elements[i], m_positions[i] });
+    return 0;
 }
 
-void CurcumaMethod::TriggerWriteRestart()
+bool PolyBuildThread::AddUnit()
 {
-    std::ofstream restart_file("curcuma_restart.json");
-    nlohmann::json restart;
-    try {
-        restart[MethodName()[0]] = WriteRestartInformation();
-    } catch (nlohmann::json::type_error& e) {
+    const Unit last = m_units.back();
+    const Position tail = m_positions[last.tail];
+    const Eigen::Vector3d direction = (m_positions[last.tail_leave] - tail).normalized();
+    const double bond = Elements::CovalentRadius[m_elements[last.tail]] + Elements::CovalentRadius[m_monomer.elements[m_monomer.head]];
+    const Position head = tail + bond * direction;
+
+    /* head leave atom of the new unit points back to the tail, the remaining turn about the new bond is
+     * measured as backbone dihedral, so equal torsions give equal conformations for every unit */
+    const Eigen::Quaterniond align = Eigen::Quaterniond::FromTwoVectors(m_monomer.positions[m_monomer.head_leave], -direction);
+    const double aligned = Dihedral(m_positions[last.first + m_monomer.tail_ref], tail, head, head + align * m_monomer.positions[m_monomer.head_ref]);
+
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    std::vector<double> angles = m_torsions;
+    std::shuffle(angles.begin(), angles.end(), m_rng);
+    for (double& angle : angles)
+        angle += m_jitter * uniform(m_rng);
+    for (int i = 0; i < m_attempts; ++i)
+        angles.push_back(pi * uniform(m_rng));
+
+    /* 1-3 pairs across the new bond: the new head and the neighbours of the tail */
+    std::vector<int> neighbours;
+    for (int i = last.first; i < m_positions.size(); ++i) {
+        if (!m_alive[i] || i == last.tail || i == last.tail_leave)
+            continue;
+        const double limit = 1.2 * (Elements::CovalentRadius[m_elements[i]] + Elements::CovalentRadius[m_elements[last.tail]]);
+        if ((m_positions[i] - tail).squaredNorm() < limit * limit)
+            neighbours.push_back(i);
     }
-    try {
-        restart_file << restart << std::endl;
-    } catch (nlohmann::json::type_error& e) {
+
+    m_hash.Remove(last.tail_leave, m_positions[last.tail_leave]);
+    std::vector<Position> positions(m_monomer.positions.size());
+    for (double angle : angles) {
+        const Eigen::Matrix3d rotation = (Eigen::AngleAxisd(angle - aligned, direction) * align).toRotationMatrix();
+        for (int i = 0; i < positions.size(); ++i)
+            positions[i] = head + rotation * m_monomer.positions[i];
+        if (Clash(positions, last.tail, neighbours))
+            continue;
+
+        if (m_relax)
+            Relax(positions);
+
+        m_alive[last.tail_leave] = 0;
+        Unit unit;
+        unit.first = m_positions.size();
+        unit.tail = unit.first + m_monomer.tail;
+        unit.tail_leave = unit.first + m_monomer.tail_leave;
+        unit.head_leave = unit.first + m_monomer.head_leave;
+        for (int i = 0; i < positions.size(); ++i) {
+            m_elements.push_back(m_monomer.elements[i]);
+            m_positions.push_back(positions[i]);
+            m_alive.push_back(i != m_monomer.head_leave);
+            if (i != m_monomer.head_leave)
+                m_hash.Insert(unit.first + i, positions[i]);
+        }
+        m_units.push_back(unit);
+        return true;
     }
+    m_hash.Insert(last.tail_leave, m_positions[last.tail_leave]);
+    return false;
 }
 
-StringList CurcumaMethod::RestartFiles() const
+void PolyBuildThread::RemoveUnit()
 {
-    StringList file_list;
-
-#ifdef C17
-#ifndef _WIN32
-    for (auto& p : fs::directory_iterator(".")) {
-        std::string file(p.path());
-        if (file.find("curcuma_restart") != std::string::npos)
-            file_list.push_back(file);
+    const Unit unit = m_units.back();
+    m_units.pop_back();
+    for (int i = unit.first; i < m_positions.size(); ++i)
+        if (m_alive[i])
+            m_hash.Remove(i, m_positions[i]);
+    m_elements.resize(unit.first);
+    m_positions.resize(unit.first);
+    m_alive.resize(unit.first);
+
+    const Unit& last = m_units.back();
+    m_alive[last.tail_leave] = 1;
+    m_hash.Insert(last.tail_leave, m_positions[last.tail_leave]);
+}
+
+bool PolyBuildThread::Clash(const std::vector<Position>& positions, int tail, const std::vector<int>& neighbours) const
+{
+    for (int i = 0; i < positions.size(); ++i) {
+        if (i == m_monomer.head_leave)
+            continue;
+        const double radius = Elements::VanDerWaalsRadius[m_monomer.elements[i]];
+        const Position& position = positions[i];
+        const bool head = i == m_monomer.head;
+        bool clash = m_hash.Any(position, [&](int j) {
+            if (j == tail || (head && std::find(neighbours.begin(), neighbours.end(), j) != neighbours.end()))
+                return false;
+            const double limit = m_clash_scaling * (radius + Elements::VanDerWaalsRadius[m_elements[j]]);
+            return (m_positions[j] - position).squaredNorm() < limit * limit;
+        });
+        if (clash)
+            return true;
     }
-#endif
-#else
-    std::ifstream test_file("curcuma_restart.json");
-    if (test_file.is_open())
-        file_list.push_back("curcuma_restart.json");
-#endif
-
-    return file_list;
+    return false;
 }
 
-nlohmann::json CurcumaMethod::LoadControl() const
+void PolyBuildThread::Relax(std::vector<Position>& positions) const
 {
-    nlohmann::json control;
-    std::ifstream restart_file("curcuma_control.json");
-    try {
-        restart_file >> control;
-    } catch (nlohmann::json::type_error& e) {
-        throw 404;
-    } catch (nlohmann::json::parse_error& e) {
-        throw 404;
+    /* UFF steepest descent of the new unit, the previous unit is kept fixed as environment */
+    const Unit& last = m_units.back();
+    Molecule fragment;
+    std::vector<int> moving;
+    for (int i = last.first; i < m_positions.size(); ++i)
+        if (m_alive[i] && i != last.tail_leave)
+            fragment.addPair({ m_elements[i], m_positions[i] });
+    for (int i = 0; i < positions.size(); ++i) {
+        if (i == m_monomer.head_leave)
+            continue;
+        moving.push_back(i);
+        fragment.addPair({ m_monomer.elements[i], positions[i] });
+    }
+    const int offset = fragment.AtomCount() - moving.size();
+
+    EnergyCalculator calculator("uff", m_controller);
+    calculator.setMolecule(fragment);
+    Matrix geometry = fragment.getGeometry();
+    double energy = calculator.CalculateEnergy(true, false);
+    Matrix gradient = calculator.Gradient();
+    double step = 0.05;
+    for (int iteration = 0; iteration < m_relax_steps && step > 1e-4; ++iteration) {
+        double largest = 0;
+        for (int i = offset; i < geometry.rows(); ++i)
+            largest = std::max(largest, gradient.row(i).norm());
+        if (largest < 1e-8)
+            break;
+        Matrix trial = geometry;
+        for (int i = offset; i < geometry.rows(); ++i)
+            trial.row(i) -= step * gradient.row(i) / largest;
+        calculator.updateGeometry(trial);
+        const double trial_energy = calculator.CalculateEnergy(true, false);
+        if (trial_energy < energy) {
+            geometry = trial;
+            energy = trial_energy;
+            gradient = calculator.Gradient();
+            step = std::min(step * 1.2, 0.1);
+        } else
+            step *= 0.5;
     }
-    std::cout << control << std::endl;
-    return control;
+    for (int k = 0; k < moving.size(); ++k)
+        positions[moving[k]] = geometry.row(offset + k).transpose();
 }
 
-void CurcumaMethod::UpdateController(const json& controller)
+PolyBuild::PolyBuild(const json& controller, bool silent)
+    : CurcumaMethod(PolyBuildJson, controller, silent)
 {
-    json method;
-    for (const auto& s : MethodName()) {
-        try {
-            method = Json2KeyWord<json>(controller, s);
-        } catch (int i) {
-            method = controller;
+    UpdateController(controller);
+}
+
+void PolyBuild::LoadControlJson()
+{
+    m_monomer_file = Json2KeyWord<std::string>(m_defaults, "monomer");
+    m_head = Json2KeyWord<int>(m_defaults, "head");
+    m_tail = Json2KeyWord<int>(m_defaults, "tail");
+    m_head_leave = Json2KeyWord<int>(m_defaults, "head_leave");
+    m_tail_leave = Json2KeyWord<int>(m_defaults, "tail_leave");
+    m_chain_count = std::max(1, Json2KeyWord<int>(m_defaults, "chains"));
+    m_threads = Json2KeyWord<int>(m_defaults, "threads");
+
+    /* torsions from the command line arrive as "180;60;-60" */
+    json torsions = Json2KeyWord<json>(m_defaults, "torsions");
+    if (torsions.is_string()) {
+        std::vector<double> list;
+        for (const auto& angle : Tools::SplitString(torsions.get<std::string>(), ";"))
+            list.push_back(std::stod(angle));
+        m_defaults["torsions"] = list;
+    } else if (torsions.is_number())
+        m_defaults["torsions"] = std::vector<double>{ torsions.get<double>() };
+}
+
+bool PolyBuild::Initialise()
+{
+    if (!m_template_set) {
+        if (m_monomer_file.compare("none") == 0) {
+            AppendError("No monomer given.");
+            return false;
+        }
+        m_template = Files::LoadFile(m_monomer_file);
+        getBasename(m_monomer_file);
+    }
+    const int atoms = m_template.AtomCount();
+    const std::vector<int> indices = { m_head, m_tail, m_head_leave, m_tail_leave };
+    for (int i = 0; i < indices.size(); ++i) {
+        if (indices[i] < 1 || indices[i] > atoms) {
+            AppendError("Head, tail and leave atoms have to be between 1 and the number of atoms of the monomer.");
+            return false;
         }
-        m_defaults = MergeJson(m_defaults, method);
+        for (int j = 0; j < i; ++j)
+            if (indices[i] == indices[j]) {
+                AppendError("Head, tail and leave atoms have to be different atoms.");
+                return false;
+            }
     }
-    if (!m_silent)
-        PrintController(m_defaults);
-    LoadControlJson();
+
+    m_monomer = PolyBuildMonomer();
+    m_monomer.head = m_head - 1;
+    m_monomer.tail = m_tail - 1;
+    m_monomer.head_leave = m_head_leave - 1;
+    m_monomer.tail_leave = m_tail_leave - 1;
+    const Position origin = m_template.Atom(m_monomer.head).second;
+    for (int i = 0; i < atoms; ++i) {
+        m_monomer.elements.push_back(m_template.Atom(i).first);
+        m_monomer.positions.push_back(m_template.Atom(i).second - origin);
+    }
+    m_monomer.head_ref = BackboneNeighbour(m_monomer, m_monomer.head, m_monomer.tail, m_monomer.tail_leave);
+    m_monomer.tail_ref = BackboneNeighbour(m_monomer, m_monomer.tail, m_monomer.head, m_monomer.head_leave);
+    return true;
 }
 
-bool CurcumaMethod::CheckStop() const
+void PolyBuild::start()
 {
-#ifdef C17
-#ifndef _WIN32
-    return std::filesystem::exists("stop");
-#endif
-    std::ifstream test_file("stop");
-    bool result = test_file.is_open();
-    test_file.close();
-    return result;
-#else
-    std::ifstream test_file("stop");
-    bool result = test_file.is_open();
-    test_file.close();
-    return result;
-#endif
+    if (m_monomer.elements.empty() && !Initialise()) {
+        printError();
+        return;
+    }
+
+    std::vector<PolyBuildThread*> threads;
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setActiveThreadCount(m_threads);
+    for (int i = 0; i < m_chain_count; ++i) {
+        PolyBuildThread* thread = new PolyBuildThread(m_monomer, m_defaults, i);
+        pool->addThread(thread);
+        threads.push_back(thread);
+    }
+    pool->setProgressBar(m_chain_count > 1 ? CxxThreadPool::ProgressBarType::Continously : CxxThreadPool::ProgressBarType::None);
+    pool->DynamicPool();
+    pool->StartAndWait();
+
+    const std::string basename = Basename().empty() ? std::string("polybuild") : Basename();
+    const std::string filename = basename + ".poly.xyz";
+    std::ofstream(filename).close();
+    int failed = 0, backtracks = 0;
+    for (const auto* thread : threads) {
+        m_chains.push_back(thread->Chain());
+        thread->Chain().appendXYZFile(filename);
+        failed += !thread->Success();
+        backtracks += thread->Backtracks();
+    }
+    std::cout << m_chain_count << " chain(s) with up to " << Json2KeyWord<int>(m_defaults, "units") << " units written to " << filename << ", " << backtracks << " backtracking steps";
+    if (failed)
+        std::cout << ", " << failed << " chain(s) could not be completed";
+    std::cout << std::endl;
+
+    pool->clear();
+    delete pool;
+    for (auto* thread : threads)
+        delete thread;
 }
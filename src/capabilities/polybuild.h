@@ -1,6 +1,6 @@
 /*
- * <Abstract Curcuma Method, please try to subclass from that!>
- * Copyright (C) 2020 Conrad Hübler <Conrad.Huebler@gmx.net>
+ * <Clash-aware oligomer and polymer builder. >
+ * Copyright (C) 2023 Conrad Hübler <Conrad.Huebler@gmx.net>
  *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -19,66 +19,180 @@
 
 #pragma once
 
-#include "src/tools/general.h"
-
+#include <algorithm>
+#include <cmath>
+#include <random>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "src/core/molecule.h"
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
+#include "curcumamethod.h"
+
+/* atom indices start with 1, head/tail are the linking atoms, the leave atoms are removed when two units are linked */
+static const json PolyBuildJson{
+    { "monomer", "none" },
+    { "head", 1 },
+    { "tail", 2 },
+    { "head_leave", 3 },
+    { "tail_leave", 4 },
+    { "units", 10 },
+    { "chains", 1 },
+    { "threads", 1 },
+    { "torsions", { 180.0, 60.0, -60.0 } }, // preferred backbone dihedrals across the new bond in degree
+    { "torsion_jitter", 10.0 },
+    { "attempts", 20 },
+    { "backtrack", 100 },
+    { "clash_scaling", 0.6 },
+    { "relax", false },
+    { "relax_steps", 50 },
+    { "seed", 42 }
+};
 
-#include "json.hpp"
-
-class CurcumaMethod {
+/*! \brief Uniform grid over placed atoms, cell edge is the largest clash distance, so only the 27 neighbouring cells are tested */
+class PolyBuildHash {
 public:
-    CurcumaMethod(const json& defaults, const json& controller, bool silent);
-    ~CurcumaMethod();
-
-    inline void setRestart(bool restart) { m_restart = restart; }
+    inline void setCellSize(double cell) { m_cell = cell; }
 
-    inline bool Restart() const { return m_restart; }
+    inline void Insert(int index, const Position& position) { m_grid[Key(position)].push_back(index); }
 
-    inline void setController(const json& controller) { m_controller = controller; }
+    inline void Remove(int index, const Position& position)
+    {
+        auto cell = m_grid.find(Key(position));
+        if (cell == m_grid.end())
+            return;
+        auto& list = cell->second;
+        list.erase(std::remove(list.begin(), list.end(), index), list.end());
+    }
 
-    virtual bool Initialise() { return true; } // TODO make pure virtual
+    /*! \brief True if visitor returns true for any stored atom in the cells around position */
+    template <typename Visitor>
+    inline bool Any(const Position& position, Visitor visitor) const
+    {
+        const long long cx = std::floor(position(0) / m_cell), cy = std::floor(position(1) / m_cell), cz = std::floor(position(2) / m_cell);
+        for (long long x = cx - 1; x <= cx + 1; ++x)
+            for (long long y = cy - 1; y <= cy + 1; ++y)
+                for (long long z = cz - 1; z <= cz + 1; ++z) {
+                    auto cell = m_grid.find(Key(x, y, z));
+                    if (cell == m_grid.end())
+                        continue;
+                    for (int index : cell->second)
+                        if (visitor(index))
+                            return true;
+                }
+        return false;
+    }
 
-    void printError()
+private:
+    inline long long Key(const Position& position) const
+    {
+        return Key(std::floor(position(0) / m_cell), std::floor(position(1) / m_cell), std::floor(position(2) / m_cell));
+    }
+    inline static long long Key(long long x, long long y, long long z)
     {
-        for (const auto& error : m_error_list)
-            std::cerr << error << std::endl;
-        m_error_list.clear();
+        return ((x & 0x1FFFFF) << 42) | ((y & 0x1FFFFF) << 21) | (z & 0x1FFFFF);
     }
 
-    void UpdateController(const json& controller);
+    std::unordered_map<long long, std::vector<int>> m_grid;
+    double m_cell = 2;
+};
 
-    virtual void start() = 0; // TODO make pure virtual and move all main action here
+/*! \brief Monomer with linking atoms (0-based), coordinates centred on the head atom
+ *
+ * head_ref and tail_ref are the backbone neighbours of head and tail on the path to the other
+ * linking atom (the leave atoms if head and tail coincide). The torsion of a new bond is the
+ * dihedral tail_ref(last unit) - tail(last unit) - head(new unit) - head_ref(new unit).
+ */
+struct PolyBuildMonomer {
+    std::vector<int> elements;
+    std::vector<Position> positions;
+    int head = 0, tail = 1, head_leave = 2, tail_leave = 3, head_ref = 1, tail_ref = 0;
+};
 
-    bool CheckStop() const;
+/*! \brief Grows one chain unit by unit
+ *
+ * The head atom of every new unit is placed on the bond vector tail -> tail leave of the last unit
+ * (covalent bond length), the unit is turned so that its head leave atom points back to the tail
+ * and rotated about the new bond until the backbone dihedral tail_ref - tail - head - head_ref
+ * equals the requested torsion. Torsions are taken from the preferred list (with jitter) and then
+ * at random, the first one without a clash against the spatial hash of the chain is accepted. If a
+ * unit can not be placed, the last unit is removed again (backtracking).
+ */
+class PolyBuildThread : public CxxThread {
+public:
+    PolyBuildThread(const PolyBuildMonomer& monomer, const json& controller, int chain);
 
-protected:
-    void TriggerWriteRestart();
+    int execute() override;
 
-    StringList RestartFiles() const;
+    inline const Molecule& Chain() const { return m_chain; }
+    inline bool Success() const { return m_success; }
+    inline int Backtracks() const { return m_backtracks; }
 
-    nlohmann::json LoadControl() const;
+private:
+    struct Unit {
+        int first = 0, tail = 0, tail_leave = 0, head_leave = 0;
+    };
+
+    bool AddUnit();
+    void RemoveUnit();
+    /* tail and its neighbours are bonded (1-2) or geminal (1-3) to the new unit and are not tested */
+    bool Clash(const std::vector<Position>& positions, int tail, const std::vector<int>& neighbours) const;
+    void Relax(std::vector<Position>& positions) const;
+
+    PolyBuildMonomer m_monomer;
+    std::vector<int> m_elements;
+    std::vector<Position> m_positions;
+    std::vector<char> m_alive;
+    std::vector<Unit> m_units;
+    std::vector<double> m_torsions;
+    PolyBuildHash m_hash;
+    Molecule m_chain;
+    std::mt19937_64 m_rng;
+    json m_controller;
+    double m_jitter = 10, m_clash_scaling = 0.6;
+    int m_target = 10, m_attempts = 20, m_max_backtrack = 100, m_relax_steps = 50, m_backtracks = 0;
+    bool m_relax = false, m_success = false;
+};
 
-    json m_defaults, m_controller;
-    bool m_restart = true;
+class PolyBuild : public CurcumaMethod {
+public:
+    PolyBuild(const json& controller = PolyBuildJson, bool silent = true);
 
-    void AppendError(const std::string& error) { m_error_list.push_back(error); }
-    // std::filebuf m_curcuma_progress;
+    /*! \brief Monomer template, otherwise read from the monomer file */
+    inline void setMonomer(const Molecule& monomer)
+    {
+        m_template = monomer;
+        m_template_set = true;
+    }
+
+    bool Initialise() override;
+
+    void start() override;
+
+    inline const std::vector<Molecule>& Chains() const { return m_chains; }
 
 private:
     /* Lets have this for all modules */
-    virtual nlohmann::json WriteRestartInformation() = 0;
+    inline nlohmann::json WriteRestartInformation() override { return json(); }
 
     /* Lets have this for all modules */
-    virtual bool LoadRestartInformation() = 0;
+    inline bool LoadRestartInformation() override { return true; }
 
-    virtual StringList MethodName() const = 0;
+    inline StringList MethodName() const override { return { std::string("PolyBuild") }; }
 
     /* Lets have all methods read the input/control file */
-    virtual void ReadControlFile() = 0;
+    void ReadControlFile() override{};
 
     /* Read Controller has to be implemented for all */
-    virtual void LoadControlJson() = 0;
-
-    StringList m_error_list;
-    bool m_silent = true;
+    void LoadControlJson() override;
+
+    Molecule m_template;
+    PolyBuildMonomer m_monomer;
+    std::vector<Molecule> m_chains;
+    std::string m_monomer_file;
+    int m_head = 1, m_tail = 2, m_head_leave = 3, m_tail_leave = 4, m_chain_count = 1, m_threads = 1;
+    bool m_template_set = false;
 };
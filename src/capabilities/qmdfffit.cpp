@@ -18,6 +18,7 @@
  */
 
 #include "src/capabilities/optimiser/LevMarQMDFFFit.h"
+#include "src/capabilities/optimiser/LinearQMDFFFit.h"
 
 #include "src/capabilities/hessian.h"
 
@@ -38,6 +39,9 @@ void QMDFFFit::LoadControlJson()
 {
     m_method = Json2KeyWord<std::string>(m_defaults, "method");
     m_threads = Json2KeyWord<int>(m_defaults, "threads");
+    m_fit = Json2KeyWord<std::string>(m_defaults, "fit");
+    m_regularisation = Json2KeyWord<double>(m_defaults, "fit_regularisation");
+    m_nonnegative = Json2KeyWord<bool>(m_defaults, "fit_nonnegative");
 }
 
 void QMDFFFit::start()
@@ -86,6 +90,10 @@ void QMDFFFit::start()
         }
     // std::cout << const_hessian_matrix << std::endl;
     int counter = 1;
+    if (m_fit.compare("linear") == 0) {
+        LinearFit(const_hessian_matrix);
+        counter = 0;
+    }
     for (int start = 0; start < 10 && counter; ++start) {
         parameter["bonds"] = Bonds();
         parameter["angles"] = Angles();
@@ -162,6 +170,36 @@ void QMDFFFit::start()
     parameterfile << parameter;
 }
 
+void QMDFFFit::LinearFit(const Matrix& const_hessian)
+{
+    Vector fc = LinearFitFC(m_geometry, m_hessian, const_hessian, m_qmdffbonds, m_qmdffangle, m_regularisation, m_nonnegative);
+    int index = 0;
+    for (auto& bond : m_qmdffbonds)
+        bond.kAB = fc(index++);
+    for (auto& angle : m_qmdffangle)
+        angle.kabc = fc(index++);
+
+    /* 1,3-stretches and angles pinned to zero by the non-negativity constraint are dropped, as in the iterative fit */
+    auto cache = m_qmdffbonds;
+    m_qmdffbonds.clear();
+    int counter = 0;
+    for (const auto& c : cache) {
+        if ((c.kAB > 0 && c.distance == 1) || c.distance == 0)
+            m_qmdffbonds.push_back(c);
+        else
+            counter++;
+    }
+    auto cache2 = m_qmdffangle;
+    m_qmdffangle.clear();
+    for (const auto& c : cache2) {
+        if (c.kabc > 0)
+            m_qmdffangle.push_back(c);
+        else
+            counter++;
+    }
+    std::cout << "Skipping " << counter << " force constants " << std::endl;
+}
+
 bool QMDFFFit::Initialise()
 {
     // std::cout << "Initialising QMDFF (see S. Grimmme, J. Chem. Theory Comput. 2014, 10, 10, 4497–4514 [10.1021/ct500573f]) for the original publication!" << std::endl;
@@ -27,7 +27,10 @@ static const json QMDFFFitJson = {
     { "method", "gfn2" },
     { "hessian", "none" },
     { "charges", "none" },
-    { "threads", 1 }
+    { "threads", 1 },
+    { "fit", "linear" },
+    { "fit_regularisation", 0.0 },
+    { "fit_nonnegative", true }
 };
 
 class QMDFFFit : public CurcumaMethod {
@@ -42,6 +45,9 @@ private:
     bool Initialise() override;
 
     void DetermineBonds();
+
+    /* Direct (non-negative) least-squares fit of kAB and kabc on the per-term hessian basis */
+    void LinearFit(const Matrix& const_hessian);
     void setBonds(const TContainer& bonds, std::vector<std::set<int>>& ignored_vdw, TContainer& angels, TContainer& dihedrals, TContainer& inversions);
     void setAngles(const TContainer& angles, const std::vector<std::set<int>>& ignored_vdw);
 
@@ -71,6 +77,9 @@ private:
     std::vector<QMDFFBond> m_qmdffbonds;
     std::vector<QMDFFAngle> m_qmdffangle;
 
+    std::string m_fit = "linear";
+    double m_regularisation = 0;
+    bool m_nonnegative = true;
     double m_scaling;
     bool m_rings = true;
     double m_au = 1;
@@ -88,4 +88,74 @@ inline double getRMSD(const Geometry& reference, const Geometry& target)
     rmsd = sqrt(rmsd / double(target.rows()));
     return rmsd;
 }
+
+/*! \brief Inner product (sum of squared coordinates) of a centered, interleaved xyz array */
+inline double InnerProduct(const double* coord, int atoms)
+{
+    double G = 0;
+    for (int i = 0; i < 3 * atoms; ++i)
+        G += coord[i] * coord[i];
+    return G;
+}
+
+/*! \brief Best-fit RMSD of two centered, interleaved xyz arrays with fixed atom order
+ *
+ * Quaternion characteristic polynomial (QCP) after Theobald, Acta Cryst. A 2005, 61, 478 and
+ * Liu et al., J. Comput. Chem. 2010, 31, 1561. No rotation matrix is formed, only the largest
+ * eigenvalue of the key matrix is obtained by Newton-Raphson iterations.
+ * Ga and Gb are the inner products of both arrays (see InnerProduct).
+ */
+inline double QCPRMSD(const double* a, const double* b, int atoms, double Ga, double Gb)
+{
+    double Sxx = 0, Sxy = 0, Sxz = 0, Syx = 0, Syy = 0, Syz = 0, Szx = 0, Szy = 0, Szz = 0;
+    for (int i = 0; i < atoms; ++i) {
+        const double ax = a[3 * i], ay = a[3 * i + 1], az = a[3 * i + 2];
+        const double bx = b[3 * i], by = b[3 * i + 1], bz = b[3 * i + 2];
+        Sxx += ax * bx;
+        Sxy += ax * by;
+        Sxz += ax * bz;
+        Syx += ay * bx;
+        Syy += ay * by;
+        Syz += ay * bz;
+        Szx += az * bx;
+        Szy += az * by;
+        Szz += az * bz;
+    }
+    const double E0 = (Ga + Gb) * 0.5;
+
+    const double Sxx2 = Sxx * Sxx, Syy2 = Syy * Syy, Szz2 = Szz * Szz;
+    const double Sxy2 = Sxy * Sxy, Syz2 = Syz * Syz, Sxz2 = Sxz * Sxz;
+    const double Syx2 = Syx * Syx, Szy2 = Szy * Szy, Szx2 = Szx * Szx;
+
+    const double SyzSzymSyySzz2 = 2.0 * (Syz * Szy - Syy * Szz);
+    const double Sxx2Syy2Szz2Syz2Szy2 = Syy2 + Szz2 - Sxx2 + Syz2 + Szy2;
+
+    const double C2 = -2.0 * (Sxx2 + Syy2 + Szz2 + Sxy2 + Syx2 + Sxz2 + Szx2 + Syz2 + Szy2);
+    const double C1 = 8.0 * (Sxx * Syz * Szy + Syy * Szx * Sxz + Szz * Sxy * Syx - Sxx * Syy * Szz - Syz * Szx * Sxy - Szy * Syx * Sxz);
+
+    const double SxzpSzx = Sxz + Szx, SyzpSzy = Syz + Szy, SxypSyx = Sxy + Syx;
+    const double SyzmSzy = Syz - Szy, SxzmSzx = Sxz - Szx, SxymSyx = Sxy - Syx;
+    const double SxxpSyy = Sxx + Syy, SxxmSyy = Sxx - Syy;
+    const double Sxy2Sxz2Syx2Szx2 = Sxy2 + Sxz2 - Syx2 - Szx2;
+
+    const double C0 = Sxy2Sxz2Syx2Szx2 * Sxy2Sxz2Syx2Szx2
+        + (Sxx2Syy2Szz2Syz2Szy2 + SyzSzymSyySzz2) * (Sxx2Syy2Szz2Syz2Szy2 - SyzSzymSyySzz2)
+        + (-(SxzpSzx) * (SyzmSzy) + (SxymSyx) * (SxxmSyy - Szz)) * (-(SxzmSzx) * (SyzpSzy) + (SxymSyx) * (SxxmSyy + Szz))
+        + (-(SxzpSzx) * (SyzpSzy) - (SxypSyx) * (SxxpSyy - Szz)) * (-(SxzmSzx) * (SyzmSzy) - (SxypSyx) * (SxxpSyy + Szz))
+        + (+(SxypSyx) * (SyzpSzy) + (SxzpSzx) * (SxxmSyy + Szz)) * (-(SxymSyx) * (SyzmSzy) + (SxzpSzx) * (SxxpSyy + Szz))
+        + (+(SxypSyx) * (SyzmSzy) + (SxzmSzx) * (SxxmSyy - Szz)) * (-(SxymSyx) * (SyzpSzy) + (SxzmSzx) * (SxxpSyy - Szz));
+
+    double lambda = E0;
+    for (int i = 0; i < 50; ++i) {
+        const double old = lambda;
+        const double x2 = lambda * lambda;
+        const double b = (x2 + C2) * lambda;
+        const double a = b + C1;
+        const double delta = (a * lambda + C0) / (2.0 * x2 * lambda + b + a);
+        lambda -= delta;
+        if (std::abs(lambda - old) < std::abs(1e-11 * lambda))
+            break;
+    }
+    return sqrt(std::abs(2.0 * (E0 - lambda) / double(atoms)));
+}
 };
@@ -0,0 +1,469 @@
+/*
+ * <All-vs-all RMSD matrix and clustering of trajectories and ensembles. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/capabilities/rmsd_functions.h"
+
+#include "src/core/fileiterator.h"
+#include "src/core/molecule.h"
+
+#include "src/tools/general.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+using json = nlohmann::json;
+
+#include "rmsdmatrix.h"
+
+RMSDMatrixThread::RMSDMatrixThread(const std::vector<double>* coords, const std::vector<double>* inner, int frames, int atoms, int tile)
+    : m_coords(coords)
+    , m_inner(inner)
+    , m_frames(frames)
+    , m_atoms(atoms)
+    , m_tile(tile)
+{
+    setAutoDelete(false);
+}
+
+int RMSDMatrixThread::execute()
+{
+    const double* coords = m_coords->data();
+    const double* inner = m_inner->data();
+    const int stride = 3 * m_atoms;
+    std::vector<float> row;
+
+    for (const auto& tile : m_tiles) {
+        const int i_begin = tile.first * m_tile;
+        const int i_end = std::min(m_frames, i_begin + m_tile);
+        const int j_begin = tile.second * m_tile;
+        const int j_end = std::min(m_frames, j_begin + m_tile);
+
+        for (int i = i_begin; i < i_end; ++i) {
+            const int first = std::max(j_begin, i + 1);
+            if (first >= j_end)
+                continue;
+            const double* a = coords + int64_t(i) * stride;
+            row.resize(j_end - first);
+            for (int j = first; j < j_end; ++j)
+                row[j - first] = RMSDFunctions::QCPRMSD(a, coords + int64_t(j) * stride, m_atoms, inner[i], inner[j]);
+
+            const int64_t index = RMSDMatrix::PackedIndex(i, first, m_frames);
+            if (m_matrix) {
+                std::copy(row.begin(), row.end(), m_matrix + index);
+            } else {
+                std::lock_guard<std::mutex> lock(*m_mutex);
+                m_file->seekp(sizeof(int64_t) + index * sizeof(float));
+                m_file->write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+            }
+        }
+    }
+    return 0;
+}
+
+RMSDMatrix::RMSDMatrix(const json& controller, bool silent)
+    : CurcumaMethod(RMSDMatrixJson, controller, silent)
+{
+    UpdateController(controller);
+}
+
+void RMSDMatrix::LoadControlJson()
+{
+    m_heavy = Json2KeyWord<bool>(m_defaults, "heavy");
+    m_threads = Json2KeyWord<int>(m_defaults, "threads");
+    m_tile = std::max(1, Json2KeyWord<int>(m_defaults, "tile"));
+    m_memory = Json2KeyWord<double>(m_defaults, "memory");
+    m_writeMatrix = Json2KeyWord<bool>(m_defaults, "writeMatrix");
+    m_cluster = Json2KeyWord<std::string>(m_defaults, "cluster");
+    m_clusters = Json2KeyWord<int>(m_defaults, "clusters");
+    m_threshold = Json2KeyWord<double>(m_defaults, "threshold");
+    m_maxiter = Json2KeyWord<int>(m_defaults, "maxiter");
+    m_seed = Json2KeyWord<int>(m_defaults, "seed");
+}
+
+void RMSDMatrix::start()
+{
+    if (m_cluster.compare("leader") == 0) {
+        Leader();
+        WriteClusters();
+        return;
+    }
+
+    LoadFrames();
+    if (m_frames < 2) {
+        std::cout << "At least two structures are needed for the rmsd matrix." << std::endl;
+        return;
+    }
+    ComputeMatrix();
+
+    if (m_cluster.compare("kmedoids") == 0 || m_cluster.compare("hierarchical") == 0) {
+        if (m_spilled) {
+            std::cout << "The rmsd matrix was written to disk only, " << m_cluster << " clustering needs it in memory. Increase -memory or use -cluster leader." << std::endl;
+            return;
+        }
+        if (m_cluster.compare("kmedoids") == 0)
+            KMedoids();
+        else
+            Hierarchical();
+        WriteClusters();
+    } else if (m_cluster.compare("none") != 0)
+        std::cout << "Unknown clustering method " << m_cluster << ", use kmedoids, hierarchical or leader." << std::endl;
+}
+
+void RMSDMatrix::AddFrame(const Molecule& molecule, std::vector<double>& coords, std::vector<double>& inner) const
+{
+    Geometry geometry = molecule.getGeometry(!m_heavy);
+    geometry.rowwise() -= geometry.colwise().mean();
+    const int64_t offset = coords.size();
+    coords.resize(offset + 3 * geometry.rows());
+    for (int i = 0; i < geometry.rows(); ++i) {
+        coords[offset + 3 * i] = geometry(i, 0);
+        coords[offset + 3 * i + 1] = geometry(i, 1);
+        coords[offset + 3 * i + 2] = geometry(i, 2);
+    }
+    inner.push_back(RMSDFunctions::InnerProduct(coords.data() + offset, geometry.rows()));
+}
+
+void RMSDMatrix::LoadFrames()
+{
+    FileIterator file(m_filename);
+    m_frames = 0;
+    while (!file.AtEnd()) {
+        Molecule molecule = file.Next();
+        const int atoms = molecule.getGeometry(!m_heavy).rows();
+        if (m_frames == 0)
+            m_atoms = atoms;
+        else if (atoms != m_atoms) {
+            std::cout << "Structure " << m_frames + 1 << " has a different number of atoms, stopping here." << std::endl;
+            break;
+        }
+        AddFrame(molecule, m_coords, m_inner);
+        ++m_frames;
+    }
+    std::cout << m_frames << " structures with " << m_atoms << " atoms loaded." << std::endl;
+}
+
+void RMSDMatrix::ComputeMatrix()
+{
+    const int64_t pairs = int64_t(m_frames) * (m_frames - 1) / 2;
+    const double megabytes = pairs * sizeof(float) / 1024.0 / 1024.0;
+    m_spilled = megabytes > m_memory;
+
+    std::fstream file;
+    std::mutex mutex;
+    if (m_spilled || m_writeMatrix) {
+        file.open(Basename() + ".rmsd.bin", std::ios::out | std::ios::binary | std::ios::trunc);
+        const int64_t frames = m_frames;
+        file.write(reinterpret_cast<const char*>(&frames), sizeof(int64_t));
+    }
+    if (m_spilled) {
+        std::cout << "The rmsd matrix needs " << megabytes << " MB and will be written directly to " << Basename() + ".rmsd.bin" << std::endl;
+        /* reopen for random access of the tile rows */
+        file.close();
+        file.open(Basename() + ".rmsd.bin", std::ios::in | std::ios::out | std::ios::binary);
+    } else
+        m_matrix.resize(pairs);
+
+    const int threads = std::max(1, m_threads);
+    const int tiles = (m_frames + m_tile - 1) / m_tile;
+
+    std::vector<RMSDMatrixThread*> workers;
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setProgressBar(CxxThreadPool::ProgressBarType::Continously);
+    pool->setActiveThreadCount(threads);
+    for (int i = 0; i < threads; ++i) {
+        RMSDMatrixThread* thread = new RMSDMatrixThread(&m_coords, &m_inner, m_frames, m_atoms, m_tile);
+        if (m_spilled)
+            thread->setSpill(&file, &mutex);
+        else
+            thread->setMatrix(m_matrix.data());
+        workers.push_back(thread);
+        pool->addThread(thread);
+    }
+    /* round robin keeps the cheaper diagonal tiles spread over all workers */
+    int index = 0;
+    for (int I = 0; I < tiles; ++I)
+        for (int J = I; J < tiles; ++J)
+            workers[index++ % threads]->addTile(I, J);
+
+    pool->StaticPool();
+    pool->StartAndWait();
+    pool->clear();
+    delete pool;
+    for (auto* thread : workers)
+        delete thread;
+
+    if (!m_spilled && m_writeMatrix)
+        file.write(reinterpret_cast<const char*>(m_matrix.data()), m_matrix.size() * sizeof(float));
+    if (file.is_open()) {
+        file.close();
+        std::cout << "Packed upper triangle of the rmsd matrix written to " << Basename() + ".rmsd.bin" << std::endl;
+    }
+}
+
+void RMSDMatrix::KMedoids()
+{
+    const int k = std::min(std::max(1, m_clusters), m_frames);
+    std::mt19937 generator(m_seed);
+
+    /* k-medoids++ initialisation */
+    std::vector<int> medoids;
+    std::vector<double> nearest(m_frames, std::numeric_limits<double>::max());
+    medoids.push_back(std::uniform_int_distribution<int>(0, m_frames - 1)(generator));
+    while (medoids.size() < k) {
+        double sum = 0;
+        for (int i = 0; i < m_frames; ++i) {
+            nearest[i] = std::min(nearest[i], Value(i, medoids.back()));
+            sum += nearest[i] * nearest[i];
+        }
+        if (sum <= 0)
+            break;
+        double pick = std::uniform_real_distribution<double>(0, sum)(generator);
+        int next = m_frames - 1;
+        for (int i = 0; i < m_frames; ++i) {
+            pick -= nearest[i] * nearest[i];
+            if (pick <= 0) {
+                next = i;
+                break;
+            }
+        }
+        medoids.push_back(next);
+    }
+
+    m_labels.assign(m_frames, 0);
+    double cost = 0;
+    for (int iter = 0; iter < m_maxiter; ++iter) {
+        cost = 0;
+        for (int i = 0; i < m_frames; ++i) {
+            double best = std::numeric_limits<double>::max();
+            for (int c = 0; c < medoids.size(); ++c) {
+                double d = Value(i, medoids[c]);
+                if (d < best) {
+                    best = d;
+                    m_labels[i] = c;
+                }
+            }
+            cost += best;
+        }
+
+        std::vector<std::vector<int>> members(medoids.size());
+        for (int i = 0; i < m_frames; ++i)
+            members[m_labels[i]].push_back(i);
+
+        bool changed = false;
+        for (int c = 0; c < medoids.size(); ++c) {
+            double best = std::numeric_limits<double>::max();
+            int medoid = medoids[c];
+            for (int i : members[c]) {
+                double sum = 0;
+                for (int j : members[c])
+                    sum += Value(i, j);
+                if (sum < best) {
+                    best = sum;
+                    medoid = i;
+                }
+            }
+            changed = changed || medoid != medoids[c];
+            medoids[c] = medoid;
+        }
+        if (!changed)
+            break;
+    }
+    m_representatives = medoids;
+    std::cout << "k-medoids finished with " << medoids.size() << " clusters, total distance to medoids " << cost << std::endl;
+}
+
+void RMSDMatrix::Hierarchical()
+{
+    /* Nearest-neighbour chain algorithm with Lance-Williams updates for average linkage,
+     * the working copy is the packed matrix itself, slot b represents the merged cluster */
+    struct Merge {
+        int a, b;
+        double distance;
+    };
+    std::vector<float> work = m_matrix;
+    auto D = [&work, this](int i, int j) -> float& {
+        if (i > j)
+            std::swap(i, j);
+        return work[PackedIndex(i, j, m_frames)];
+    };
+
+    std::vector<char> active(m_frames, 1);
+    std::vector<int> size(m_frames, 1);
+    std::vector<int> chain;
+    std::vector<Merge> merges;
+    int remaining = m_frames;
+    int first = 0;
+
+    while (remaining > 1) {
+        if (chain.empty()) {
+            while (!active[first])
+                ++first;
+            chain.push_back(first);
+        }
+        const int a = chain.back();
+        const int previous = chain.size() > 1 ? chain[chain.size() - 2] : -1;
+        int b = previous;
+        double best = previous >= 0 ? D(a, previous) : std::numeric_limits<double>::max();
+        for (int k = 0; k < m_frames; ++k) {
+            if (!active[k] || k == a)
+                continue;
+            if (D(a, k) < best) {
+                best = D(a, k);
+                b = k;
+            }
+        }
+        if (b == previous) {
+            chain.pop_back();
+            chain.pop_back();
+            merges.push_back({ a, b, best });
+            for (int k = 0; k < m_frames; ++k) {
+                if (!active[k] || k == a || k == b)
+                    continue;
+                D(b, k) = (size[a] * D(a, k) + size[b] * D(b, k)) / double(size[a] + size[b]);
+            }
+            size[b] += size[a];
+            active[a] = 0;
+            --remaining;
+        } else
+            chain.push_back(b);
+    }
+
+    std::stable_sort(merges.begin(), merges.end(), [](const Merge& x, const Merge& y) { return x.distance < y.distance; });
+
+    std::ofstream dendrogram(Basename() + ".dendrogram.dat");
+    dendrogram << "# merged_slot  into_slot  distance" << std::endl;
+    for (const auto& merge : merges)
+        dendrogram << merge.a << " " << merge.b << " " << merge.distance << std::endl;
+
+    std::vector<int> parent(m_frames);
+    std::iota(parent.begin(), parent.end(), 0);
+    std::function<int(int)> root = [&parent, &root](int i) { return parent[i] == i ? i : parent[i] = root(parent[i]); };
+
+    int clusters = m_frames;
+    for (const auto& merge : merges) {
+        if (m_clusters > 0 && clusters <= m_clusters)
+            break;
+        if (m_clusters <= 0 && merge.distance > m_threshold)
+            break;
+        parent[root(merge.a)] = root(merge.b);
+        --clusters;
+    }
+
+    std::map<int, int> ids;
+    m_labels.assign(m_frames, 0);
+    for (int i = 0; i < m_frames; ++i) {
+        int r = root(i);
+        if (ids.count(r) == 0)
+            ids.insert({ r, int(ids.size()) });
+        m_labels[i] = ids[r];
+    }
+    FindRepresentatives(ids.size());
+    std::cout << "Average linkage clustering finished with " << ids.size() << " clusters." << std::endl;
+}
+
+void RMSDMatrix::Leader()
+{
+    /* Single pass over the file, every structure is compared against the leaders only */
+    FileIterator file(m_filename);
+    std::vector<double> leaders, leader_inner, current, current_inner;
+    m_labels.clear();
+    m_representatives.clear();
+    m_frames = 0;
+    while (!file.AtEnd()) {
+        Molecule molecule = file.Next();
+        current.clear();
+        current_inner.clear();
+        AddFrame(molecule, current, current_inner);
+        const int atoms = current.size() / 3;
+        if (m_frames == 0)
+            m_atoms = atoms;
+        else if (atoms != m_atoms) {
+            std::cout << "Structure " << m_frames + 1 << " has a different number of atoms, stopping here." << std::endl;
+            break;
+        }
+        int label = -1;
+        for (int l = 0; l < m_representatives.size() && label == -1; ++l) {
+            if (RMSDFunctions::QCPRMSD(current.data(), leaders.data() + int64_t(l) * 3 * m_atoms, m_atoms, current_inner[0], leader_inner[l]) < m_threshold)
+                label = l;
+        }
+        if (label == -1) {
+            label = m_representatives.size();
+            m_representatives.push_back(m_frames);
+            leaders.insert(leaders.end(), current.begin(), current.end());
+            leader_inner.push_back(current_inner[0]);
+        }
+        m_labels.push_back(label);
+        ++m_frames;
+    }
+    std::cout << "Leader clustering of " << m_frames << " structures finished with " << m_representatives.size() << " clusters." << std::endl;
+}
+
+void RMSDMatrix::FindRepresentatives(int clusters)
+{
+    std::vector<std::vector<int>> members(clusters);
+    for (int i = 0; i < m_frames; ++i)
+        members[m_labels[i]].push_back(i);
+
+    m_representatives.assign(clusters, 0);
+    for (int c = 0; c < clusters; ++c) {
+        double best = std::numeric_limits<double>::max();
+        for (int i : members[c]) {
+            double sum = 0;
+            for (int j : members[c])
+                sum += Value(i, j);
+            if (sum < best) {
+                best = sum;
+                m_representatives[c] = i;
+            }
+        }
+    }
+}
+
+void RMSDMatrix::WriteClusters() const
+{
+    std::vector<char> representative(m_frames, 0);
+    for (int r : m_representatives)
+        representative[r] = 1;
+
+    std::ofstream output(Basename() + ".cluster.dat");
+    output << "# structure  cluster  representative" << std::endl;
+    for (int i = 0; i < m_labels.size(); ++i)
+        output << i + 1 << " " << m_labels[i] + 1 << " " << int(representative[i]) << std::endl;
+    output.close();
+
+    std::ofstream xyz(Basename() + ".representatives.xyz");
+    xyz.close();
+    FileIterator file(m_filename, true);
+    for (int i = 0; !file.AtEnd() && i < m_frames; ++i) {
+        Molecule molecule = file.Next();
+        if (representative[i])
+            molecule.appendXYZFile(Basename() + ".representatives.xyz");
+    }
+    std::cout << "Cluster assignment written to " << Basename() + ".cluster.dat" << ", representatives to " << Basename() + ".representatives.xyz" << std::endl;
+}
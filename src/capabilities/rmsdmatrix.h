@@ -0,0 +1,154 @@
+/*
+ * <All-vs-all RMSD matrix and clustering of trajectories and ensembles. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "src/core/molecule.h"
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
+#include "curcumamethod.h"
+
+#include "json.hpp"
+using json = nlohmann::json;
+
+static const json RMSDMatrixJson{
+    { "heavy", false },
+    { "threads", 1 },
+    { "tile", 64 },
+    { "memory", 2048 },
+    { "writeMatrix", true },
+    { "cluster", "none" },
+    { "clusters", 10 },
+    { "threshold", 1.0 },
+    { "maxiter", 100 },
+    { "seed", 42 }
+};
+
+/*! \brief Worker of the all-vs-all kernel, computes a set of frame tiles of the packed upper triangle */
+class RMSDMatrixThread : public CxxThread {
+public:
+    RMSDMatrixThread(const std::vector<double>* coords, const std::vector<double>* inner, int frames, int atoms, int tile);
+    ~RMSDMatrixThread() = default;
+
+    int execute() override;
+
+    void addTile(int I, int J) { m_tiles.push_back({ I, J }); }
+
+    /*! \brief Write directly into the packed in-memory matrix */
+    void setMatrix(float* matrix) { m_matrix = matrix; }
+
+    /*! \brief Write tile rows into the binary file instead, the mutex guards the shared stream */
+    void setSpill(std::fstream* file, std::mutex* mutex)
+    {
+        m_file = file;
+        m_mutex = mutex;
+    }
+
+private:
+    const std::vector<double>* m_coords;
+    const std::vector<double>* m_inner;
+    std::vector<std::pair<int, int>> m_tiles;
+    float* m_matrix = nullptr;
+    std::fstream* m_file = nullptr;
+    std::mutex* m_mutex = nullptr;
+    int m_frames = 0, m_atoms = 0, m_tile = 64;
+};
+
+class RMSDMatrix : public CurcumaMethod {
+public:
+    RMSDMatrix(const json& controller = RMSDMatrixJson, bool silent = true);
+    virtual ~RMSDMatrix() = default;
+
+    void setFileName(const std::string& filename)
+    {
+        m_filename = filename;
+        getBasename(filename);
+    }
+
+    void start() override;
+
+    /*! \brief Position of the pair (i, j), i < j, in the packed upper triangle */
+    static inline int64_t PackedIndex(int64_t i, int64_t j, int64_t frames)
+    {
+        return i * frames - i * (i + 1) / 2 + j - i - 1;
+    }
+
+    /*! \brief RMSD between frames i and j from the in-memory matrix */
+    inline double Value(int i, int j) const
+    {
+        if (i == j)
+            return 0;
+        if (i > j)
+            std::swap(i, j);
+        return m_matrix[PackedIndex(i, j, m_frames)];
+    }
+
+    inline int Frames() const { return m_frames; }
+    const std::vector<int>& Labels() const { return m_labels; }
+    const std::vector<int>& Representatives() const { return m_representatives; }
+
+private:
+    /* Lets have this for all modules */
+    inline nlohmann::json WriteRestartInformation() override { return json(); }
+
+    /* Lets have this for all modules */
+    inline bool LoadRestartInformation() override { return true; }
+
+    inline StringList MethodName() const override { return { std::string("RMSDMatrix") }; }
+
+    /* Lets have all methods read the input/control file */
+    void ReadControlFile() override{};
+
+    /* Read Controller has to be implemented for all */
+    void LoadControlJson() override;
+
+    /* Read all frames, keep only the centered (heavy atom) coordinates */
+    void LoadFrames();
+
+    /* Append a centered frame to the coordinate store */
+    void AddFrame(const Molecule& molecule, std::vector<double>& coords, std::vector<double>& inner) const;
+
+    void ComputeMatrix();
+
+    void KMedoids();
+    void Hierarchical();
+    void Leader();
+
+    /* Medoid of every cluster in m_labels */
+    void FindRepresentatives(int clusters);
+
+    void WriteClusters() const;
+
+    std::string m_filename, m_cluster = "none";
+    std::vector<double> m_coords, m_inner;
+    std::vector<float> m_matrix;
+    std::vector<int> m_labels, m_representatives;
+    int m_frames = 0, m_atoms = 0;
+    int m_threads = 1, m_tile = 64, m_clusters = 10, m_maxiter = 100, m_seed = 42;
+    double m_memory = 2048, m_threshold = 1.0;
+    bool m_heavy = false, m_writeMatrix = true, m_spilled = false;
+};
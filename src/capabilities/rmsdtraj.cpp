@@ -31,8 +31,10 @@
 #include "src/tools/general.h"
 #include "src/tools/geometry.h"
 
+#include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <map>
@@ -44,6 +46,48 @@ using json = nlohmann::json;
 
 #include "rmsdtraj.h"
 
+RMSDTrajThread::RMSDTrajThread(const json& config, bool heavy, int fragment)
+{
+    m_driver = new RMSDDriver(config);
+    m_driver->setProtons(!heavy);
+    m_driver->setForceReorder(false);
+    m_driver->setCheckConnections(false);
+    m_driver->setFragment(fragment);
+    m_driver->setScaling(1.3);
+    setAutoDelete(false);
+}
+
+RMSDTrajThread::~RMSDTrajThread()
+{
+    delete m_driver;
+}
+
+int RMSDTrajThread::execute()
+{
+    const Molecule* reference = m_unique->at(0);
+    for (int i = m_start; i < m_end; ++i) {
+        RMSDTrajFrame& frame = m_frames->at(i);
+        m_driver->setReference(*reference);
+        m_driver->setTarget(*frame.molecule);
+        m_driver->start();
+
+        frame.rmsd = m_driver->RMSD();
+        frame.aligned = m_driver->TargetAligned();
+        frame.rules = m_driver->ReorderRules();
+        frame.candidate = m_check_unique && frame.rmsd > m_rmsd_threshold;
+
+        /* the reference (index 0) was already checked above, walk backwards through the remaining known structures */
+        for (int mols = m_unique_count - 1; mols > 0 && frame.candidate; --mols) {
+            m_driver->setReference(*m_unique->at(mols));
+            m_driver->setTarget(*frame.molecule);
+            m_driver->start();
+            frame.candidate = m_driver->RMSD() > m_rmsd_threshold;
+        }
+        m_driver->clear();
+    }
+    return 0;
+}
+
 RMSDTraj::RMSDTraj(const json& controller, bool silent)
     : CurcumaMethod(RMSDTrajJson, controller, silent)
 {
@@ -82,30 +126,19 @@ bool RMSDTraj::Initialise()
     if (m_pcafile)
         m_pca_file.open(m_outfile + "_pca.dat");
 
+    if (m_streampca)
+        m_pca_scratch.open(m_outfile + "_pca.scratch", std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+
     if (m_pairwise) {
         m_pairwise_file.open(m_outfile + "_pairwise.dat");
     }
 
-    json RMSDJsonControl = {
-        { "reorder", false },
-        { "check", false },
-        { "heavy", false },
-        { "fragment", -1 },
-        { "fragment_reference", -1 },
-        { "fragment_target", -1 },
-        { "init", -1 },
-        { "pt", 0 },
-        { "silent", true },
-        { "storage", 1.0 },
-        { "method", "incr" },
-        //{ "noreorder", m_noreorder },
-        { "threads", 1 }
-    };
-    m_driver = new RMSDDriver(RMSDJsonControl);
+    m_driver = new RMSDDriver(RMSDControl());
     m_driver->setProtons(!m_heavy);
     m_driver->setForceReorder(false);
     m_driver->setCheckConnections(false);
     m_driver->setFragment(m_fragment);
+    m_driver->setScaling(1.3);
     std::ofstream export_file;
     if (m_writeUnique) {
         export_file.open(m_outfile + ".unique.xyz");
@@ -131,6 +164,27 @@ bool RMSDTraj::Initialise()
     }
     return true;
 }
+
+json RMSDTraj::RMSDControl() const
+{
+    json RMSDJsonControl = {
+        { "reorder", false },
+        { "check", false },
+        { "heavy", false },
+        { "fragment", -1 },
+        { "fragment_reference", -1 },
+        { "fragment_target", -1 },
+        { "init", -1 },
+        { "pt", 0 },
+        { "silent", true },
+        { "storage", 1.0 },
+        { "method", "incr" },
+        //{ "noreorder", m_noreorder },
+        { "threads", 1 }
+    };
+    return RMSDJsonControl;
+}
+
 void RMSDTraj::start()
 {
     if (m_second_file.compare("none") == 0)
@@ -141,27 +195,84 @@ void RMSDTraj::start()
 
 void RMSDTraj::ProcessSingleFile()
 {
-    //  Molecule mol(m_atoms, 0);
-    //  Molecule mol_2(m_atoms, 0);
-    Molecule prev;
     FileIterator file(m_filename);
     std::vector<int> progress(10, 0);
-    while (!file.AtEnd()) {
+
+    /* Without an external reference the first frame becomes the reference */
+    if (m_stored_structures.size() == 0 && !file.AtEnd()) {
         Molecule* molecule = new Molecule(file.Next());
-        //   std::cout << molecule->Atom(0).second.transpose() << std::endl;
-        bool check = CheckMolecule(molecule);
-        if (check) {
-            std::cout << "New structure added ... ( " << m_stored_structures.size() << "). " << /*  int(m_currentIndex / double(m_max_lines) * 100) << " % done ...!" << */ std::endl;
-        } else {
+        if (CheckMolecule(molecule))
+            std::cout << "New structure added ... ( " << m_stored_structures.size() << "). " << std::endl;
+        delete molecule;
+    }
+    if (m_stored_structures.size() == 0)
+        return;
+
+    if (m_writeAligned)
+        m_aligned_file.open(m_outfile + "_aligned.xyz", std::ios_base::app);
+
+    const int threads = std::max(1, m_threads);
+    const int blocksize = threads * std::max(1, m_blocksize);
+
+    std::vector<RMSDTrajThread*> workers;
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setProgressBar(CxxThreadPool::ProgressBarType::None);
+    pool->setActiveThreadCount(threads);
+    for (int i = 0; i < threads; ++i) {
+        RMSDTrajThread* thread = new RMSDTrajThread(RMSDControl(), m_heavy, m_fragment);
+        thread->setRMSDThreshold(m_rmsd_threshold);
+        workers.push_back(thread);
+        pool->addThread(thread);
+    }
+
+    std::vector<Molecule*> block = ReadBlock(&file, blocksize);
+    while (block.size()) {
+        std::vector<RMSDTrajFrame> frames(block.size());
+        for (std::size_t i = 0; i < block.size(); ++i) {
+            frames[i].molecule = block[i];
+            frames[i].energy = block[i]->Energy();
         }
-        if (progress[int((m_currentIndex / double(m_max_lines)) * 100) / 10] == 0) {
-            progress[int((m_currentIndex / double(m_max_lines)) * 100) / 10] = 1;
-            std::cout << int(m_currentIndex / double(m_max_lines) * 100) << " % done ...!" << std::endl;
+
+        const int known = m_stored_structures.size();
+        const int chunk = (frames.size() + threads - 1) / threads;
+        for (int i = 0; i < threads; ++i) {
+            int begin = std::min(int(frames.size()), i * chunk);
+            int end = std::min(int(frames.size()), begin + chunk);
+            workers[i]->setFrames(&frames, begin, end);
+            workers[i]->setUnique(&m_stored_structures, known, m_writeUnique);
         }
-        delete molecule;
-        if (CheckStop())
+
+        /* decode the next block while the workers align the current one */
+        std::future<std::vector<Molecule*>> next = std::async(std::launch::async, &RMSDTraj::ReadBlock, this, &file, blocksize);
+
+        pool->Reset();
+        pool->StaticPool();
+        pool->StartAndWait();
+
+        WriteBlock(frames, known);
+        for (auto& frame : frames)
+            delete frame.molecule;
+
+        block = next.get();
+
+        int percent = std::min(99, int((m_currentIndex / double(m_max_lines)) * 100));
+        if (progress[percent / 10] == 0) {
+            progress[percent / 10] = 1;
+            std::cout << percent << " % done ...!" << std::endl;
+        }
+        if (CheckStop()) {
+            for (auto* molecule : block)
+                delete molecule;
             break;
+        }
     }
+    pool->clear();
+    delete pool;
+    for (auto* thread : workers)
+        delete thread;
+
+    if (m_writeAligned)
+        m_aligned_file.close();
 
     PostAnalyse();
 
@@ -172,6 +283,62 @@ void RMSDTraj::ProcessSingleFile()
     }
 }
 
+std::vector<Molecule*> RMSDTraj::ReadBlock(FileIterator* file, int count)
+{
+    std::vector<Molecule*> block;
+    block.reserve(count);
+    while (!file->AtEnd() && block.size() < count)
+        block.push_back(new Molecule(file->Next()));
+    return block;
+}
+
+void RMSDTraj::WriteBlock(std::vector<RMSDTrajFrame>& frames, int known)
+{
+    for (auto& frame : frames) {
+        m_currentIndex += frame.molecule->AtomCount();
+
+        if (frame.rules.size())
+            std::cout << Tools::Vector2String(frame.rules) << std::endl;
+
+        m_rmsd_file << frame.rmsd << "\t" << std::setprecision(10) << frame.energy << std::endl;
+        m_rmsd_vector.push_back(frame.rmsd);
+        m_energy_vector.push_back(frame.energy);
+
+        if (m_writeAligned)
+            m_aligned_file << frame.aligned.XYZString();
+
+        if (m_pcafile) {
+            for (std::size_t j = 0; j < frame.aligned.AtomCount(); ++j) {
+                if (frame.aligned.Atom(j).first != 1)
+                    m_pca_file << frame.aligned.Atom(j).second(0) << " " << frame.aligned.Atom(j).second(1) << " " << frame.aligned.Atom(j).second(2);
+            }
+            m_pca_file << std::endl;
+        }
+
+        if (m_streampca)
+            AccumulatePCA(frame.aligned);
+
+        if (!frame.candidate)
+            continue;
+
+        /* Structures admitted within this block are unknown to the workers, check them serially */
+        bool unique = true;
+        for (int mols = m_stored_structures.size() - 1; mols >= known && unique; --mols) {
+            m_driver->setReference(*m_stored_structures[mols]);
+            m_driver->setTarget(frame.aligned);
+            m_driver->start();
+            unique = m_driver->RMSD() > m_rmsd_threshold;
+        }
+        m_driver->clear();
+
+        if (unique) {
+            m_stored_structures.push_back(new Molecule(frame.aligned));
+            frame.aligned.appendXYZFile(m_outfile + ".unique.xyz");
+            std::cout << "New structure added ... ( " << m_stored_structures.size() << "). " << std::endl;
+        }
+    }
+}
+
 bool RMSDTraj::CheckMolecule(Molecule* molecule)
 {
     bool result = false;
@@ -238,6 +405,9 @@ bool RMSDTraj::CheckMolecule(Molecule* molecule)
             m_pca_file << std::endl;
         }
 
+        if (m_streampca)
+            AccumulatePCA(m_driver->TargetAligned());
+
         double first_rmsd = m_driver->RMSD();
         if (m_writeUnique) {
             bool perform_rmsd = true;
@@ -292,22 +462,8 @@ void RMSDTraj::CompareTrajectories()
     FileIterator file1(m_filename);
     FileIterator file2(m_second_file);
 
-    json RMSDJsonControl = {
-        { "reorder", false },
-        { "check", false },
-        { "heavy", false },
-        { "fragment", -1 },
-        { "fragment_reference", -1 },
-        { "fragment_target", -1 },
-        { "init", -1 },
-        { "pt", 0 },
-        { "silent", true },
-        { "storage", 1.0 },
-        { "method", "incr" },
-        //{ "noreorder", m_noreorder },
-        { "threads", 1 }
-    };
-    m_driver = new RMSDDriver(RMSDJsonControl);
+    delete m_driver;
+    m_driver = new RMSDDriver(RMSDControl());
     m_driver->setProtons(!m_heavy);
     m_driver->setForceReorder(false);
     m_driver->setCheckConnections(false);
@@ -352,13 +508,86 @@ void RMSDTraj::PostAnalyse()
     m_rmsd_file << "#" << rmsd_std << "\t" << energy_std << std::endl;
     m_rmsd_file << "#" << rmsd_shannon << "\t" << energy_shannon << std::endl;
 
+    if (m_streampca)
+        WritePCA();
+
     // delete driver;
 }
 
+void RMSDTraj::AccumulatePCA(const Molecule& aligned)
+{
+    std::vector<float> coords;
+    for (std::size_t j = 0; j < aligned.AtomCount(); ++j) {
+        if (aligned.Atom(j).first == 1)
+            continue;
+        coords.push_back(aligned.Atom(j).second(0));
+        coords.push_back(aligned.Atom(j).second(1));
+        coords.push_back(aligned.Atom(j).second(2));
+    }
+    if (m_pca.Dimension() == 0)
+        m_pca.setDimension(coords.size());
+    if (coords.size() != m_pca.Dimension())
+        return;
+
+    m_pca.addSample(Eigen::Map<Eigen::VectorXf>(coords.data(), coords.size()).cast<double>());
+    /* the aligned coordinates are kept in binary for the projection after diagonalisation */
+    m_pca_scratch.write(reinterpret_cast<const char*>(coords.data()), coords.size() * sizeof(float));
+}
+
+void RMSDTraj::WritePCA()
+{
+    m_pca.Finalise(m_pca_modes);
+    if (m_pca.Samples() < 2) {
+        m_pca_scratch.close();
+        std::remove((m_outfile + "_pca.scratch").c_str());
+        return;
+    }
+    const Vector& eigenvalues = m_pca.Eigenvalues();
+    const Matrix& modes = m_pca.Modes();
+    const double total = eigenvalues.sum();
+
+    std::ofstream eigenvalue_file(m_outfile + "_pca_eigenvalues.dat");
+    eigenvalue_file << "# eigenvalue  fraction  cumulative" << std::endl;
+    double cumulative = 0;
+    for (int i = 0; i < eigenvalues.size(); ++i) {
+        cumulative += eigenvalues(i);
+        eigenvalue_file << eigenvalues(i) << " " << eigenvalues(i) / total << " " << cumulative / total << std::endl;
+    }
+
+    std::ofstream modes_file(m_outfile + "_pca_modes.dat");
+    modes_file << "# mean  mode_1 ... mode_" << modes.cols() << std::endl;
+    for (int i = 0; i < modes.rows(); ++i) {
+        modes_file << m_pca.Mean()(i);
+        for (int j = 0; j < modes.cols(); ++j)
+            modes_file << " " << modes(i, j);
+        modes_file << std::endl;
+    }
+
+    std::ofstream projection_file(m_outfile + "_pca_projection.dat");
+    projection_file << "# frame  pc_1 ... pc_" << modes.cols() << std::endl;
+    m_pca_scratch.flush();
+    m_pca_scratch.seekg(0);
+    std::vector<float> coords(m_pca.Dimension());
+    for (long long frame = 0; frame < m_pca.Samples(); ++frame) {
+        if (!m_pca_scratch.read(reinterpret_cast<char*>(coords.data()), coords.size() * sizeof(float)))
+            break;
+        Vector projection = m_pca.Project(Eigen::Map<Eigen::VectorXf>(coords.data(), coords.size()).cast<double>());
+        projection_file << frame + 1;
+        for (int j = 0; j < projection.size(); ++j)
+            projection_file << " " << projection(j);
+        projection_file << std::endl;
+    }
+    m_pca_scratch.close();
+    std::remove((m_outfile + "_pca.scratch").c_str());
+    std::cout << "PCA of " << m_pca.Samples() << " structures written to " << m_outfile + "_pca_eigenvalues.dat, " << m_outfile + "_pca_modes.dat and " << m_outfile + "_pca_projection.dat" << std::endl;
+}
+
 void RMSDTraj::LoadControlJson()
 {
     m_heavy = Json2KeyWord<bool>(m_defaults, "heavy");
     m_pcafile = Json2KeyWord<bool>(m_defaults, "pcafile");
+    m_streampca = Json2KeyWord<bool>(m_defaults, "pca");
+    m_pca_modes = Json2KeyWord<int>(m_defaults, "pcamodes");
     m_writeUnique = Json2KeyWord<bool>(m_defaults, "writeUnique");
     m_writeAligned = Json2KeyWord<bool>(m_defaults, "writeAligned");
     m_rmsd_threshold = Json2KeyWord<double>(m_defaults, "rmsd");
@@ -372,6 +601,8 @@ void RMSDTraj::LoadControlJson()
     m_filter = Json2KeyWord<bool>(m_defaults, "filter");
     m_writeRMSD = Json2KeyWord<bool>(m_defaults, "writeRMSD");
     m_offset = m_defaults["offset"];
+    m_threads = Json2KeyWord<int>(m_defaults, "threads");
+    m_blocksize = Json2KeyWord<int>(m_defaults, "blocksize");
 }
 
 void RMSDTraj::Optimise()
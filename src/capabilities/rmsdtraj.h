@@ -28,9 +28,14 @@
 
 #include "src/core/molecule.h"
 
+#include "src/tools/pca.h"
+
+#include "external/CxxThreadPool/include/CxxThreadPool.h"
+
 #include "curcumamethod.h"
 
 class RMSDDriver;
+class FileIterator;
 
 #include "json.hpp"
 using json = nlohmann::json;
@@ -44,13 +49,61 @@ const json RMSDTrajJson{
     { "second", "none" },
     { "heavy", false },
     { "pcafile", false },
+    { "pca", false },
+    { "pcamodes", 10 },
     { "allxyz", false },
     { "RefFirst", false },
     { "noreorder", true },
     { "opt", false },
     { "filter", false },
     { "writeRMSD", true },
-    { "offset", 0 }
+    { "offset", 0 },
+    { "threads", 1 },
+    { "blocksize", 64 }
+};
+
+/*! \brief Result of a single trajectory frame, filled by the worker and consumed in frame order */
+struct RMSDTrajFrame {
+    Molecule* molecule = nullptr;
+    Molecule aligned;
+    std::vector<int> rules;
+    double rmsd = 0;
+    double energy = 0;
+    bool candidate = false;
+};
+
+/*! \brief Worker of the RMSDTraj pipeline, owns its RMSDDriver and processes a contiguous range of frames */
+class RMSDTrajThread : public CxxThread {
+public:
+    RMSDTrajThread(const json& config, bool heavy, int fragment);
+    ~RMSDTrajThread();
+
+    int execute() override;
+
+    void setFrames(std::vector<RMSDTrajFrame>* frames, int start, int end)
+    {
+        m_frames = frames;
+        m_start = start;
+        m_end = end;
+    }
+
+    /*! \brief Unique structures known before the current block was dispatched, index 0 is the reference */
+    void setUnique(const std::vector<Molecule*>* unique, int count, bool check)
+    {
+        m_unique = unique;
+        m_unique_count = count;
+        m_check_unique = check;
+    }
+
+    inline void setRMSDThreshold(double rmsd_threshold) { m_rmsd_threshold = rmsd_threshold; }
+
+private:
+    RMSDDriver* m_driver;
+    std::vector<RMSDTrajFrame>* m_frames = nullptr;
+    const std::vector<Molecule*>* m_unique = nullptr;
+    int m_start = 0, m_end = 0, m_unique_count = 0;
+    bool m_check_unique = false;
+    double m_rmsd_threshold = 1.0;
 };
 
 class RMSDTraj : public CurcumaMethod {
@@ -107,8 +160,25 @@ private:
     void ProcessSingleFile();
     void CompareTrajectories();
 
+    /* Reader stage, decodes up to count frames from the iterator */
+    std::vector<Molecule*> ReadBlock(FileIterator* file, int count);
+
+    /* Sequencer, writes the results of one block in frame order and admits unique structures,
+     * known is the number of stored structures the workers already compared against */
+    void WriteBlock(std::vector<RMSDTrajFrame>& frames, int known);
+
+    json RMSDControl() const;
+
+    /* Add the aligned heavy atom coordinates to the streaming PCA */
+    void AccumulatePCA(const Molecule& aligned);
+
+    /* Write eigenvalues, modes and projections of the streaming PCA */
+    void WritePCA();
+
     std::string m_filename, m_reference, m_second_file, m_outfile;
-    std::ofstream m_rmsd_file, m_pca_file, m_pairwise_file;
+    std::ofstream m_rmsd_file, m_pca_file, m_pairwise_file, m_aligned_file;
+    std::fstream m_pca_scratch;
+    IncrementalPCA m_pca;
     std::vector<Molecule*> m_stored_structures;
     Molecule *m_initial, *m_previous;
     RMSDDriver* m_driver;
@@ -118,7 +188,10 @@ private:
     int m_atoms = -1;
     int m_max_lines = -1;
     int m_offset = 0;
+    int m_threads = 1;
+    int m_blocksize = 64;
+    int m_pca_modes = 10;
     bool m_writeUnique = false, m_pairwise = false, m_heavy = false, m_pcafile = false, m_writeAligned = false, m_ref_first = false, m_opt = false, m_filter = false, m_writeRMSD = true;
-    bool m_allxyz = false;
+    bool m_allxyz = false, m_streampca = false;
     double m_rmsd_threshold = 1.0;
 };
@@ -58,6 +58,7 @@ SimpleMD::~SimpleMD()
 {
     for (int i = 0; i < m_unique_structures.size(); ++i)
         delete m_unique_structures[i];
+    delete m_checkpoint_writer;
 }
 
 void SimpleMD::LoadControlJson()
@@ -77,6 +78,7 @@ void SimpleMD::LoadControlJson()
     m_print = Json2KeyWord<int>(m_defaults, "print");
     m_max_top_diff = Json2KeyWord<int>(m_defaults, "MaxTopoDiff");
     m_seed = Json2KeyWord<int>(m_defaults, "seed");
+    m_replica = Json2KeyWord<int>(m_defaults, "replica");
 
     m_rmsd = Json2KeyWord<double>(m_defaults, "rmsd");
     m_hmass = Json2KeyWord<double>(m_defaults, "hmass");
@@ -87,11 +89,13 @@ void SimpleMD::LoadControlJson()
     m_opt = Json2KeyWord<bool>(m_defaults, "opt");
     m_scale_velo = Json2KeyWord<double>(m_defaults, "velo");
     m_rescue = Json2KeyWord<bool>(m_defaults, "rescue");
+    m_max_rescue = std::max(1, Json2KeyWord<int>(m_defaults, "max_rescue"));
     m_coupling = Json2KeyWord<double>(m_defaults, "coupling");
     if (m_coupling < m_dT)
         m_coupling = m_dT;
 
     m_writerestart = Json2KeyWord<int>(m_defaults, "writerestart");
+    m_binary_checkpoint = Json2KeyWord<std::string>(m_defaults, "checkpoint").compare("json") != 0;
     m_respa = Json2KeyWord<int>(m_defaults, "respa");
     m_dipole = Json2KeyWord<bool>(m_defaults, "dipole");
 
@@ -182,17 +186,23 @@ void SimpleMD::LoadControlJson()
 
 bool SimpleMD::Initialise()
 {
-    static std::random_device rd{};
-    static std::mt19937 gen{ rd() };
     if (m_seed == -1) {
         const auto start = std::chrono::high_resolution_clock::now();
         m_seed = std::chrono::duration_cast<std::chrono::seconds>(start.time_since_epoch()).count();
     } else if (m_seed == 0)
         m_seed = m_T0 * m_mass.size();
-    std::cout << "Random seed is " << m_seed << std::endl;
-    gen.seed(m_seed);
-
-    if (m_initfile.compare("none") != 0) {
+    std::cout << "Random seed is " << m_seed << ", stream " << m_replica << std::endl;
+    m_rng.seed(m_seed, m_replica);
+
+    std::vector<char> checkpoint;
+    if (m_initfile.size() > 5 && m_initfile.compare(m_initfile.size() - 5, 5, ".ckpt") == 0) {
+        checkpoint = MDCheckpoint::ReadFile(m_initfile);
+        if (checkpoint.empty()) {
+            AppendError("Could not read checkpoint " + m_initfile);
+            return false;
+        }
+        m_restart = true;
+    } else if (m_initfile.compare("none") != 0) {
         json md;
         std::ifstream restart_file(m_initfile);
         try {
@@ -204,8 +214,13 @@ bool SimpleMD::Initialise()
         }
         LoadRestartInformation(md);
         m_restart = true;
-    } else if (!m_norestart)
-        LoadRestartInformation();
+    } else if (!m_norestart) {
+        checkpoint = MDCheckpoint::ReadFile(CheckpointFile());
+        if (checkpoint.empty())
+            LoadRestartInformation();
+        else
+            m_restart = true;
+    }
 
     if (m_molecule.AtomCount() == 0)
         return false;
@@ -305,6 +320,14 @@ bool SimpleMD::Initialise()
     m_dof = 3 * m_natoms;
 
     InitConstrainedBonds();
+    /* the checkpoint overrides the state set up above, including walls and constraints */
+    if (!checkpoint.empty()) {
+        if (!LoadCheckpoint(checkpoint)) {
+            AppendError("Checkpoint is damaged or does not belong to this structure.");
+            return false;
+        }
+        std::cout << "Continuing from checkpoint at " << m_currentStep << " fs" << std::endl;
+    }
     if (m_writeinit) {
         json init = WriteRestartInformation();
         std::ofstream result_file;
@@ -346,15 +369,12 @@ void SimpleMD::InitConstrainedBonds()
 
 void SimpleMD::InitVelocities(double scaling)
 {
-    static std::random_device rd{};
-    static std::mt19937 gen{ rd() };
-    std::normal_distribution<> d{ 0, 1 };
     double Px = 0.0, Py = 0.0, Pz = 0.0;
     for (int i = 0; i < m_natoms; ++i) {
         double v0 = sqrt(kb_Eh * m_T0 * amu2au / (m_mass[i])) * scaling / fs2amu;
-        m_velocities[3 * i + 0] = v0 * d(gen);
-        m_velocities[3 * i + 1] = v0 * d(gen);
-        m_velocities[3 * i + 2] = v0 * d(gen);
+        m_velocities[3 * i + 0] = v0 * m_rng.Normal();
+        m_velocities[3 * i + 1] = v0 * m_rng.Normal();
+        m_velocities[3 * i + 2] = v0 * m_rng.Normal();
         Px += m_velocities[3 * i + 0] * m_mass[i];
         Py += m_velocities[3 * i + 1] * m_mass[i];
         Pz += m_velocities[3 * i + 2] * m_mass[i];
@@ -442,6 +462,9 @@ nlohmann::json SimpleMD::WriteRestartInformation()
     restart["rm_COM"] = m_rm_COM;
     restart["mtd"] = m_mtd;
 
+    const CounterRNG::State& rng = m_rng.getState();
+    restart["rng"] = { rng.seed, rng.stream, rng.step, rng.index };
+
     return restart;
 };
 
@@ -570,9 +593,145 @@ bool SimpleMD::LoadRestartInformation(const json& state)
     }
     m_restart = geometry.size() && velocities.size();
 
+    if (state.contains("rng") && state["rng"].is_array() && state["rng"].size() == 4) {
+        CounterRNG::State rng;
+        rng.seed = state["rng"][0];
+        rng.stream = state["rng"][1];
+        rng.step = state["rng"][2];
+        rng.index = state["rng"][3];
+        m_rng.setState(rng);
+    }
+
     return true;
 }
 
+void SimpleMD::CaptureState(MDState& state) const
+{
+    /* assign keeps the capacity of the slot, so after the first round no allocation happens */
+    state.geometry.assign(m_current_geometry.begin(), m_current_geometry.end());
+    state.velocities.assign(m_velocities.begin(), m_velocities.end());
+    state.gradient.assign(m_gradient.begin(), m_gradient.end());
+    state.current_step = m_currentStep;
+    state.T = m_T;
+    state.Epot = m_Epot;
+    state.Ekin = m_Ekin;
+    state.Etot = m_Etot;
+    state.Ekin_exchange = m_Ekin_exchange;
+    state.aver_Temp = m_aver_Temp;
+    state.aver_Epot = m_aver_Epot;
+    state.aver_Ekin = m_aver_Ekin;
+    state.aver_Etot = m_aver_Etot;
+    state.aver_dipol = m_aver_dipol;
+    state.average_virial = m_average_virial_correction;
+    state.average_wall = m_average_wall_potential;
+    state.rng = m_rng.getState();
+}
+
+void SimpleMD::RestoreState(const MDState& state)
+{
+    m_current_geometry.assign(state.geometry.begin(), state.geometry.end());
+    m_velocities.assign(state.velocities.begin(), state.velocities.end());
+    m_gradient.assign(state.gradient.begin(), state.gradient.end());
+    m_currentStep = state.current_step;
+    m_T = state.T;
+    m_Epot = state.Epot;
+    m_Ekin = state.Ekin;
+    m_Etot = state.Etot;
+    m_Ekin_exchange = state.Ekin_exchange;
+    m_aver_Temp = state.aver_Temp;
+    m_aver_Epot = state.aver_Epot;
+    m_aver_Ekin = state.aver_Ekin;
+    m_aver_Etot = state.aver_Etot;
+    m_aver_dipol = state.aver_dipol;
+    m_average_virial_correction = state.average_virial;
+    m_average_wall_potential = state.average_wall;
+    m_rng.setState(state.rng);
+}
+
+std::string SimpleMD::CheckpointFile() const
+{
+    return (Basename().empty() ? std::string("curcuma_md") : Basename()) + ".ckpt";
+}
+
+std::vector<char> SimpleMD::WriteCheckpoint() const
+{
+    MDState state;
+    CaptureState(state);
+    MDCheckpoint::Writer writer;
+    writer.Put(static_cast<uint64_t>(m_natoms));
+    writer.Put(static_cast<int64_t>(m_step));
+    writer.Put(state.geometry);
+    writer.Put(state.velocities);
+    writer.Put(state.gradient);
+    for (double value : { state.current_step, state.T, state.Epot, state.Ekin, state.Etot, state.Ekin_exchange, state.aver_Temp, state.aver_Epot, state.aver_Ekin, state.aver_Etot, state.aver_dipol, state.average_virial, state.average_wall })
+        writer.Put(value);
+    writer.Put(state.rng);
+    for (double value : { m_wall_spheric_radius, m_wall_x_min, m_wall_x_max, m_wall_y_min, m_wall_y_max, m_wall_z_min, m_wall_z_max })
+        writer.Put(value);
+    writer.Put(static_cast<uint64_t>(m_bond_constrained.size()));
+    for (const auto& bond : m_bond_constrained) {
+        writer.Put(static_cast<int32_t>(bond.first.first));
+        writer.Put(static_cast<int32_t>(bond.first.second));
+        writer.Put(bond.second);
+    }
+    writer.Put(static_cast<uint8_t>(m_eval_mtd));
+    return writer.Finish();
+}
+
+bool SimpleMD::LoadCheckpoint(const std::vector<char>& data)
+{
+    MDCheckpoint::Reader reader(data);
+    uint64_t atoms = 0, bonds = 0;
+    int64_t step = 0;
+    MDState state;
+    if (!reader.Valid() || !reader.Get(atoms) || atoms != m_natoms || !reader.Get(step))
+        return false;
+    reader.Get(state.geometry);
+    reader.Get(state.velocities);
+    reader.Get(state.gradient);
+    for (double* value : { &state.current_step, &state.T, &state.Epot, &state.Ekin, &state.Etot, &state.Ekin_exchange, &state.aver_Temp, &state.aver_Epot, &state.aver_Ekin, &state.aver_Etot, &state.aver_dipol, &state.average_virial, &state.average_wall })
+        reader.Get(*value);
+    reader.Get(state.rng);
+    double walls[7];
+    for (double& value : walls)
+        reader.Get(value);
+    std::vector<std::pair<std::pair<int, int>, double>> constrained;
+    reader.Get(bonds);
+    for (uint64_t i = 0; i < bonds && reader.Valid(); ++i) {
+        int32_t first = 0, second = 0;
+        double distance = 0;
+        reader.Get(first);
+        reader.Get(second);
+        reader.Get(distance);
+        constrained.push_back({ { first, second }, distance });
+    }
+    uint8_t eval_mtd = m_eval_mtd;
+    reader.Get(eval_mtd);
+    if (!reader.Valid() || state.geometry.size() != 3 * atoms || state.velocities.size() != 3 * atoms)
+        return false;
+
+    RestoreState(state);
+    m_gradient.resize(3 * atoms);
+    m_step = step;
+    m_wall_spheric_radius = walls[0];
+    m_wall_x_min = walls[1];
+    m_wall_x_max = walls[2];
+    m_wall_y_min = walls[3];
+    m_wall_y_max = walls[4];
+    m_wall_z_min = walls[5];
+    m_wall_z_max = walls[6];
+    m_bond_constrained = constrained;
+    m_eval_mtd = eval_mtd;
+    return true;
+}
+
+void SimpleMD::QueueCheckpoint()
+{
+    if (!m_checkpoint_writer)
+        m_checkpoint_writer = new MDCheckpoint::AsyncWriter;
+    m_checkpoint_writer->Write(CheckpointFile(), WriteCheckpoint());
+}
+
 void SimpleMD::start()
 {
     if (m_initialised == false)
@@ -580,7 +739,7 @@ void SimpleMD::start()
     auto unix_timestamp = std::chrono::seconds(std::time(NULL));
     m_unix_started = std::chrono::milliseconds(unix_timestamp).count();
     double* gradient = new double[3 * m_natoms];
-    std::vector<json> states;
+    m_snapshots.setCapacity(m_max_rescue);
     for (int i = 0; i < 3 * m_natoms; ++i) {
         gradient[i] = 0;
     }
@@ -601,8 +760,6 @@ void SimpleMD::start()
     m_Ekin = EKin();
     m_Etot = m_Epot + m_Ekin;
 
-    int m_step = 0;
-
     PrintStatus();
 
 #ifdef USE_Plumed
@@ -669,9 +826,15 @@ void SimpleMD::start()
 
     for (; m_currentStep < m_maxtime;) {
         auto step0 = std::chrono::system_clock::now();
+        /* random numbers of a step only depend on seed, replica and the simulation time */
+        m_rng.setStep(std::llround(m_currentStep / m_dT));
 
         if (CheckStop() == true) {
             TriggerWriteRestart();
+            if (m_binary_checkpoint) {
+                QueueCheckpoint();
+                m_checkpoint_writer->Wait();
+            }
 #ifdef USE_Plumed
             if (m_mtd) {
                 plumed_finalize(plumedmain); // Call the plumed destructor
@@ -679,6 +842,12 @@ void SimpleMD::start()
 #endif
             return;
         }
+        if (CheckpointRequested()) {
+            std::cout << "Writing restart file on request ..." << std::endl;
+            TriggerWriteRestart();
+            if (m_binary_checkpoint)
+                QueueCheckpoint();
+        }
 
         if (m_rm_COM_step > 0 && m_step % m_rm_COM_step == 0) {
             // std::cout << "Removing COM motion." << std::endl;
@@ -723,11 +892,12 @@ void SimpleMD::start()
         if (m_step % m_dump == 0) {
             bool write = WriteGeometry();
             if (write) {
-                states.push_back(WriteRestartInformation());
+                if (m_rescue)
+                    CaptureState(m_snapshots.Next());
                 m_current_rescue = 0;
-            } else if (!write && m_rescue && states.size() > (1 - m_current_rescue)) {
+            } else if (!write && m_rescue && m_snapshots.Size() > m_current_rescue) {
                 std::cout << "Molecule exploded, resetting to previous state ..." << std::endl;
-                LoadRestartInformation(states[states.size() - 1 - m_current_rescue]);
+                RestoreState(m_snapshots.Latest(m_current_rescue));
                 Geometry geometry = m_molecule.getGeometry();
                 for (int i = 0; i < m_natoms; ++i) {
                     geometry(i, 0) = m_current_geometry[3 * i + 0] * au;
@@ -762,9 +932,12 @@ void SimpleMD::start()
         }
 
         if (m_writerestart > -1 && m_step % m_writerestart == 0) {
-            std::ofstream restart_file("curcuma_step_" + std::to_string(int(m_step * m_dT)) + ".json");
-            nlohmann::json restart;
-            restart_file << WriteRestartInformation() << std::endl;
+            if (m_binary_checkpoint)
+                QueueCheckpoint();
+            else {
+                std::ofstream restart_file("curcuma_step_" + std::to_string(int(m_step * m_dT)) + ".json");
+                restart_file << WriteRestartInformation() << std::endl;
+            }
         }
         if ((m_step && int(m_step * m_dT) % m_print == 0)) {
             m_Etot = m_Epot + m_Ekin;
@@ -809,6 +982,12 @@ void SimpleMD::start()
     std::ofstream restart_file("curcuma_final.json");
     restart_file << WriteRestartInformation() << std::endl;
     std::remove("curcuma_restart.json");
+    if (m_checkpoint_writer) {
+        m_checkpoint_writer->Wait();
+        if (m_checkpoint_writer->Failed())
+            std::cout << "Writing the checkpoint " << CheckpointFile() << " failed at least once." << std::endl;
+    }
+    std::remove(CheckpointFile().c_str());
     delete[] gradient;
 }
 
@@ -1427,13 +1606,10 @@ void SimpleMD::CSVR()
 {
     double Ekin_target = 0.5 * kb_Eh * (m_T0)*m_dof;
     double c = exp(-(m_dT * m_respa) / m_coupling);
-    static std::random_device rd{};
-    static std::mt19937 gen{ rd() };
-    static std::normal_distribution<> d{ 0, 1 };
-    static std::chi_squared_distribution<float> dchi{ m_dof };
+    std::chi_squared_distribution<double> dchi{ double(m_dof) };
 
-    double R = d(gen);
-    double SNf = dchi(gen);
+    double R = m_rng.Normal();
+    double SNf = dchi(m_rng);
     double alpha2 = c + (1 - c) * (SNf + R * R) * Ekin_target / (m_dof * m_Ekin) + 2 * R * sqrt(c * (1 - c) * Ekin_target / (m_dof * m_Ekin));
     m_Ekin_exchange += m_Ekin * (alpha2 - 1);
     double alpha = sqrt(alpha2);
@@ -19,17 +19,21 @@
 
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <ctime>
 #include <functional>
 #include <random>
 #include <ratio>
 
+#include "src/capabilities/mdcheckpoint.h"
 #include "src/capabilities/rmsdtraj.h"
 
 #include "src/core/energycalculator.h"
 #include "src/core/molecule.h"
 
+#include "src/tools/counterrng.h"
+
 #include "external/CxxThreadPool/include/CxxThreadPool.h"
 
 #include "curcumamethod.h"
@@ -53,6 +57,7 @@ static json CurcumaMDJson{
     { "hmass", 1 },
     { "velo", 1 },
     { "rescue", false },
+    { "max_rescue", 10 }, // number of snapshots kept for rescue
     { "coupling", 10 },
     { "MaxTopoDiff", 15 },
     { "impuls", 0 },
@@ -62,6 +67,7 @@ static json CurcumaMDJson{
     { "initfile", "none" },
     { "norestart", false },
     { "writerestart", 1000 },
+    { "checkpoint", "binary" }, // format of the periodic restart files, binary (exact, written in background) or json
     { "rattle", false },
     { "rattle_tolerance", 1e-6 },
     { "rattle_maxiter", 10 },
@@ -69,6 +75,7 @@ static json CurcumaMDJson{
     { "respa", 1 },
     { "dipole", false },
     { "seed", 1 },
+    { "replica", 0 }, // random stream of this trajectory, set per thread by MDThread
     { "cleanenergy", false },
     { "wall", "none" }, // can be spheric or rect
     { "wall_type", "harmonic" }, // can be logfermi or harmonic
@@ -89,6 +96,42 @@ static json CurcumaMDJson{
     { "mtd_dT", -1 }
 };
 
+/*! \brief Dynamic state of a trajectory, raw copies of the coordinate buffers (atomic units) */
+struct MDState {
+    std::vector<double> geometry, velocities, gradient;
+    double current_step = 0, T = 0, Epot = 0, Ekin = 0, Etot = 0, Ekin_exchange = 0;
+    double aver_Temp = 0, aver_Epot = 0, aver_Ekin = 0, aver_Etot = 0, aver_dipol = 0, average_virial = 0, average_wall = 0;
+    CounterRNG::State rng;
+};
+
+/*! \brief Fixed number of snapshots, the oldest one is overwritten, slots keep their buffers */
+class MDSnapshotRing {
+public:
+    inline void setCapacity(int capacity)
+    {
+        m_slots = std::vector<MDState>(std::max(1, capacity));
+        m_head = m_size = 0;
+    }
+
+    /* slot for the next snapshot */
+    inline MDState& Next()
+    {
+        MDState& slot = m_slots[m_head];
+        m_head = (m_head + 1) % m_slots.size();
+        m_size = std::min<int>(m_size + 1, m_slots.size());
+        return slot;
+    }
+
+    /* back = 0 is the latest snapshot */
+    inline const MDState& Latest(int back = 0) const { return m_slots[(m_head + m_slots.size() - 1 - back) % m_slots.size()]; }
+
+    inline int Size() const { return m_size; }
+
+private:
+    std::vector<MDState> m_slots = std::vector<MDState>(1);
+    int m_head = 0, m_size = 0;
+};
+
 class SimpleMD : public CurcumaMethod {
 public:
     SimpleMD(const json& controller, bool silent);
@@ -122,6 +165,15 @@ private:
 
     bool LoadRestartInformation(const json& state);
 
+    void CaptureState(MDState& state) const;
+    void RestoreState(const MDState& state);
+
+    /* Binary checkpoint of the complete dynamic state, see mdcheckpoint.h for the layout */
+    std::vector<char> WriteCheckpoint() const;
+    bool LoadCheckpoint(const std::vector<char>& data);
+    void QueueCheckpoint();
+    std::string CheckpointFile() const;
+
     virtual StringList MethodName() const override
     {
         return { "MD" };
@@ -211,6 +263,9 @@ private:
     std::vector<double> m_collected_dipole;
     Matrix m_topo_initial;
     std::vector<Molecule*> m_unique_structures;
+    MDSnapshotRing m_snapshots;
+    MDCheckpoint::AsyncWriter* m_checkpoint_writer = nullptr;
+    bool m_binary_checkpoint = true;
     std::string m_method = "UFF", m_initfile = "none", m_thermostat = "csvr", m_plumed;
     bool m_unstable = false;
     bool m_dipole = false;
@@ -218,7 +273,9 @@ private:
     bool m_mtd = false;
     bool m_eval_mtd = true;
     int m_mtd_dT = -1;
-    int m_seed = -1;
+    long long m_seed = -1;
+    int m_replica = 0;
+    CounterRNG m_rng;
     int m_time_step = 0;
     int m_dof = 0;
 };
@@ -239,6 +296,7 @@ public:
     {
         json controller;
         controller["md"] = m_controller;
+        controller["md"]["replica"] = ThreadId();
         m_mddriver = new SimpleMD(controller, false);
         m_mddriver->setMolecule(m_molecule);
         m_mddriver->overrideBasename(m_basename + ".t" + std::to_string(ThreadId()));
@@ -22,6 +22,9 @@
 
 #include "external/CxxThreadPool/include/CxxThreadPool.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <set>
 #include <vector>
 
@@ -31,328 +34,377 @@
 
 #include "eht.h"
 
-EHT::EHT()
+EHT::EHT(const json& controller)
 {
+    json settings = MergeJson(EHTSettings, controller);
+    m_threads = settings["eht_threads"];
+    m_threshold = settings["eht_screening"];
+    m_K = settings["eht_K"];
 }
 
-void EHT::start()
+void EHTOverlapBlock(const EHTPrimitiveSet& set, const EHTShell& a, const EHTShell& b, const Position& R, double threshold, Matrix& block)
 {
-    m_molecule.print_geom();
-
-    std::vector<STO_6G> basisset;
-    for (int i = 0; i < m_molecule.Atoms().size(); ++i) {
-        if (m_molecule.Atom(i).first == 1) {
-            m_num_electrons += 1;
-            STO_6G b;
-            b.index = i;
-
-            ehtSTO_6GHs t;
-            b.alpha = t.alpha;
-            b.coeff = t.coeff;
-            b.sym = "s";
-            b.e = -0.5;
-            basisset.push_back(b);
-            std::cout << "H" << std::endl;
-        } else if (m_molecule.Atom(i).first == 6) {
-            m_num_electrons += 4;
-
-            STO_6G b;
-            b.index = i;
-            b.sym = "s";
-            ehtSTO_6GCs t;
-            b.alpha = t.alpha;
-            b.coeff = t.coeff;
-            b.e = -0.7144;
-
-            basisset.push_back(b);
-            ehtSTO_6GCp t2;
-            b.alpha = t2.alpha;
-            b.coeff = t2.coeff;
-            b.x = 1;
-            b.sym = "pz";
-            b.e = -0.3921;
-
-            basisset.push_back(b);
-
-            b.x = 0;
-            b.y = 1;
-            b.sym = "px";
-            basisset.push_back(b);
-
-            b.y = 0;
-            b.z = 1;
-            b.sym = "py";
-            basisset.push_back(b);
-            std::cout << "C" << std::endl;
-        } else if (m_molecule.Atom(i).first == 8) {
-            m_num_electrons += 6;
-
-            STO_6G b;
-            b.index = i;
-            b.sym = "s";
-            ehtSTO_6GOs t;
-            b.alpha = t.alpha;
-            b.coeff = t.coeff;
-            b.e = -1.1904;
-
-            basisset.push_back(b);
-            ehtSTO_6GOp t2;
-            b.alpha = t2.alpha;
-            b.coeff = t2.coeff;
-            b.x = 1;
-            b.sym = "pz";
-            b.e = -0.5827;
-
-            basisset.push_back(b);
-
-            b.x = 0;
-            b.y = 1;
-            b.sym = "px";
-            basisset.push_back(b);
-
-            b.y = 0;
-            b.z = 1;
-            b.sym = "py";
-            basisset.push_back(b);
-            std::cout << "O" << std::endl;
-        } else if (m_molecule.Atom(i).first == 7) {
-            m_num_electrons += 5;
-
-            STO_6G b;
-            b.index = i;
-            b.sym = "s";
-            ehtSTO_6GNs t;
-            b.alpha = t.alpha;
-            b.coeff = t.coeff;
-            b.e = -0.9404;
-
-            basisset.push_back(b);
-            ehtSTO_6GNp t2;
-            b.alpha = t2.alpha;
-            b.coeff = t2.coeff;
-            b.x = 1;
-            b.sym = "pz";
-            b.e = -0.5110;
-
-            basisset.push_back(b);
-
-            b.x = 0;
-            b.y = 1;
-            b.sym = "px";
-            basisset.push_back(b);
-
-            b.y = 0;
-            b.z = 1;
-            b.sym = "py";
-            basisset.push_back(b);
-            std::cout << "O" << std::endl;
+    block.setZero(a.Functions(), b.Functions());
+    const double r2 = R.squaredNorm();
+    /* (1 + r2) bounds the polynomial prefactors of the p functions */
+    if (set.max_prefactor * exp(-set.min_mu * r2) * (1 + r2) < threshold)
+        return;
+
+    for (const auto& prim : set.primitives) {
+        const double s00 = prim.prefactor * exp(-prim.mu * r2);
+        if (std::abs(s00) * (1 + r2) < threshold)
+            continue;
+        /* P - A = -beta/p (A - B), P - B = alpha/p (A - B) */
+        if (a.l == 0 && b.l == 0)
+            block(0, 0) += s00;
+        else if (a.l == 0) {
+            for (int k = 0; k < 3; ++k)
+                block(0, k) += prim.alpha_p * R(k) * s00;
+        } else if (b.l == 0) {
+            for (int k = 0; k < 3; ++k)
+                block(k, 0) -= prim.beta_p * R(k) * s00;
+        } else {
+            for (int k = 0; k < 3; ++k)
+                for (int l = 0; l < 3; ++l)
+                    block(k, l) += (-prim.beta_p * R(k) * prim.alpha_p * R(l) + (k == l) * prim.half_p) * s00;
         }
     }
-    std::cout << basisset.size() << std::endl;
-    Matrix S = MakeOverlap(basisset);
-    // std::cout << S << std::endl;
-    Matrix H = MakeH(S, basisset);
-    std::cout << std::endl
-              << std::endl;
-    // std::cout << H << std::endl;
-
-    Matrix S_1_2 = Matrix::Zero(basisset.size(), basisset.size());
-    Eigen::JacobiSVD<Matrix> svd(S, Eigen::ComputeThinU | Eigen::ComputeThinV);
-
-    Matrix IntS;
-    IntS.setZero(basisset.size(), basisset.size());
-
-    for (int i = 0; i < basisset.size(); ++i)
-        IntS(i, i) = 1 / sqrt(svd.singularValues()(i));
-
-    S_1_2 = svd.matrixU() * IntS * svd.matrixV().transpose();
-
-    Eigen::SelfAdjointEigenSolver<Matrix> diag_F;
-    Matrix F = S_1_2.transpose() * H * S_1_2;
-    diag_F.compute(F);
-    std::cout << std::endl;
-    // std::cout << diag_F.eigenvalues() <<std::endl;
-
-    double energy = 0;
-    for (int i = 0; i < m_num_electrons / 2; ++i) {
-        energy += diag_F.eigenvalues()(i) * 2;
-        std::cout << diag_F.eigenvalues()(i) << " 2" << std::endl;
+}
+
+void EHTOverlapDerivativeBlock(const EHTPrimitiveSet& set, const EHTShell& a, const EHTShell& b, const Position& R, double threshold, std::array<Matrix, 3>& block)
+{
+    for (auto& d : block)
+        d.setZero(a.Functions(), b.Functions());
+    const double r2 = R.squaredNorm();
+    if (set.max_prefactor * exp(-set.min_mu * r2) * (1 + r2) < threshold)
+        return;
+
+    for (const auto& prim : set.primitives) {
+        const double s00 = prim.prefactor * exp(-prim.mu * r2);
+        if (std::abs(s00) * (1 + r2) < threshold)
+            continue;
+        for (int m = 0; m < 3; ++m) {
+            /* d s00 / d R_m */
+            const double ds00 = -2 * prim.mu * R(m) * s00;
+            if (a.l == 0 && b.l == 0)
+                block[m](0, 0) += ds00;
+            else if (a.l == 0) {
+                for (int k = 0; k < 3; ++k)
+                    block[m](0, k) += prim.alpha_p * ((k == m) * s00 + R(k) * ds00);
+            } else if (b.l == 0) {
+                for (int k = 0; k < 3; ++k)
+                    block[m](k, 0) -= prim.beta_p * ((k == m) * s00 + R(k) * ds00);
+            } else {
+                const double ab = prim.alpha_p * prim.beta_p;
+                for (int k = 0; k < 3; ++k)
+                    for (int l = 0; l < 3; ++l)
+                        block[m](k, l) += -ab * ((k == m) * R(l) + (l == m) * R(k)) * s00
+                            + (-ab * R(k) * R(l) + (k == l) * prim.half_p) * ds00;
+            }
+        }
     }
-    std::cout << "Total electronic energy = " << energy << " Eh." << std::endl;
-    // std::cout << diag_F.eigenvalues().sum();
 }
 
-Matrix EHT::MakeOverlap(const std::vector<STO_6G>& basisset)
+void EHTIntegralThread::OverlapGradient()
 {
-    Matrix S = Eigen::MatrixXd::Zero(basisset.size(), basisset.size());
-
-    std::vector<double> norm(basisset.size(), 0);
-
-    for (int i = 0; i < basisset.size(); ++i) {
-        STO_6G bi = basisset[i];
-        Vector pi = m_molecule.Atom(bi.index).second;
-        STO_6G bj = basisset[i];
-        Vector pj = m_molecule.Atom(bi.index).second;
-        double xx = 0;
-        if (bi.sym.compare("s") == 0 && bj.sym.compare("s") == 0) {
-            for (int c1 = 0; c1 < 6; ++c1)
-                for (int c2 = 0; c2 < 6; ++c2)
-                    xx += ss(pi(0), pj(0), pi(1), pj(1), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-        } else if ((bi.sym.compare("px") == 0 && bj.sym.compare("px") == 0)) {
-            for (int c1 = 0; c1 < 6; ++c1)
-                for (int c2 = 0; c2 < 6; ++c2)
-                    xx += p2(pi(0), pj(0), pi(1), pj(1), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-        } else if ((bi.sym.compare("py") == 0 && bj.sym.compare("py") == 0)) {
-            for (int c1 = 0; c1 < 6; ++c1)
-                for (int c2 = 0; c2 < 6; ++c2)
-                    xx += p2(pi(1), pj(1), pi(0), pj(0), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-        } else if ((bi.sym.compare("pz") == 0 && bj.sym.compare("pz") == 0)) {
-            for (int c1 = 0; c1 < 6; ++c1)
-                for (int c2 = 0; c2 < 6; ++c2)
-                    xx += p2(pi(2), pj(2), pi(1), pj(1), pi(0), pj(0), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
+    std::array<Matrix, 3> block;
+    for (int index : m_indices) {
+        const EHTShellPair& pair = m_pairs->at(index);
+        const EHTShell& a = m_shells->at(pair.a);
+        const EHTShell& b = m_shells->at(pair.b);
+        /* one-centre overlaps do not depend on the geometry */
+        if (a.atom == b.atom)
+            continue;
+        const Position R = (m_geometry->row(a.atom) - m_geometry->row(b.atom)).transpose();
+        EHTOverlapDerivativeBlock(m_sets->at(pair.set), a, b, R, m_threshold, block);
+        const auto X = m_X->block(a.offset, b.offset, a.Functions(), b.Functions());
+        for (int m = 0; m < 3; ++m) {
+            /* factor 2 for the upper triangle block */
+            const double g = 2 * X.cwiseProduct(block[m]).sum();
+            m_gradient(a.atom, m) += g;
+            m_gradient(b.atom, m) -= g;
         }
-        norm[i] = 1 / sqrt(xx);
     }
+}
 
-    for (int i = 0; i < basisset.size(); ++i) {
-        STO_6G bi = basisset[i];
-        Vector pi = m_molecule.Atom(bi.index).second;
-        for (int j = i; j < basisset.size(); ++j) {
-            STO_6G bj = basisset[j];
-            Vector pj = m_molecule.Atom(bj.index).second;
-
-            double xx = 0;
-
-            if (bi.sym.compare("s") == 0 && bj.sym.compare("s") == 0) { /* s-s orbitals */
-                for (int c1 = 0; c1 < 6; ++c1)
-                    for (int c2 = 0; c2 < 6; ++c2)
-                        xx += ss(pi(0), pj(0), pi(1), pj(1), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-            } else if ((bi.sym.compare("s") == 0 && bj.sym.compare("px") == 0) || (bi.sym.compare("px") == 0 && bj.sym.compare("s") == 0)) { /* s-px orbitals */
-                if (bj.sym.compare("px") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += sp(pi(0), pj(0), pi(1), pj(1), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-                } else if (bi.sym.compare("px") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += sp(pj(0), pi(0), pj(1), pi(1), pj(2), pi(2), bj.alpha[c2], bi.alpha[c2], bj.coeff[c1], bi.coeff[c1]);
-                }
-            } else if ((bi.sym.compare("s") == 0 && bj.sym.compare("py") == 0) || (bi.sym.compare("py") == 0 && bj.sym.compare("s") == 0)) { /* s-py orbitals */
-                if (bj.sym.compare("py") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += sp(pi(0), pj(1), pi(1), pj(0), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-                } else if (bi.sym.compare("py") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += sp(pj(1), pi(0), pj(0), pi(1), pj(2), pi(2), bj.alpha[c2], bi.alpha[c2], bj.coeff[c1], bi.coeff[c1]);
-                }
-            } else if ((bi.sym.compare("s") == 0 && bj.sym.compare("pz") == 0) || (bi.sym.compare("pz") == 0 && bj.sym.compare("s") == 0)) { /* s-pz orbitals */
-                if (bj.sym.compare("pz") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += sp(pi(0), pj(2), pi(1), pj(1), pi(2), pj(0), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-                } else if (bi.sym.compare("pz") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += sp(pj(2), pi(0), pj(1), pi(1), pj(0), pi(2), bj.alpha[c2], bi.alpha[c2], bj.coeff[c1], bi.coeff[c1]);
-                }
-            } else if ((bi.sym.compare("px") == 0 && bj.sym.compare("px") == 0)) { /* px-px orbitals */
-                for (int c1 = 0; c1 < 6; ++c1)
-                    for (int c2 = 0; c2 < 6; ++c2)
-                        xx += p2(pi(0), pj(0), pi(1), pj(1), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-            } else if ((bi.sym.compare("py") == 0 && bj.sym.compare("py") == 0)) { /* py-py orbitals */
-                for (int c1 = 0; c1 < 6; ++c1)
-                    for (int c2 = 0; c2 < 6; ++c2)
-                        xx += p2(pi(1), pj(1), pi(0), pj(0), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-            } else if ((bi.sym.compare("pz") == 0 && bj.sym.compare("pz") == 0)) { /* pz-pz orbitals */
-                for (int c1 = 0; c1 < 6; ++c1)
-                    for (int c2 = 0; c2 < 6; ++c2)
-                        xx += p2(pi(2), pj(2), pi(1), pj(1), pi(0), pj(0), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-            } else if ((bi.sym.compare("px") == 0 && bj.sym.compare("py") == 0) || (bi.sym.compare("py") == 0 && bj.sym.compare("px") == 0)) { /* px-py orbitals */
-                if (bj.sym.compare("py") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += pp(pi(0), pj(1), pi(1), pj(0), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-                } else if (bi.sym.compare("py") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += pp(pi(1), pj(0), pi(0), pj(1), pi(2), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-                }
-            } else if ((bi.sym.compare("px") == 0 && bj.sym.compare("pz") == 0) || (bi.sym.compare("pz") == 0 && bj.sym.compare("px") == 0)) { /* px-pz-orbitals */
-                if (bj.sym.compare("pz") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += pp(pi(0), pj(2), pi(1), pj(1), pi(2), pj(0), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-                } else if (bi.sym.compare("pz") == 0) {
-                    for (int c1 = 0; c1 < 6; ++c1)
-                        for (int c2 = 0; c2 < 6; ++c2)
-                            xx += pp(pi(2), pj(0), pi(1), pj(1), pi(0), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-                }
-            } else if ((bi.sym.compare("py") == 0 && bj.sym.compare("pz") == 0)) { /* py-pz-orbitals */
+int EHTIntegralThread::execute()
+{
+    if (m_X) {
+        OverlapGradient();
+        return 0;
+    }
+    Matrix block;
+    for (int index : m_indices) {
+        const EHTShellPair& pair = m_pairs->at(index);
+        const EHTShell& a = m_shells->at(pair.a);
+        const EHTShell& b = m_shells->at(pair.b);
+        const Position R = (m_geometry->row(a.atom) - m_geometry->row(b.atom)).transpose();
+        EHTOverlapBlock(m_sets->at(pair.set), a, b, R, m_threshold, block);
+        m_S->block(a.offset, b.offset, a.Functions(), b.Functions()) = block;
+    }
+    return 0;
+}
 
-                for (int c1 = 0; c1 < 6; ++c1)
-                    for (int c2 = 0; c2 < 6; ++c2)
-                        xx += pp(pi(1), pj(2), pi(0), pj(1), pi(2), pj(0), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
+void EHT::AddShell(int atom, int l, const std::vector<double>& alpha, const std::vector<double>& coeff, double e)
+{
+    EHTShell shell;
+    shell.atom = atom;
+    shell.l = l;
+    shell.e = e;
+    shell.alpha = alpha;
+    shell.offset = m_basis;
+    const std::pair<int, int> kind(m_molecule.Atom(atom).first, l);
+    shell.kind = std::find(m_kinds.begin(), m_kinds.end(), kind) - m_kinds.begin();
+    if (shell.kind == m_kinds.size())
+        m_kinds.push_back(kind);
+    /* primitive normalisation of cartesian s and p gaussians */
+    for (std::size_t i = 0; i < alpha.size(); ++i)
+        shell.coeff.push_back(coeff[i] * pow(2 * alpha[i] / pi, 0.75) * (l == 0 ? 1.0 : 2 * sqrt(alpha[i])));
+
+    /* contraction normalisation from the self overlap */
+    double self = 0;
+    for (std::size_t i = 0; i < alpha.size(); ++i)
+        for (std::size_t j = 0; j < alpha.size(); ++j) {
+            const double p = alpha[i] + alpha[j];
+            self += shell.coeff[i] * shell.coeff[j] * pow(pi / p, 1.5) * (l == 0 ? 1.0 : 0.5 / p);
+        }
+    for (auto& c : shell.coeff)
+        c /= sqrt(self);
 
-            } else if (bi.sym.compare("pz") == 0 && bj.sym.compare("py") == 0) { /* pz-py-orbitals */
-                for (int c1 = 0; c1 < 6; ++c1)
-                    for (int c2 = 0; c2 < 6; ++c2)
-                        xx += pp(pi(2), pj(1), pi(1), pj(0), pi(0), pj(2), bi.alpha[c1], bj.alpha[c1], bi.coeff[c2], bj.coeff[c2]);
-            } else
-                std::cout << "something is missing " << bi.sym << " " << bj.sym << std::endl;
-            S(i, j) = xx * norm[i] * norm[j];
-            S(j, i) = xx * norm[j] * norm[i];
+    m_basis += shell.Functions();
+    m_shells.push_back(shell);
+}
 
-            // S(j,i) += xx*norm[j]*norm[i]*0.5;
+void EHT::MakePrimitiveSets()
+{
+    /* one representative shell per kind, the sets are indexed by kind(a) * kinds + kind(b) */
+    std::vector<int> representative(m_kinds.size());
+    for (int i = m_shells.size() - 1; i >= 0; --i)
+        representative[m_shells[i].kind] = i;
+
+    m_sets.clear();
+    for (int ka = 0; ka < m_kinds.size(); ++ka) {
+        for (int kb = 0; kb < m_kinds.size(); ++kb) {
+            const EHTShell& a = m_shells[representative[ka]];
+            const EHTShell& b = m_shells[representative[kb]];
+            EHTPrimitiveSet set;
+            set.min_mu = std::numeric_limits<double>::max();
+            set.max_prefactor = 0;
+            for (std::size_t i = 0; i < a.alpha.size(); ++i) {
+                for (std::size_t j = 0; j < b.alpha.size(); ++j) {
+                    const double alpha = a.alpha[i], beta = b.alpha[j];
+                    const double p = alpha + beta;
+                    EHTPrimitivePair prim;
+                    prim.mu = alpha * beta / p;
+                    prim.alpha_p = alpha / p;
+                    prim.beta_p = beta / p;
+                    prim.half_p = 0.5 / p;
+                    prim.prefactor = a.coeff[i] * b.coeff[j] * pow(pi / p, 1.5);
+                    set.min_mu = std::min(set.min_mu, prim.mu);
+                    set.max_prefactor += std::abs(prim.prefactor);
+                    set.primitives.push_back(prim);
+                }
+            }
+            /* the bound decays beyond r2 = 1 / min_mu - 1, bracket and bisect the threshold crossing */
+            auto bound = [&set](double r2) { return set.max_prefactor * exp(-set.min_mu * r2) * (1 + r2); };
+            set.cutoff2 = std::numeric_limits<double>::infinity();
+            if (m_threshold > 0) {
+                double lower = std::max(0.0, 1 / set.min_mu - 1), upper = lower + 1;
+                while (bound(upper) >= m_threshold)
+                    upper = 2 * upper;
+                for (int k = 0; k < 60; ++k) {
+                    const double middle = (lower + upper) / 2;
+                    (bound(middle) >= m_threshold ? lower : upper) = middle;
+                }
+                set.cutoff2 = upper;
+            }
+            m_sets.push_back(set);
+        }
+    }
+}
 
-            // std::cout << i << " " << j << " "  << bi.sym << " " << bj.sym << " " << " "<< xx << " " <<xx*norm[i]*norm[j] <<std::endl;
+void EHT::MakePairs(const Matrix& geometry)
+{
+    m_pairs.clear();
+    for (int a = 0; a < m_shells.size(); ++a) {
+        for (int b = 0; b <= a; ++b) {
+            const int set = m_shells[a].kind * m_kinds.size() + m_shells[b].kind;
+            const double r2 = (geometry.row(m_shells[a].atom) - geometry.row(m_shells[b].atom)).squaredNorm();
+            if (r2 <= m_sets[set].cutoff2)
+                m_pairs.push_back({ a, b, set });
         }
     }
-    return S;
 }
 
-Matrix EHT::MakeH(const Matrix& S, const std::vector<STO_6G>& basisset)
+bool EHT::Initialise()
 {
-    double K = 1.75;
-    Matrix H = Eigen::MatrixXd::Zero(basisset.size(), basisset.size());
-    for (int i = 0; i < basisset.size(); ++i) {
-        STO_6G bi = basisset[i];
-        Vector pi = m_molecule.Atom(bi.index).second;
-        for (int j = 0; j < basisset.size(); ++j) {
-            STO_6G bj = basisset[j];
-            Vector pj = m_molecule.Atom(bj.index).second;
-            if (i == j)
-                H(i, j) = bi.e;
-            else {
-                H(i, j) = K * S(i, j) * (bi.e + bj.e) / 2.0;
-                H(j, i) = K * S(j, i) * (bi.e + bj.e) / 2.0;
-            }
+    m_shells.clear();
+    m_kinds.clear();
+    m_valence.clear();
+    m_basis = 0;
+    m_num_electrons = 0;
+    for (int i = 0; i < m_molecule.AtomCount(); ++i) {
+        const int element = m_molecule.Atom(i).first;
+        if (element == 1) {
+            ehtSTO_6GHs s;
+            AddShell(i, 0, s.alpha, s.coeff, -0.5);
+            m_num_electrons += 1;
+            m_valence.push_back(1);
+        } else if (element == 6) {
+            ehtSTO_6GCs s;
+            ehtSTO_6GCp p;
+            AddShell(i, 0, s.alpha, s.coeff, -0.7144);
+            AddShell(i, 1, p.alpha, p.coeff, -0.3921);
+            m_num_electrons += 4;
+            m_valence.push_back(4);
+        } else if (element == 7) {
+            ehtSTO_6GNs s;
+            ehtSTO_6GNp p;
+            AddShell(i, 0, s.alpha, s.coeff, -0.9404);
+            AddShell(i, 1, p.alpha, p.coeff, -0.5110);
+            m_num_electrons += 5;
+            m_valence.push_back(5);
+        } else if (element == 8) {
+            ehtSTO_6GOs s;
+            ehtSTO_6GOp p;
+            AddShell(i, 0, s.alpha, s.coeff, -1.1904);
+            AddShell(i, 1, p.alpha, p.coeff, -0.5827);
+            m_num_electrons += 6;
+            m_valence.push_back(6);
+        } else {
+            std::cout << "No EHT parameters for element " << element << " (atom " << i + 1 << ")." << std::endl;
+            return false;
         }
     }
-    return H;
+    m_num_electrons -= m_molecule.Charge();
+    MakePrimitiveSets();
+    m_initialised = true;
+    return true;
 }
 
-double EHT::ss(double x1, double x2, double y1, double y2, double z1, double z2, double alpha1, double alpha2, double c1, double c2)
+double EHT::Calculate(bool gradient, bool verbose)
 {
-    double ex = exp(-((alpha1 * alpha2) / (alpha1 + alpha2)) * ((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) + (z1 - z2) * (z1 - z2)));
-    return (c1 * c2 * (pow(2, 1.5) * pow(alpha1 * alpha2, 0.75) * pow(alpha1 + alpha2, -1.5) * ex));
+    if (!m_initialised && !Initialise())
+        return 0;
+
+    /* pairs beyond the screening distance are not stored at all */
+    MakePairs(m_geometry / au);
+    if (verbose)
+        std::cout << m_basis << " basis functions in " << m_shells.size() << " shells, " << m_pairs.size() << " shell pairs" << std::endl;
+
+    m_overlap = MakeOverlap();
+    Matrix H = MakeH(m_overlap);
+
+    /* H C = S C e, Cholesky based reduction instead of explicit S^-1/2 */
+    Eigen::GeneralizedSelfAdjointEigenSolver<Matrix> solver(H, m_overlap, Eigen::ComputeEigenvectors | Eigen::Ax_lBx);
+    m_eigenvalues = solver.eigenvalues();
+    m_coefficients = solver.eigenvectors();
+
+    m_occupation = Vector::Zero(m_basis);
+    for (int i = 0; i < m_num_electrons / 2 && i < m_basis; ++i)
+        m_occupation(i) = 2;
+    if (m_num_electrons % 2 && m_num_electrons / 2 < m_basis)
+        m_occupation(m_num_electrons / 2) = 1;
+
+    m_energy = m_occupation.dot(m_eigenvalues);
+    if (verbose) {
+        for (int i = 0; i < m_basis && m_occupation(i) > 0; ++i)
+            std::cout << m_eigenvalues(i) << " " << m_occupation(i) << std::endl;
+        std::cout << "Total electronic energy = " << m_energy << " Eh." << std::endl;
+    }
+    if (gradient)
+        MakeGradient();
+    return m_energy;
 }
 
-double EHT::sp(double x1, double x2, double y1, double y2, double z1, double z2, double alpha1, double alpha2, double c1, double c2)
+void EHT::start()
 {
-    double ex = exp(-((alpha1 * alpha2) / (alpha1 + alpha2)) * ((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) + (z1 - z2) * (z1 - z2)));
-    return ((c1 * c2 * (4 * pow(2, 0.5) * pow(alpha1, 1.75) * pow(alpha2, 1.25) * ex * (x1 - x2))) * (pow(alpha1 + alpha2, -2.5)));
+    Calculate(false, true);
 }
 
-double EHT::pp(double x1, double x2, double y1, double y2, double z1, double z2, double alpha1, double alpha2, double c1, double c2)
+std::vector<double> EHT::Charges() const
 {
-    double ex = exp(-((alpha1 * alpha2) / (alpha1 + alpha2)) * ((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) + (z1 - z2) * (z1 - z2)));
-    return (c1 * c2 * ((-8 * (pow(2, 0.5) * (pow(alpha1 * alpha2, 2.25)) * ex * (x1 - x2) * (y1 - y2))) * (pow(alpha1 + alpha2, -3.5))));
+    std::vector<double> charges(m_valence.begin(), m_valence.end());
+    if (m_coefficients.size() == 0)
+        return charges;
+    const Matrix P = m_coefficients * m_occupation.asDiagonal() * m_coefficients.transpose();
+    const Vector population = (P.cwiseProduct(m_overlap)).rowwise().sum();
+    for (const auto& shell : m_shells)
+        for (int k = 0; k < shell.Functions(); ++k)
+            charges[shell.atom] -= population(shell.offset + k);
+    return charges;
 }
 
-double EHT::p2(double x1, double x2, double y1, double y2, double z1, double z2, double alpha1, double alpha2, double c1, double c2)
+void EHT::RunWorkers(Matrix* S, const Matrix* X)
 {
-    double ex = exp(-((alpha1 * alpha2) / (alpha1 + alpha2)) * ((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) + (z1 - z2) * (z1 - z2)));
-    return (c1 * c2 * ((4 * pow(2, 0.5) * pow(alpha1 * alpha2, 1.25) * ex * (alpha2 + alpha1 * (1 - 2 * alpha2 * (x1 - x2) * (x1 - x2))) * (pow(alpha1 + alpha2, -3.5)))));
+    /* geometry in bohr, the integrals are evaluated in atomic units */
+    const Matrix geometry = m_geometry / au;
+
+    const int threads = std::max(1, m_threads);
+    std::vector<EHTIntegralThread*> workers;
+    CxxThreadPool* pool = new CxxThreadPool;
+    pool->setProgressBar(CxxThreadPool::ProgressBarType::None);
+    pool->setActiveThreadCount(threads);
+    for (int i = 0; i < threads; ++i) {
+        EHTIntegralThread* thread = new EHTIntegralThread(&m_shells, &m_pairs, &m_sets, &geometry, S, m_threshold);
+        if (X)
+            thread->setGradient(X, geometry.rows());
+        workers.push_back(thread);
+        pool->addThread(thread);
+    }
+    for (int i = 0; i < m_pairs.size(); ++i)
+        workers[i % threads]->addPair(i);
+
+    pool->StaticPool();
+    pool->StartAndWait();
+    pool->clear();
+    delete pool;
+
+    if (X)
+        m_gradient = Matrix::Zero(geometry.rows(), 3);
+    for (auto* thread : workers) {
+        if (X)
+            m_gradient += thread->Gradient();
+        delete thread;
+    }
+}
+
+void EHT::MakeGradient()
+{
+    /* E = sum_i n_i e_i, with H C = S C e:
+     * dE = sum_ij P_ij dH_ij - W_ij dS_ij, and dH_ij = K (e_i + e_j) / 2 dS_ij off the diagonal */
+    const Matrix P = m_coefficients * m_occupation.asDiagonal() * m_coefficients.transpose();
+    const Matrix W = m_coefficients * (m_occupation.cwiseProduct(m_eigenvalues)).asDiagonal() * m_coefficients.transpose();
+    Matrix X(m_basis, m_basis);
+    for (int i = 0; i < m_basis; ++i)
+        for (int j = 0; j < m_basis; ++j)
+            X(i, j) = m_K * (m_energies(i) + m_energies(j)) / 2.0 * P(i, j) - W(i, j);
+    RunWorkers(nullptr, &X);
+}
+
+Matrix EHT::MakeOverlap()
+{
+    Matrix S = Matrix::Zero(m_basis, m_basis);
+    RunWorkers(&S, nullptr);
+    /* only the lower triangle was evaluated */
+    return S.selfadjointView<Eigen::Lower>();
+}
+
+Matrix EHT::MakeH(const Matrix& S)
+{
+    m_energies = Vector(m_basis);
+    for (const auto& shell : m_shells)
+        for (int k = 0; k < shell.Functions(); ++k)
+            m_energies(shell.offset + k) = shell.e;
+    const Vector& e = m_energies;
+
+    Matrix H = Matrix::Zero(m_basis, m_basis);
+    for (int i = 0; i < m_basis; ++i) {
+        H(i, i) = e(i);
+        for (int j = 0; j < i; ++j) {
+            H(i, j) = m_K * S(i, j) * (e(i) + e(j)) / 2.0;
+            H(j, i) = H(i, j);
+        }
+    }
+    return H;
 }
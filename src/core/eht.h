@@ -23,12 +23,20 @@
 
 #include "external/CxxThreadPool/include/CxxThreadPool.h"
 
+#include <array>
 #include <set>
 #include <vector>
 
 #include <Eigen/Dense>
 
 #include "json.hpp"
+using json = nlohmann::json;
+
+static json EHTSettings{
+    { "eht_threads", 1 },
+    { "eht_screening", 1e-12 },
+    { "eht_K", 1.75 }
+};
 
 struct ehtSTO_6GHs {
     std::vector<double> alpha = { 0.3552322122E+02, 0.6513143725E+01, 0.1822142904E+01, 0.6259552659E+00, 0.2430767471E+00, 0.1001124280E+00 };
@@ -65,37 +73,144 @@ struct ehtSTO_6GOp {
     std::vector<double> coeff = { 0.3759696623E-02, 0.3767936984E-01, 0.1738967435E+00, 0.4180364347E+00, 0.4258595477E+00, 0.1017082955E+00 };
 };
 
-struct STO_6G {
+/*! \brief Contracted shell, coefficients include the primitive and contraction normalisation */
+struct EHTShell {
     std::vector<double> alpha, coeff;
-    int x = 0, y = 0, z = 0;
-    int index = 0;
-    std::string sym = "";
+    int atom = 0;
+    int l = 0;
+    int offset = 0;
+    int kind = 0; // index of the element/l combination, shells of one kind share their primitive products
     double e = 0;
+    inline int Functions() const { return l == 0 ? 1 : 3; }
+};
+
+/*! \brief Geometry independent data of a primitive product */
+struct EHTPrimitivePair {
+    double mu, alpha_p, beta_p, half_p, prefactor;
+};
+
+/*! \brief Primitive products of two shell kinds with their screening bounds, cutoff2 is the squared
+ * distance (bohr) beyond which the overlap block is below the threshold */
+struct EHTPrimitiveSet {
+    double min_mu, max_prefactor, cutoff2;
+    std::vector<EHTPrimitivePair> primitives;
+};
+
+/*! \brief Shell pair (a >= b) that survived the distance screening, only indices are stored */
+struct EHTShellPair {
+    int a, b, set;
+};
+
+/*! \brief Overlap block of a shell pair, R = A - B in bohr */
+void EHTOverlapBlock(const EHTPrimitiveSet& set, const EHTShell& a, const EHTShell& b, const Position& R, double threshold, Matrix& block);
+
+/*! \brief Derivatives of the overlap block of a shell pair with respect to R = A - B */
+void EHTOverlapDerivativeBlock(const EHTPrimitiveSet& set, const EHTShell& a, const EHTShell& b, const Position& R, double threshold, std::array<Matrix, 3>& block);
+
+class EHTIntegralThread : public CxxThread {
+public:
+    EHTIntegralThread(const std::vector<EHTShell>* shells, const std::vector<EHTShellPair>* pairs, const std::vector<EHTPrimitiveSet>* sets, const Matrix* geometry, Matrix* S, double threshold)
+        : m_shells(shells)
+        , m_pairs(pairs)
+        , m_sets(sets)
+        , m_geometry(geometry)
+        , m_S(S)
+        , m_threshold(threshold)
+    {
+        setAutoDelete(false);
+    }
+
+    int execute() override;
+
+    void addPair(int pair) { m_indices.push_back(pair); }
+
+    /*! \brief Switch to gradient mode, X = dE/dS_ij is contracted with the overlap derivatives */
+    void setGradient(const Matrix* X, int atoms)
+    {
+        m_X = X;
+        m_gradient = Matrix::Zero(atoms, 3);
+    }
+
+    inline const Matrix& Gradient() const { return m_gradient; }
+
+private:
+    void OverlapGradient();
+
+    const std::vector<EHTShell>* m_shells;
+    const std::vector<EHTShellPair>* m_pairs;
+    const std::vector<EHTPrimitiveSet>* m_sets;
+    const Matrix* m_geometry;
+    Matrix* m_S;
+    const Matrix* m_X = nullptr;
+    Matrix m_gradient;
+    std::vector<int> m_indices;
+    double m_threshold;
 };
 
 class EHT {
 public:
-    EHT();
+    EHT(const json& controller = EHTSettings);
+
+    void setMolecule(const Molecule& molecule)
+    {
+        m_molecule = molecule;
+        m_geometry = molecule.getGeometry();
+        m_initialised = false;
+    }
+
+    /*! \brief New coordinates in Angstrom, shells and shell pairs are kept */
+    inline void UpdateGeometry(const Matrix& geometry) { m_geometry = geometry; }
+
+    inline void setThreads(int threads) { m_threads = threads; }
+    inline void setScreening(double threshold)
+    {
+        m_threshold = threshold;
+        m_initialised = false;
+    }
+
+    /*! \brief Build shells and the primitive products of all shell kinds, geometry independent */
+    bool Initialise();
+
+    /*! \brief Solve for the current geometry, returns the electronic energy in Eh */
+    double Calculate(bool gradient = false, bool verbose = false);
 
-    void setMolecule(const Molecule& molecule) { m_molecule = molecule; }
     void start();
 
+    inline double Energy() const { return m_energy; }
+    inline const Vector& Eigenvalues() const { return m_eigenvalues; }
+    inline const Matrix& Coefficients() const { return m_coefficients; }
+    inline int BasisFunctions() const { return m_basis; }
+
+    /*! \brief Analytic gradient in Eh/bohr */
+    inline const Matrix& Gradient() const { return m_gradient; }
+
+    /*! \brief Mulliken charges from the last calculation */
+    std::vector<double> Charges() const;
+
 private:
-    Molecule m_molecule;
-    /* Some integrals */
-    /* s - s - sigma bond */
-    double ss(double x1, double x2, double y1, double y2, double z1, double z2, double alpha1, double alpha2, double c1, double c2);
+    void AddShell(int atom, int l, const std::vector<double>& alpha, const std::vector<double>& coeff, double e);
+    void MakePrimitiveSets();
 
-    /* s - p - sigma bond */
-    double sp(double x1, double x2, double y1, double y2, double z1, double z2, double alpha1, double alpha2, double c1, double c2);
+    /* Shell pairs within the cutoff of their primitive set for the geometry in bohr */
+    void MakePairs(const Matrix& geometry);
 
-    /* p - p - pi bond */
-    double pp(double x1, double x2, double y1, double y2, double z1, double z2, double alpha1, double alpha2, double c1, double c2);
+    /* Run the integral workers, either for S or for the gradient contracted with X */
+    void RunWorkers(Matrix* S, const Matrix* X);
 
-    /* p - p - sigma bond */
-    double p2(double x1, double x2, double y1, double y2, double z1, double z2, double alpha1, double alpha2, double c1, double c2);
+    Matrix MakeOverlap();
+    Matrix MakeH(const Matrix& S);
+    void MakeGradient();
 
-    Matrix MakeOverlap(const std::vector<STO_6G>& basisset);
-    Matrix MakeH(const Matrix& S, const std::vector<STO_6G>& basisset);
-    int m_num_electrons = 0;
+    Molecule m_molecule;
+    Matrix m_geometry;
+    std::vector<EHTShell> m_shells;
+    std::vector<EHTShellPair> m_pairs;
+    std::vector<EHTPrimitiveSet> m_sets;
+    std::vector<std::pair<int, int>> m_kinds;
+    std::vector<double> m_valence;
+    Vector m_eigenvalues, m_occupation, m_energies;
+    Matrix m_coefficients, m_overlap, m_gradient;
+    double m_energy = 0, m_threshold = 1e-12, m_K = 1.75;
+    int m_num_electrons = 0, m_basis = 0, m_threads = 1;
+    bool m_initialised = false;
 };
@@ -142,6 +142,14 @@ EnergyCalculator::EnergyCalculator(const std::string& method, const json& contro
             this->CalculateQMDFF(gradient, verbose);
         };
 
+    } else if (std::find(m_eht_methods.begin(), m_eht_methods.end(), m_method) != m_eht_methods.end()) { // Extended Hueckel energy calculator requested
+        m_eht = new EHT(controller);
+        m_ecengine = [this](bool gradient, bool verbose) {
+            this->CalculateEHT(gradient, verbose);
+        };
+        m_charges = [this]() {
+            return this->m_eht->Charges();
+        };
     } else if (std::find(m_ff_methods.begin(), m_ff_methods.end(), m_method) != m_ff_methods.end()) { // Just D4 energy calculator requested
         m_forcefield = new ForceField(controller);
         m_ecengine = [this](bool gradient, bool verbose) {
@@ -176,6 +184,8 @@ EnergyCalculator::~EnergyCalculator()
 #endif
     } else if (std::find(m_qmdff_method.begin(), m_qmdff_method.end(), m_method) != m_qmdff_method.end()) { // Just D4 energy calculator requested
         delete m_qmdff;
+    } else if (std::find(m_eht_methods.begin(), m_eht_methods.end(), m_method) != m_eht_methods.end()) {
+        delete m_eht;
     } else { // Fall back to UFF?
         delete m_uff;
     }
@@ -226,6 +236,9 @@ void EnergyCalculator::setMolecule(const Molecule& molecule)
         m_qmdff->setMolecule(atoms, m_geometry);
         m_qmdff->Initialise();
 
+    } else if (std::find(m_eht_methods.begin(), m_eht_methods.end(), m_method) != m_eht_methods.end()) { // shells and shell pairs are set up once
+        m_eht->setMolecule(molecule);
+        m_error = !m_eht->Initialise();
     } else if (std::find(m_ff_methods.begin(), m_ff_methods.end(), m_method) != m_ff_methods.end()) { //
         if (m_parameter.size() == 0) {
             if (!std::filesystem::exists(m_param_file)) {
@@ -421,6 +434,15 @@ void EnergyCalculator::CalculateQMDFF(bool gradient, bool verbose)
     }
 }
 
+void EnergyCalculator::CalculateEHT(bool gradient, bool verbose)
+{
+    m_eht->UpdateGeometry(m_geometry);
+    m_energy = m_eht->Calculate(gradient, verbose);
+    if (gradient) {
+        m_gradient = m_eht->Gradient() * au;
+    }
+}
+
 void EnergyCalculator::CalculateFF(bool gradient, bool verbose)
 {
     m_forcefield->UpdateGeometry(m_geometry);
@@ -445,6 +467,15 @@ Matrix EnergyCalculator::Gradient() const
     return m_gradient;
 }
 
+double EnergyCalculator::GradientUnit() const
+{
+    if (std::find(m_uff_methods.begin(), m_uff_methods.end(), m_method) != m_uff_methods.end()
+        || std::find(m_ff_methods.begin(), m_ff_methods.end(), m_method) != m_ff_methods.end()
+        || std::find(m_qmdff_method.begin(), m_qmdff_method.end(), m_method) != m_qmdff_method.end())
+        return 1;
+    return 1 / (au * au);
+}
+
 std::vector<double> EnergyCalculator::Charges() const
 {
     return m_charges();
@@ -37,6 +37,7 @@
 #include "src/core/dftd4interface.h"
 #endif
 
+#include "src/core/eht.h"
 #include "src/core/eigen_uff.h"
 #include "src/core/forcefield.h"
 #include "src/core/qmdff.h"
@@ -69,6 +70,10 @@ public:
 
     Matrix Gradient() const;
 
+    /*! \brief Factor converting Gradient() to Eh/Angstrom, the force fields work in Angstrom,
+     * the electronic structure backends return Eh/Bohr multiplied by au */
+    double GradientUnit() const;
+
     double CalculateEnergy(bool gradient = false, bool verbose = false);
 
     bool HasNan() const { return m_containsNaN; }
@@ -102,6 +107,11 @@ public:
     }
 #endif
 
+    EHT* getEHTInterface() const
+    {
+        return m_eht;
+    }
+
     QMDFF* getQMDFFInterface() const
     {
         return m_qmdff;
@@ -138,6 +148,8 @@ private:
     void InitialiseQMDFF();
     void CalculateQMDFF(bool gradient, bool verbose = false);
 
+    void CalculateEHT(bool gradient, bool verbose = false);
+
     void InitialiseFF();
     void CalculateFF(bool gradient, bool verbose = false);
 
@@ -159,6 +171,7 @@ private:
 
     eigenUFF* m_uff = NULL;
     QMDFF* m_qmdff = NULL;
+    EHT* m_eht = NULL;
     ForceField* m_forcefield = NULL;
     StringList m_uff_methods = { "fuff" };
     StringList m_ff_methods = { "uff", "uff-d3" };
@@ -167,6 +180,7 @@ private:
     StringList m_xtb_methods = { "gfnff", "xtb-gfn1", "xtb-gfn2" };
     StringList m_d3_methods = { "d3" };
     StringList m_d4_methods = { "d4" };
+    StringList m_eht_methods = { "eht" };
     std::function<void(bool, bool)> m_ecengine;
     std::function<std::vector<double>()> m_charges;
     std::function<Position()> m_dipole;
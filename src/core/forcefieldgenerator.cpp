@@ -101,11 +101,9 @@ void ForceFieldGenerator::Generate(const std::vector<std::pair<int, int>>& forme
     AssignUffAtomTypes();
     // if (m_rings)
     // std::cout << "Crude ring finding method ... " << std::endl;
-    int maxsize = m_atom_types.size();
-    int maxcache = m_atom_types.size();
-    if (m_atom_types.size() > 1000)
-        maxcache = 5;
-    m_identified_rings = Topology::FindRings(m_stored_bonds, m_atom_types.size(), maxsize, maxcache);
+    /* rings up to eight members, larger cycles would make the perception grow with the system size */
+    const int maxsize = 8;
+    m_identified_rings = Topology::FindRings(m_stored_bonds, m_atom_types.size(), maxsize);
     // std::cout << "... done!" << std::endl;
 
     if (m_method.compare("uff-d3") == 0) {
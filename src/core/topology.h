@@ -20,6 +20,12 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <set>
 #include <vector>
 
 namespace Topology {
@@ -29,142 +35,232 @@ inline double Distance(double x1, double x2, double y1, double y2, double z1, do
     return sqrt((((x1 - x2) * (x1 - x2)) + ((y1 - y2) * (y1 - y2)) + ((z1 - z2) * (z1 - z2))));
 }
 
-inline std::vector<std::vector<int>> FindRings(const std::vector<std::vector<int>>& stored_bonds, int atoms, int maxsize = 30, int storage = 10)
+/*! \brief Smallest set of smallest rings and the relevant cycle prototypes, rings as sorted atom lists */
+struct RingSet {
+    std::vector<std::vector<int>> sssr, relevant;
+};
+
+/*! \brief Ring perception on the bond graph (Vismara's odd and even cycle prototypes from BFS trees,
+ * reduced by Gaussian elimination over GF(2) on the edge incidence vectors)
+ *
+ * Trees are pruned first, the number of rings per component is E - V + C. Every vertex r only searches
+ * the subgraph of vertices >= r, so each cycle is generated from its smallest atom. Rings larger than
+ * maxsize are not considered.
+ */
+inline RingSet PerceiveRings(const std::vector<std::vector<int>>& stored_bonds, int atoms, int maxsize = 30)
 {
-    std::vector<std::vector<int>> identified_rings;
-    std::vector<int> done;
+    RingSet result;
+    atoms = std::min<int>(atoms, stored_bonds.size());
 
+    /* remove all atoms that can not be part of a ring */
+    std::vector<int> degree(atoms, 0);
+    std::vector<char> core(atoms, 1);
+    for (int i = 0; i < atoms; ++i)
+        for (int j : stored_bonds[i])
+            degree[i] += (j >= 0 && j < atoms && j != i);
+    std::vector<int> queue;
+    for (int i = 0; i < atoms; ++i)
+        if (degree[i] < 2)
+            queue.push_back(i);
+    while (queue.size()) {
+        const int i = queue.back();
+        queue.pop_back();
+        if (!core[i])
+            continue;
+        core[i] = 0;
+        for (int j : stored_bonds[i])
+            if (j >= 0 && j < atoms && j != i && core[j] && --degree[j] < 2)
+                queue.push_back(j);
+    }
+
+    /* adjacency with edge indices, every bond once */
+    std::vector<std::vector<std::pair<int, int>>> adjacency(atoms);
+    std::vector<int> parent(atoms);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto root = [&parent](int i) {
+        while (parent[i] != i)
+            i = parent[i] = parent[parent[i]];
+        return i;
+    };
+    int edges = 0, vertices = 0, components = 0;
     for (int i = 0; i < atoms; ++i) {
-        //  if (std::find(done.begin(), done.end(), i) != done.end())
-        //      continue;
-        if (stored_bonds[i].size() == 1) {
-            done.push_back(i);
+        if (!core[i])
+            continue;
+        vertices++;
+        for (int j : stored_bonds[i]) {
+            if (j <= i || j >= atoms || !core[j])
+                continue;
+            adjacency[i].emplace_back(j, edges);
+            adjacency[j].emplace_back(i, edges);
+            edges++;
+            parent[root(i)] = root(j);
+        }
+    }
+    for (int i = 0; i < atoms; ++i)
+        components += core[i] && root(i) == i;
+    const int cyclomatic = edges - vertices + components;
+    if (cyclomatic <= 0)
+        return result;
+
+    struct Cycle {
+        std::vector<int> atoms;
+        std::vector<uint64_t> bits;
+    };
+    const int words = (edges + 63) / 64;
+    std::vector<Cycle> candidates;
+    std::set<std::vector<uint64_t>> known;
+
+    std::vector<int> dist(atoms, -1), pred(atoms, -1), pred_edge(atoms, -1), stamp(atoms, -1);
+    std::vector<int> visited;
+    int tag = 0;
+    for (int r = 0; r < atoms; ++r) {
+        if (!core[r])
             continue;
+        for (int v : visited)
+            dist[v] = -1;
+        visited.clear();
+
+        /* BFS tree in the subgraph of vertices >= r */
+        dist[r] = 0;
+        visited.push_back(r);
+        for (std::size_t head = 0; head < visited.size(); ++head) {
+            const int v = visited[head];
+            if (2 * (dist[v] + 1) - 1 > maxsize)
+                continue;
+            for (const auto& [w, e] : adjacency[v]) {
+                if (w < r || dist[w] != -1)
+                    continue;
+                dist[w] = dist[v] + 1;
+                pred[w] = v;
+                pred_edge[w] = e;
+                visited.push_back(w);
+            }
         }
-        bool loop = true;
-        std::vector<int> bonded = stored_bonds[i];
-        std::vector<int> knots, outer;
-        // std::vector< std::pair<int, std::vector<int> > > mknots;
-        /*
-        for (int atom : bonded) {
-            if (stored_bonds[atom].size() == 1)
-                done.push_back(atom);
-            knots.push_back(atom);
-            outer.push_back(atom);
-        }*/
-        std::vector<std::vector<int>> stash;
-        stash.push_back(std::vector<int>{ i });
-        // done.push_back(std::vector<int>());
-        int index = -1;
-        while (stash.size() && done.size() < storage * atoms) { // this is just a hack ...
-            for (auto tmp : knots) {
-                auto it = std::find(done.begin(), done.end(), tmp);
-                if (it != done.end())
-                    done.erase(it);
+
+        /* Vismara's prototypes: an edge (y, z) with d(z) = d(y) closes the odd cycle P(r, y) + (y, z) + P(z, r),
+         * two distinct predecessors p, q of y close the even cycle P(r, p) + (p, y) + (y, q) + P(q, r) */
+        auto add = [&](const std::vector<int>& ends, const std::vector<int>& links) {
+            /* both paths may only share r */
+            ++tag;
+            for (int v = ends[0]; v != r; v = pred[v])
+                stamp[v] = tag;
+            for (int v = ends[1]; v != r; v = pred[v])
+                if (stamp[v] == tag)
+                    return;
+
+            Cycle cycle;
+            cycle.bits.assign(words, 0);
+            for (int e : links)
+                cycle.bits[e / 64] |= uint64_t(1) << (e % 64);
+            if (ends.size() == 3)
+                cycle.atoms.push_back(ends[2]);
+            for (int v = ends[0]; v != r; v = pred[v]) {
+                cycle.atoms.push_back(v);
+                cycle.bits[pred_edge[v] / 64] |= uint64_t(1) << (pred_edge[v] % 64);
             }
-            for (int s = 0; s < stash.size(); ++s) {
-                int outeratom = stash[s][stash[s].size() - 1];
-                {
-                    std::vector<int> bonded = stored_bonds[outeratom];
-                    std::vector<int> vacant;
-                    bool close_ring = false;
-                    for (int atom : bonded) {
-                        // std::cout << atom << " " << stash[s][stash[s].size() - 2] << std::endl;
-                        if (stash[s][stash[s].size() - 2] == atom)
-                            continue;
-
-                        if (stash[s][0] == atom) {
-                            vacant.push_back(atom);
-                            close_ring = true;
-                            break;
-                        }
-                        if (stored_bonds[atom].size() == 1) // ignore atoms with only one bond
-                        {
-                            done.push_back(atom);
-                            continue;
-                        }
-                        int counter = 0;
-                        for (auto a : stash[s]) // check if atom is already in the list
-                            counter += a == atom;
-                        bool isKnot = std::find(knots.begin(), knots.end(), atom) != knots.end(); // check if atom is a knot
-                        if (counter) // if atom is in list
-                        {
-                            if (isKnot) // take care of knot-atoms
-                            {
-                                if (counter >= stored_bonds[atom].size()) // if fewer counts than binding partners, except
-                                    continue;
-                            } else
-                                continue;
-                        }
-
-                        if (std::find(done.begin(), done.end(), atom) != done.end()) {
-                            continue;
-                        }
-
-                        vacant.push_back(atom);
-                        if (stash[s].size() == 1)
-                            break;
-                    }
-                    if (vacant.size() == 0 || close_ring) {
-                        loop = false;
-                        if (stash[s].size() < 3) {
-                            stash.erase(stash.begin() + s);
-                            break;
-                        }
-                        int first = stash[s][0];
-                        int last = stash[s][stash[s].size() - 1];
-                        bool connected = false;
-                        for (int a : stored_bonds[first]) {
-                            if (a == last) {
-                                connected = true;
-                                break;
-                            }
-                        }
-                        if (connected) {
-                            index = s;
-                            auto tmp = stash[s];
-                            std::sort(tmp.begin(), tmp.end());
-                            identified_rings.push_back(tmp);
-                            for (int a : stash[s]) {
-                                if (stash[s].size() < maxsize)
-                                    done.push_back(a);
-                                // std::cout << a << " ";
-                            }
-                            // std::cout << std::endl;
-                            stash.erase(stash.begin() + s);
-                        } else {
-                            //    for (int a : stash[s])
-                            //        done.push_back(a);
-                            stash.erase(stash.begin() + s);
-                        }
-                    } else if (vacant.size() == 1)
-                        stash[s].push_back(vacant[0]);
-                    else {
-                        auto currentstash = stash[s];
-                        stash.erase(stash.begin() + s);
-                        if (currentstash.size() > maxsize)
-                            break;
-                        // auto currdone = done[s];
-                        // done.erase(done.begin() + s);
-                        knots.push_back(outeratom);
-                        for (int atom : vacant) {
-                            stash.push_back(currentstash);
-                            stash[stash.size() - 1].push_back(atom);
-                            //  done.push_back(currdone);
-                        }
-                    }
-                }
+            cycle.atoms.push_back(r);
+            for (int v = ends[1]; v != r; v = pred[v]) {
+                cycle.atoms.push_back(v);
+                cycle.bits[pred_edge[v] / 64] |= uint64_t(1) << (pred_edge[v] % 64);
+            }
+            if (known.insert(cycle.bits).second)
+                candidates.push_back(std::move(cycle));
+        };
+
+        std::vector<std::pair<int, int>> predecessors;
+        for (int y : visited) {
+            predecessors.clear();
+            for (const auto& [z, e] : adjacency[y]) {
+                if (z < r || dist[z] == -1)
+                    continue;
+                if (dist[z] + 1 == dist[y])
+                    predecessors.emplace_back(z, e);
+                else if (dist[z] == dist[y] && z < y && 2 * dist[y] + 1 <= maxsize)
+                    add({ y, z }, { e });
             }
+            if (2 * dist[y] > maxsize)
+                continue;
+            for (std::size_t p = 0; p < predecessors.size(); ++p)
+                for (std::size_t q = p + 1; q < predecessors.size(); ++q)
+                    add({ predecessors[p].first, predecessors[q].first, y }, { predecessors[p].second, predecessors[q].second });
         }
     }
-    for (auto a : identified_rings) {
-        // if (a.size() < 10) {
-        // for (auto i : a)
-        //    std::cout << i << " ";
-        // std::cout << std::endl;
-        //}
+    std::stable_sort(candidates.begin(), candidates.end(), [](const Cycle& a, const Cycle& b) { return a.atoms.size() < b.atoms.size(); });
+
+    /* Gaussian elimination, the basis rows are stored by their lowest set bit */
+    auto reduce = [words](std::vector<uint64_t> bits, const std::map<int, std::vector<uint64_t>>& basis) -> std::pair<int, std::vector<uint64_t>> {
+        while (true) {
+            int pivot = -1;
+            for (int w = 0; w < words && pivot == -1; ++w)
+                if (bits[w]) {
+                    pivot = 64 * w;
+                    for (uint64_t word = bits[w]; !(word & 1); word >>= 1)
+                        ++pivot;
+                }
+            if (pivot == -1)
+                return { -1, bits };
+            auto row = basis.find(pivot);
+            if (row == basis.end())
+                return { pivot, bits };
+            for (int w = 0; w < words; ++w)
+                bits[w] ^= row->second[w];
+        }
+    };
+
+    std::map<int, std::vector<uint64_t>> basis, shorter;
+    for (std::size_t begin = 0; begin < candidates.size();) {
+        std::size_t end = begin;
+        while (end < candidates.size() && candidates[end].atoms.size() == candidates[begin].atoms.size())
+            ++end;
+        /* relevant cycles are independent of all strictly shorter cycles */
+        for (std::size_t i = begin; i < end; ++i) {
+            std::vector<int> ring = candidates[i].atoms;
+            std::sort(ring.begin(), ring.end());
+            if (reduce(candidates[i].bits, shorter).first != -1)
+                result.relevant.push_back(ring);
+            auto reduced = reduce(candidates[i].bits, basis);
+            if (reduced.first != -1 && int(result.sssr.size()) < cyclomatic) {
+                basis[reduced.first] = reduced.second;
+                result.sssr.push_back(ring);
+            }
+        }
+        shorter = basis;
+        begin = end;
+        if (int(result.sssr.size()) == cyclomatic)
+            break;
     }
-    return identified_rings;
+    return result;
+}
+
+/*! \brief Ring perception, cached by the bond topology as force field setups request the same rings repeatedly */
+inline RingSet CachedRings(const std::vector<std::vector<int>>& stored_bonds, int atoms, int maxsize = 30)
+{
+    static std::mutex mutex;
+    static std::map<std::pair<int, std::vector<std::vector<int>>>, RingSet> cache;
+
+    std::vector<std::vector<int>> key(stored_bonds.begin(), stored_bonds.begin() + std::min<int>(atoms, stored_bonds.size()));
+    for (auto& bonds : key)
+        std::sort(bonds.begin(), bonds.end());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto entry = cache.find({ maxsize, key });
+    if (entry != cache.end())
+        return entry->second;
+    if (cache.size() > 32)
+        cache.clear();
+    return cache.emplace(std::make_pair(maxsize, key), PerceiveRings(stored_bonds, atoms, maxsize)).first->second;
+}
+
+/*! \brief Smallest set of smallest rings (sorted atom lists) up to maxsize atoms */
+inline std::vector<std::vector<int>> FindRings(const std::vector<std::vector<int>>& stored_bonds, int atoms, int maxsize = 30)
+{
+    return CachedRings(stored_bonds, atoms, maxsize).sssr;
+}
+
+/*! \brief Relevant cycle prototypes, the union of all minimal cycle bases */
+inline std::vector<std::vector<int>> RelevantCycles(const std::vector<std::vector<int>>& stored_bonds, int atoms, int maxsize = 30)
+{
+    return CachedRings(stored_bonds, atoms, maxsize).relevant;
 }
 
 }
@@ -26,18 +26,23 @@
 #include "src/capabilities/confscan.h"
 #include "src/capabilities/confsearch.h"
 #include "src/capabilities/confstat.h"
+#include "src/capabilities/ensemblethermo.h"
 #include "src/capabilities/curcumaopt.h"
 #include "src/capabilities/docking.h"
 #include "src/capabilities/hessian.h"
+#include "src/capabilities/neb.h"
 #include "src/capabilities/nebdocking.h"
+#include "src/capabilities/polybuild.h"
 #include "src/capabilities/pairmapper.h"
 #include "src/capabilities/persistentdiagram.h"
 #include "src/capabilities/qmdfffit.h"
 #include "src/capabilities/rmsd.h"
+#include "src/capabilities/rmsdmatrix.h"
 #include "src/capabilities/rmsdtraj.h"
 #include "src/capabilities/simplemd.h"
 
 #include "src/tools/general.h"
+#include "src/tools/stopcontrol.h"
 #include "src/tools/info.h"
 
 #include "src/capabilities/optimiser/OptimiseDipoleScaling.h"
@@ -90,24 +95,6 @@ void bt_handler(int sig)
     exit(1);
 }
 
-void ctrl_c_handler(int s)
-{
-    if (std::filesystem::exists("stop")) {
-#ifdef C17
-#ifndef _WIN32
-        std::filesystem::remove("stop");
-#endif
-#else
-        remove("stop");
-#endif
-        printf("Caught stop signal a second time.\nWill exit now!\n\n");
-        exit(1);
-    } else {
-        printf("Caught stop signal\nWill try to stop current stuff!\n");
-        std::ofstream output("stop");
-    }
-}
-
 #endif
 #endif
 
@@ -141,7 +128,6 @@ double DotProduct(const Vector& pos1, const Vector& pos2)
 int main(int argc, char **argv) {
 #ifndef _WIN32
 #if __GNUC__
-    signal(SIGINT, ctrl_c_handler);
     signal(SIGSEGV, bt_handler);
     signal(SIGABRT, bt_handler);
 #endif
@@ -155,6 +141,9 @@ int main(int argc, char **argv) {
 #else
     remove("stop");
 #endif
+    /* SIGINT/SIGTERM stop, SIGUSR1 writes a restart file, the stop file is still honoured */
+    StopControl::InstallHandlers();
+    StopControl::StartWatcher();
     RunTimer timer(true);
     if(argc < 2)
     {
@@ -163,15 +152,19 @@ int main(int argc, char **argv) {
                   << "-rmsd        * RMSD Calculator                                            *" << std::endl
                   << "-confscan    * Filter list of conformers                                  *" << std::endl
                   << "-confstat    * Conformation statistics                                    *" << std::endl
+                  << "-thermo      * Free energy ranking of conformer ensembles                 *" << std::endl
                   << "-dock        * Perform some docking                                       *" << std::endl;
         std::cout << "-opt         * LBFGS optimiser                                            *" << std::endl;
         std::cout << "-sp          * Single point calculation                                   *" << std::endl;
         std::cout << "-md          * Molecular dynamics using                                   *" << std::endl;
+        std::cout << "-neb         * Nudged elastic band / string method reaction path          *" << std::endl;
+        std::cout << "-polybuild   * Build clash-free oligomer and polymer chains               *" << std::endl;
         std::cout << "-block       * Split files with many structures in block                  *" << std::endl
                   << "-distance    * Calculate distance between two atoms                       *" << std::endl
                   << "-angle       * Calculate angle between three atoms                        *" << std::endl
                   << "-split       * Split a supramolcular structure in individual molecules    *" << std::endl
                   << "-rmsdtraj    * Find unique structures                                     *" << std::endl
+                  << "-rmsdmatrix  * All-vs-all RMSD matrix and clustering                      *" << std::endl
                   << "-distance    * Calculate distance matrix                                  *" << std::endl
                   << "-reorder     * Write molecule file with randomly reordered indices        *" << std::endl
                   << "-centroid    * Calculate centroid of specific atoms/fragments             *" << std::endl;
@@ -302,6 +295,22 @@ int main(int argc, char **argv) {
             stat->start();
             return 0;
 
+        } else if (strcmp(argv[1], "-thermo") == 0) {
+            if (argc < 3) {
+                std::cerr << "Please use curcuma for free energy ranking of conformer ensembles as follows\ncurcuma -thermo conffile.xyz" << std::endl;
+                std::cerr << "Additonal arguments are:" << std::endl;
+                std::cerr << "-method name      **** Method for energies and hessians (uff = default)." << std::endl;
+                std::cerr << "-threads n        **** Number of structures calculated in parallel." << std::endl;
+                std::cerr << "-window E         **** Energy window in kJ/mol, no frequencies are calculated above." << std::endl;
+                std::cerr << "-T temp           **** Temperature in K." << std::endl;
+                std::cerr << "-freq_cutoff f    **** Free rotor interpolation for frequencies around f (cm-1)." << std::endl;
+                return -1;
+            }
+            EnsembleThermo thermo(controller, false);
+            thermo.setFileName(argv[2]);
+            thermo.start();
+            return 0;
+
         } else if (strcmp(argv[1], "-led") == 0) {
             if (argc < 3) {
                 std::cerr << "Please use curcuma for fragment assignment as follows:\ncurcuma -led input.xyz" << std::endl;
@@ -315,10 +324,15 @@ int main(int argc, char **argv) {
         } else if (strcmp(argv[1], "-hmap") == 0) {
             if (argc < 3) {
                 std::cerr << "Please use curcuma for hydrogen bond mapping as follows:\ncurcuma -hmap trajectory.xyz" << std::endl;
+                std::cerr << "Additonal arguments are:" << std::endl;
+                std::cerr << "-pair A B         **** Atom indices or elements of additional pairs" << std::endl;
+                std::cerr << "-pairfile file    **** File with atom index pairs" << std::endl;
+                std::cerr << "-threads N        **** Number of threads used for blocks of frames" << std::endl;
                 return 0;
             }
 
             std::vector<std::pair<int, int>> pairs, elements;
+            int threads = 1;
 
             if (argc > 3) {
                 for (std::size_t i = 3; i < argc; ++i) {
@@ -337,6 +351,10 @@ int main(int argc, char **argv) {
                             }
                         }
                     }
+                    if (strcmp(argv[i], "-threads") == 0) {
+                        if (i + 1 < argc && Tools::isInt(argv[i + 1]))
+                            threads = std::stoi(argv[i + 1]);
+                    }
                     if (strcmp(argv[i], "-pairfile") == 0) {
                         if (i + 1 < argc) {
                             std::ifstream input(argv[i + 1]);
@@ -357,6 +375,7 @@ int main(int argc, char **argv) {
 
             PairMapper mapper;
             mapper.setFile(argv[2]);
+            mapper.setThreads(threads);
             for (const std::pair<int, int>& pair : pairs)
                 mapper.addPair(pair);
             for (const std::pair<int, int>& pair : elements)
@@ -372,6 +391,7 @@ int main(int argc, char **argv) {
                 std::cerr << "-scale_d1         **** Scale minimal distance for file1.dat!" << std::endl;
                 std::cerr << "-scale_d2         **** Scale minimal distance for file2.dat!" << std::endl;
                 std::cerr << "-local_distance   **** Recalculate distance for every bin (false = default)" << std::endl;
+                std::cerr << "-threads          **** Number of threads for the neighbour search (1 = default)" << std::endl;
                 return 0;
             }
 
@@ -478,6 +498,22 @@ int main(int argc, char **argv) {
             traj.Initialise();
             traj.start();
 
+        } else if (strcmp(argv[1], "-rmsdmatrix") == 0) {
+            if (argc < 3) {
+                std::cerr << "Please use curcuma for all-vs-all rmsd calculation of trajectories and ensembles as follows:\ncurcuma -rmsdmatrix input.xyz" << std::endl;
+                std::cerr << "Additonal arguments are:" << std::endl;
+                std::cerr << "-heavy            **** Use only heavy atoms." << std::endl;
+                std::cerr << "-threads n        **** Number of threads." << std::endl;
+                std::cerr << "-cluster method   **** Cluster structures: kmedoids, hierarchical or leader." << std::endl;
+                std::cerr << "-clusters n       **** Number of clusters for kmedoids and hierarchical." << std::endl;
+                std::cerr << "-threshold d      **** RMSD threshold for leader (and hierarchical with -clusters 0)." << std::endl;
+                return 0;
+            }
+
+            RMSDMatrix matrix(controller, false);
+            matrix.setFileName(argv[2]);
+            matrix.start();
+
         } else if (strcmp(argv[1], "-nebprep") == 0) {
             if (argc < 3) {
                 std::cerr << "Please use curcuma for geometry preparation for nudge-elastic-band calculation follows:\ncurcuma -nebprep first.xyz second.xyz" << std::endl;
@@ -501,6 +537,46 @@ int main(int argc, char **argv) {
             nebdock->Prepare();
             delete nebdock;
 
+        } else if (strcmp(argv[1], "-neb") == 0) {
+            if (argc < 4) {
+                std::cerr << "Please use curcuma for nudged elastic band calculations as follows:\ncurcuma -neb first.xyz second.xyz" << std::endl;
+                std::cerr << "Additonal arguments are:" << std::endl;
+                std::cerr << "-method name      **** Method for energies and gradients (uff = default)." << std::endl;
+                std::cerr << "-threads n        **** Number of images calculated in parallel." << std::endl;
+                std::cerr << "-images n         **** Number of intermediate images." << std::endl;
+                std::cerr << "-interpolation s  **** Initial path, idpp (default) or linear." << std::endl;
+                std::cerr << "-optimiser s      **** fire (default) or lbfgs." << std::endl;
+                std::cerr << "-string           **** String method instead of springs." << std::endl;
+                return 0;
+            }
+
+            NEB neb(controller, false);
+            neb.setStructures(Files::LoadFile(argv[2]), Files::LoadFile(argv[3]));
+            neb.getBasename(argv[2]);
+            if (!neb.Initialise())
+                return -1;
+            neb.start();
+
+        } else if (strcmp(argv[1], "-polybuild") == 0) {
+            if (argc < 3) {
+                std::cerr << "Please use curcuma to build polymer chains as follows:\ncurcuma -polybuild monomer.xyz -units 20" << std::endl;
+                std::cerr << "Additonal arguments are:" << std::endl;
+                std::cerr << "-head n -tail n   **** Linking atoms of the monomer (1 and 2 = default)." << std::endl;
+                std::cerr << "-head_leave n     **** Atom on the head removed on linking (3 = default)." << std::endl;
+                std::cerr << "-tail_leave n     **** Atom on the tail removed on linking (4 = default)." << std::endl;
+                std::cerr << "-chains n         **** Number of independent chains." << std::endl;
+                std::cerr << "-torsions s       **** Preferred torsions in degree, e.g. \"180;60;-60\"." << std::endl;
+                std::cerr << "-relax            **** Relax every new unit with UFF." << std::endl;
+                return 0;
+            }
+
+            PolyBuild polybuild(controller, false);
+            polybuild.setMonomer(Files::LoadFile(argv[2]));
+            polybuild.getBasename(argv[2]);
+            if (!polybuild.Initialise())
+                return -1;
+            polybuild.start();
+
         } else if (strcmp(argv[1], "-centroid") == 0) {
             if (argc < 3) {
                 std::cerr << "Please use curcuma for centroid calculation of user definable fragments:\ncurcuma -centroid first.xyz" << std::endl;
@@ -1018,16 +1094,26 @@ int main(int argc, char **argv) {
                 std::cout << std::endl;
                 std::cout << "mean of scalar: " << sum / mol.AtomCount();*/
             }
-            Vector scaling(mol.AtomCount());
-            for (int i = 0; i < mol.AtomCount(); ++i) {
-                scaling(i) = 1;
+            if (blob.contains("lm") && blob["lm"]) {
+                Vector scaling = Vector::Ones(mol.AtomCount());
+                auto result = OptimiseDipoleScaling(conformers, scaling);
+                std::cout << "LM-Scaler:\n" << result << "\n" << std::endl;
             }
-            auto result = OptimiseDipoleScaling(conformers, scaling);
-            std::cout << "LM-Scaler:\n" << result << "\n" << std::endl;
 
-            Matrix Theta(mol.AtomCount(),1);
-            Theta = DipoleScalingCalculation(conformers);
-            std::cout << "Analytic-Scaler:\n" << Theta << "\n" << std::endl;
+            double ridge = 0;
+            int folds = 5, threads = 1;
+            if (blob.contains("ridge"))
+                ridge = blob["ridge"];
+            if (blob.contains("folds"))
+                folds = blob["folds"];
+            if (blob.contains("threads"))
+                threads = blob["threads"];
+            auto fit = FitDipoleScaling(conformers, ridge, folds, threads);
+            std::cout << "Analytic-Scaler:\n" << fit.scaling << "\n" << std::endl;
+            std::cout << "Conformers: " << conformers.size() << "  RMSE: " << fit.rmse << "  MAE: " << fit.mae << "  max: " << fit.max_error << "  R2: " << fit.r2 << std::endl;
+            std::cout << "RMSE without scaling: " << fit.unscaled_rmse << std::endl;
+            if (fit.folds)
+                std::cout << fit.folds << "-fold cross validation RMSE: " << fit.cv_rmse << std::endl;
 
 
         } else {
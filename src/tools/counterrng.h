@@ -0,0 +1,117 @@
+/*
+ * <Counter based random numbers (Philox4x32-10). >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+/*! \brief Philox4x32-10 (Salmon et al., SC11, DOI 10.1145/2063384.2063405) keyed by seed, stream and step
+ *
+ * Every random word is a pure function of (seed, stream, step, index), so each replica owns an independent
+ * stream without shared state, and the complete state are four integers. The class satisfies
+ * UniformRandomBitGenerator and can be used with the std distributions.
+ */
+class CounterRNG {
+public:
+    typedef uint32_t result_type;
+
+    struct State {
+        uint64_t seed = 0, stream = 0, step = 0, index = 0;
+    };
+
+    CounterRNG(uint64_t seed = 0, uint64_t stream = 0)
+    {
+        this->seed(seed, stream);
+    }
+
+    inline void seed(uint64_t seed, uint64_t stream = 0)
+    {
+        m_state = State();
+        m_state.seed = seed;
+        m_state.stream = stream;
+        m_block = std::numeric_limits<uint64_t>::max();
+    }
+
+    /*! \brief Jump to the beginning of the numbers of step, nothing happens if already there */
+    inline void setStep(uint64_t step)
+    {
+        if (step == m_state.step)
+            return;
+        m_state.step = step;
+        m_state.index = 0;
+        m_block = std::numeric_limits<uint64_t>::max();
+    }
+
+    inline const State& getState() const { return m_state; }
+
+    inline void setState(const State& state)
+    {
+        m_state = state;
+        m_block = std::numeric_limits<uint64_t>::max();
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    inline result_type operator()()
+    {
+        const uint64_t block = m_state.index / 4;
+        if (block != m_block) {
+            m_words = Philox({ static_cast<uint32_t>(block), static_cast<uint32_t>(m_state.step), static_cast<uint32_t>(m_state.step >> 32), static_cast<uint32_t>(m_state.stream) },
+                { static_cast<uint32_t>(m_state.seed), static_cast<uint32_t>(m_state.seed >> 32) ^ static_cast<uint32_t>(m_state.stream >> 32) });
+            m_block = block;
+        }
+        return m_words[m_state.index++ % 4];
+    }
+
+    /*! \brief Uniform in (0, 1), 53 bit resolution */
+    inline double Uniform()
+    {
+        const uint64_t high = operator()() >> 5, low = operator()() >> 6;
+        return ((high << 26 | low) + 0.5) / 9007199254740992.0;
+    }
+
+    /*! \brief Standard normal by Box-Muller, no cached second value so the state stays four integers */
+    inline double Normal()
+    {
+        const double u = Uniform(), v = Uniform();
+        return std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * 3.14159265358979323846 * v);
+    }
+
+    static inline std::array<uint32_t, 4> Philox(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key)
+    {
+        for (int round = 0; round < 10; ++round) {
+            const uint64_t first = uint64_t(0xD2511F53) * counter[0];
+            const uint64_t second = uint64_t(0xCD9E8D57) * counter[2];
+            counter = { static_cast<uint32_t>(second >> 32) ^ counter[1] ^ key[0], static_cast<uint32_t>(second),
+                static_cast<uint32_t>(first >> 32) ^ counter[3] ^ key[1], static_cast<uint32_t>(first) };
+            key[0] += 0x9E3779B9;
+            key[1] += 0xBB67AE85;
+        }
+        return counter;
+    }
+
+private:
+    State m_state;
+    std::array<uint32_t, 4> m_words = { 0, 0, 0, 0 };
+    uint64_t m_block = std::numeric_limits<uint64_t>::max();
+};
@@ -0,0 +1,108 @@
+/*
+ * <Streaming principal component analysis of coordinate sets.>
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <Eigen/Dense>
+
+#include "src/core/global.h"
+
+/*! \brief Incremental PCA, mean and covariance are accumulated block-wise
+ *
+ * Samples are buffered in blocks. Each block is reduced to its mean and scatter matrix
+ * (one matrix product) and merged into the running statistics with the pairwise
+ * Welford/Chan update, so memory stays at dimension^2 regardless of the number of samples.
+ */
+class IncrementalPCA {
+public:
+    IncrementalPCA(int dimension = 0, int blocksize = 64)
+    {
+        setDimension(dimension, blocksize);
+    }
+
+    inline void setDimension(int dimension, int blocksize = 64)
+    {
+        m_dimension = dimension;
+        m_blocksize = std::max(1, blocksize);
+        m_mean = Vector::Zero(dimension);
+        m_scatter = Matrix::Zero(dimension, dimension);
+        m_block = Matrix::Zero(m_blocksize, dimension);
+        m_buffered = 0;
+        m_samples = 0;
+    }
+
+    inline int Dimension() const { return m_dimension; }
+    inline long long Samples() const { return m_samples + m_buffered; }
+
+    inline void addSample(const Vector& sample)
+    {
+        m_block.row(m_buffered) = sample.transpose();
+        if (++m_buffered == m_blocksize)
+            Flush();
+    }
+
+    /*! \brief Merge the buffered samples into the running mean and scatter matrix */
+    void Flush()
+    {
+        if (m_buffered == 0)
+            return;
+        const double nb = m_buffered;
+        const double na = m_samples;
+        const auto block = m_block.topRows(m_buffered);
+        const Vector mean = block.colwise().mean().transpose();
+        const Matrix centered = block.rowwise() - mean.transpose();
+
+        m_scatter.selfadjointView<Eigen::Lower>().rankUpdate(centered.transpose());
+        const Vector delta = mean - m_mean;
+        m_scatter.selfadjointView<Eigen::Lower>().rankUpdate(delta, na * nb / (na + nb));
+        m_mean += delta * nb / (na + nb);
+
+        m_samples += m_buffered;
+        m_buffered = 0;
+    }
+
+    /*! \brief Diagonalise the covariance, eigenvalues and modes are sorted descending */
+    void Finalise(int modes)
+    {
+        Flush();
+        if (m_samples < 2)
+            return;
+        Matrix covariance = m_scatter.selfadjointView<Eigen::Lower>();
+        covariance /= double(m_samples - 1);
+        Eigen::SelfAdjointEigenSolver<Matrix> solver(covariance);
+        modes = std::min(std::max(1, modes), m_dimension);
+        m_eigenvalues = solver.eigenvalues().reverse();
+        m_modes = solver.eigenvectors().rightCols(modes).rowwise().reverse();
+    }
+
+    inline const Vector& Mean() const { return m_mean; }
+    inline const Vector& Eigenvalues() const { return m_eigenvalues; }
+    inline const Matrix& Modes() const { return m_modes; }
+
+    inline Vector Project(const Vector& sample) const
+    {
+        return m_modes.transpose() * (sample - m_mean);
+    }
+
+private:
+    int m_dimension = 0, m_blocksize = 64, m_buffered = 0;
+    long long m_samples = 0;
+    Vector m_mean, m_eigenvalues;
+    Matrix m_scatter, m_block, m_modes;
+};
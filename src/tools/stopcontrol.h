@@ -0,0 +1,142 @@
+/*
+ * <Process wide stop and checkpoint requests. >
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/*! \brief Stop and checkpoint flags shared by all methods
+ *
+ * SIGINT and SIGTERM request a stop (a second SIGINT exits immediately), SIGUSR1 requests a restart file
+ * without stopping. The signal handlers only touch lock-free atomics. A watcher thread checks for the
+ * file "stop" every few seconds, so method loops only read an atomic flag instead of stat'ing the file.
+ */
+class StopControl {
+public:
+    static inline bool StopRequested() { return s_stop.load(std::memory_order_relaxed); }
+
+    static inline void RequestStop() { s_stop.store(true, std::memory_order_relaxed); }
+
+    /* every SIGUSR1 increments the generation, methods compare against the last one they have seen */
+    static inline unsigned int CheckpointGeneration() { return s_checkpoint.load(std::memory_order_relaxed); }
+
+    static inline void RequestCheckpoint() { s_checkpoint.fetch_add(1, std::memory_order_relaxed); }
+
+    static inline void Reset()
+    {
+        s_stop.store(false, std::memory_order_relaxed);
+        s_interrupts.store(0, std::memory_order_relaxed);
+    }
+
+    static inline void InstallHandlers()
+    {
+        std::signal(SIGINT, &StopControl::Handler);
+        std::signal(SIGTERM, &StopControl::Handler);
+#ifndef _WIN32
+        std::signal(SIGUSR1, &StopControl::Handler);
+#endif
+    }
+
+    /*! \brief Poll the stop file every interval seconds in a background thread */
+    static inline void StartWatcher(double interval = 2.0)
+    {
+        Watcher& watcher = getWatcher();
+        std::lock_guard<std::mutex> lock(watcher.mutex);
+        if (watcher.thread.joinable())
+            return;
+        watcher.quit = false;
+        watcher.thread = std::thread([&watcher, interval]() {
+            std::unique_lock<std::mutex> lock(watcher.mutex);
+            while (!watcher.quit) {
+                if (std::ifstream("stop").good())
+                    RequestStop();
+                watcher.condition.wait_for(lock, std::chrono::duration<double>(interval));
+            }
+        });
+    }
+
+    static inline void StopWatcher() { getWatcher().Quit(); }
+
+private:
+    struct Watcher {
+        ~Watcher() { Quit(); }
+        void Quit()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                quit = true;
+            }
+            condition.notify_all();
+            if (thread.joinable())
+                thread.join();
+        }
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool quit = false;
+    };
+
+    static inline Watcher& getWatcher()
+    {
+        static Watcher watcher;
+        return watcher;
+    }
+
+    static inline void Handler(int signal)
+    {
+        /* std::signal may reset the disposition */
+        std::signal(signal, &StopControl::Handler);
+#ifndef _WIN32
+        if (signal == SIGUSR1) {
+            RequestCheckpoint();
+            return;
+        }
+#endif
+        if (signal == SIGINT && s_interrupts.fetch_add(1, std::memory_order_relaxed) > 0) {
+            Message("Caught stop signal a second time.\nWill exit now!\n\n");
+            std::_Exit(1);
+        }
+        Message("Caught stop signal\nWill try to stop current stuff!\n");
+        RequestStop();
+    }
+
+    template <std::size_t N>
+    static inline void Message(const char (&message)[N])
+    {
+#ifndef _WIN32
+        ssize_t written = write(STDOUT_FILENO, message, N - 1);
+        (void)written;
+#endif
+    }
+
+    static inline std::atomic<bool> s_stop{ false };
+    static inline std::atomic<unsigned int> s_checkpoint{ 0 };
+    static inline std::atomic<int> s_interrupts{ 0 };
+};
@@ -0,0 +1,425 @@
+/*
+ * <Performance benchmarks for curcuma.>
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/capabilities/confscan.h"
+#include "src/capabilities/hessian.h"
+#include "src/capabilities/rmsd.h"
+#include "src/capabilities/simplemd.h"
+
+#include "src/core/energycalculator.h"
+#include "src/core/fileiterator.h"
+#include "src/core/hbonds.h"
+#include "src/core/molecule.h"
+
+#include "src/tools/general.h"
+
+#include "workloads.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "json.hpp"
+using json = nlohmann::json;
+
+namespace fs = std::filesystem;
+
+struct Options {
+    std::vector<int> threads;
+    std::set<std::string> only;
+    std::string output = "curcuma_bench.json";
+    int repeats = 3;
+    double min_time = 0.2;
+    uint64_t seed = 1;
+    bool quick = false;
+    bool verbose = false;
+
+    inline bool Run(const std::string& benchmark) const { return only.empty() || only.count(benchmark); }
+};
+
+struct Timing {
+    double median = 0, best = 0, mean = 0;
+    int samples = 0, calls = 0;
+};
+
+/*! \brief Swallows everything written to std::cout while alive, the methods are rather talkative */
+class Mute {
+public:
+    Mute(bool active)
+        : m_active(active)
+    {
+        if (m_active)
+            m_buffer = std::cout.rdbuf(nullptr);
+    }
+    ~Mute()
+    {
+        if (m_active)
+            std::cout.rdbuf(m_buffer);
+    }
+
+private:
+    bool m_active;
+    std::streambuf* m_buffer = nullptr;
+};
+
+static Options options;
+static json results = json::array();
+
+inline double Seconds(const std::function<void()>& function)
+{
+    const auto start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* The first call warms up and calibrates: cheap functions are repeated within a sample until min_time is
+ * reached, expensive ones use the first call as first sample. Times are per call. */
+Timing Measure(const std::function<void()>& function, int repeats = -1)
+{
+    Mute mute(!options.verbose);
+    if (repeats < 1)
+        repeats = options.repeats;
+    std::vector<double> samples;
+    const double first = Seconds(function);
+    int inner = 1;
+    if (first >= options.min_time)
+        samples.push_back(first);
+    else
+        inner = std::max(1, int(options.min_time / std::max(first, 1e-9)));
+    while (samples.size() < repeats) {
+        samples.push_back(Seconds([&function, inner]() {
+            for (int i = 0; i < inner; ++i)
+                function();
+        }) / inner);
+    }
+    Timing timing;
+    timing.samples = samples.size();
+    timing.calls = inner;
+    std::sort(samples.begin(), samples.end());
+    timing.best = samples.front();
+    timing.median = samples[samples.size() / 2];
+    for (double sample : samples)
+        timing.mean += sample / samples.size();
+    return timing;
+}
+
+void Record(const std::string& benchmark, const std::string& workload, int atoms, int threads, const Timing& timing, const json& extra = json::object())
+{
+    json entry = { { "benchmark", benchmark }, { "workload", workload }, { "atoms", atoms }, { "threads", threads },
+        { "seconds", timing.median }, { "best", timing.best }, { "mean", timing.mean }, { "samples", timing.samples }, { "calls", timing.calls } };
+    entry.update(extra);
+    results.push_back(entry);
+    fmt::print("{:<10} {:<24} {:>6} atoms {:>3} threads {:>12.6f} s\n", benchmark, workload, atoms, threads, timing.median);
+}
+
+std::vector<int> Sizes(const std::vector<int>& full, const std::vector<int>& quick)
+{
+    return options.quick ? quick : full;
+}
+
+void BenchXYZ()
+{
+    for (int waters : Sizes({ 10, 100, 1000 }, { 10, 100 })) {
+        const Molecule cluster = Workloads::WaterCluster(waters, options.seed);
+        const int frames = std::max<int>(10, (options.quick ? 30000 : 300000) / cluster.AtomCount());
+        const std::string filename = fmt::format("xyz_{}.xyz", waters);
+        std::remove(filename.c_str());
+        for (int i = 0; i < frames; ++i)
+            cluster.appendXYZFile(filename);
+        const double bytes = fs::file_size(filename);
+        int read = 0;
+        Timing timing = Measure([&filename, &read]() {
+            FileIterator file(filename, true);
+            read = 0;
+            while (!file.AtEnd()) {
+                Molecule molecule = file.Next();
+                read++;
+            }
+        });
+        Record("xyz", cluster.Name(), cluster.AtomCount(), 1, timing,
+            { { "frames", read }, { "frames_per_second", read / timing.median }, { "megabytes_per_second", bytes / 1e6 / timing.median } });
+        std::remove(filename.c_str());
+    }
+}
+
+void BenchRMSD()
+{
+    for (const std::string method : { "incr", "template", "hybrid", "dtemplate", "free" }) {
+        for (int waters : Sizes({ 5, 10, 20, 40 }, { 5, 10 })) {
+            const Molecule reference = Workloads::WaterCluster(waters, options.seed);
+            const Molecule target = Workloads::ShuffledWaterCluster(reference, options.seed);
+            for (int threads : options.threads) {
+                json controller = RMSDJson;
+                controller["threads"] = threads;
+                controller["reorder"] = true;
+                controller["method"] = method;
+                double rmsd = 0;
+                Timing timing = Measure([&]() {
+                    RMSDDriver driver(controller, true);
+                    driver.setReference(reference);
+                    driver.setTarget(target);
+                    driver.start();
+                    rmsd = driver.RMSD();
+                });
+                Record("rmsd_" + method, reference.Name(), reference.AtomCount(), threads, timing, { { "rmsd", rmsd } });
+            }
+        }
+    }
+}
+
+std::vector<Molecule> EnergyWorkloads()
+{
+    std::vector<Molecule> molecules;
+    for (int waters : Sizes({ 10, 30, 100, 300, 1000 }, { 10, 100 }))
+        molecules.push_back(Workloads::WaterCluster(waters, options.seed));
+    for (int carbons : Sizes({ 32, 320 }, { 32 }))
+        molecules.push_back(Workloads::Alkane(carbons).molecule);
+    for (int residues : Sizes({ 10, 100 }, { 10 }))
+        molecules.push_back(Workloads::Peptide(residues).molecule);
+    molecules.push_back(Workloads::HostGuest(16, 4));
+    return molecules;
+}
+
+/* ForceField ("uff"), eigenUFF ("fuff") and QMDFF through the EnergyCalculator, as used by all methods */
+void BenchEnergy(const std::string& benchmark, const std::string& method)
+{
+    for (const Molecule& molecule : EnergyWorkloads()) {
+        for (int threads : options.threads) {
+            json controller = { { "method", method }, { "threads", threads } };
+            EnergyCalculator* calculator = nullptr;
+            Timing setup = Measure([&]() {
+                delete calculator;
+                calculator = new EnergyCalculator(method, controller);
+                calculator->setMolecule(molecule);
+            },
+                1);
+            double energy = 0;
+            Timing timing = Measure([&]() {
+                energy = calculator->CalculateEnergy(true, false);
+            });
+            delete calculator;
+            Record(benchmark, molecule.Name(), molecule.AtomCount(), threads, timing, { { "setup", setup.median }, { "energy", energy } });
+        }
+    }
+}
+
+void BenchH4()
+{
+    for (int waters : Sizes({ 10, 30, 100, 300, 1000 }, { 10, 100 })) {
+        const Molecule cluster = Workloads::WaterCluster(waters, options.seed);
+        const int atoms = cluster.AtomCount();
+        std::vector<hbonds4::atom_t> geometry(atoms);
+        for (int i = 0; i < atoms; ++i)
+            geometry[i] = { cluster.Atom(i).second(0), cluster.Atom(i).second(1), cluster.Atom(i).second(2), cluster.Atom(i).first };
+        hbonds4::H4Correction correction;
+        correction.allocate(atoms);
+        double energy = 0;
+        Timing timing = Measure([&]() {
+            for (int i = 0; i < atoms; ++i) {
+                correction.GradientH4()[i] = { 0, 0, 0 };
+                correction.GradientHH()[i] = { 0, 0, 0 };
+            }
+            energy = correction.energy_corr_h4(atoms, geometry.data()) + correction.energy_corr_hh_rep(atoms, geometry.data());
+        });
+        Record("h4", cluster.Name(), atoms, 1, timing, { { "energy", energy } });
+    }
+}
+
+void BenchHessian()
+{
+    std::vector<Molecule> molecules;
+    for (int waters : Sizes({ 3, 10 }, { 3 }))
+        molecules.push_back(Workloads::WaterCluster(waters, options.seed));
+    molecules.push_back(Workloads::Alkane(8).molecule);
+    for (const Molecule& molecule : molecules) {
+        for (int threads : options.threads) {
+            json controller = HessianJson;
+            controller["method"] = "uff";
+            controller["threads"] = threads;
+            Timing timing = Measure([&]() {
+                Hessian hessian(controller, true);
+                hessian.setMolecule(molecule);
+                hessian.start();
+            },
+                1);
+            Record("hessian", molecule.Name(), molecule.AtomCount(), threads, timing);
+        }
+    }
+}
+
+void BenchConfScan()
+{
+    for (int unique : Sizes({ 10, 40 }, { 10 })) {
+        const Workloads::Ensemble ensemble = Workloads::AlkaneConformers(8, unique, 2, 0.01, options.seed);
+        /* duplicates get exactly the energy of their original */
+        std::vector<double> energies(ensemble.unique, 0);
+        std::vector<bool> done(ensemble.unique, false);
+        const std::string filename = fmt::format("conformers_{}.xyz", unique);
+        std::remove(filename.c_str());
+        {
+            Mute mute(!options.verbose);
+            for (int i = 0; i < ensemble.conformers.size(); ++i) {
+                Molecule conformer = ensemble.conformers[i];
+                const int label = ensemble.label[i];
+                if (!done[label]) {
+                    EnergyCalculator calculator("uff", { { "threads", 1 } });
+                    calculator.setMolecule(conformer);
+                    energies[label] = calculator.CalculateEnergy(false, false);
+                    done[label] = true;
+                }
+                conformer.setEnergy(energies[label]);
+                conformer.appendXYZFile(filename);
+            }
+        }
+        for (int threads : options.threads) {
+            json controller = ConfScanJson;
+            controller["threads"] = threads;
+            controller["restart"] = false;
+            int accepted = 0;
+            Timing timing = Measure([&]() {
+                ConfScan scan(controller, true);
+                scan.setFileName(filename);
+                scan.start();
+                accepted = scan.Result().size();
+            },
+                1);
+            Record("confscan", fmt::format("alkane_8_{}x3", ensemble.unique), ensemble.conformers.front().AtomCount(), threads, timing,
+                { { "conformers", ensemble.conformers.size() }, { "unique", ensemble.unique }, { "accepted", accepted }, { "conformers_per_second", ensemble.conformers.size() / timing.median } });
+        }
+    }
+}
+
+void BenchMD()
+{
+    const int time = options.quick ? 50 : 200;
+    std::vector<Molecule> molecules;
+    for (int waters : Sizes({ 10, 100 }, { 10 }))
+        molecules.push_back(Workloads::WaterCluster(waters, options.seed));
+    molecules.push_back(Workloads::Alkane(20).molecule);
+    for (const Molecule& molecule : molecules) {
+        for (int threads : options.threads) {
+            json md = CurcumaMDJson;
+            md["MaxTime"] = time;
+            md["dt"] = 1;
+            md["threads"] = threads;
+            md["seed"] = options.seed;
+            md["writeXYZ"] = false;
+            md["printOutput"] = false;
+            md["print"] = 10 * time;
+            md["norestart"] = true;
+            md["writerestart"] = -1;
+            Timing timing = Measure([&]() {
+                SimpleMD simulation({ { "md", md } }, true);
+                simulation.setMolecule(molecule);
+                simulation.getBasename("md_bench.xyz");
+                simulation.Initialise();
+                simulation.start();
+            },
+                1);
+            Record("md", molecule.Name(), molecule.AtomCount(), threads, timing, { { "steps", time }, { "steps_per_second", time / timing.median } });
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string argument = argv[i];
+        const bool value = i + 1 < argc;
+        if (argument == "-o" && value)
+            options.output = argv[++i];
+        else if (argument == "-threads" && value) {
+            for (const std::string& entry : Tools::SplitString(argv[++i], ","))
+                options.threads.push_back(std::max(1, std::stoi(entry)));
+        } else if (argument == "-only" && value) {
+            for (const std::string& entry : Tools::SplitString(argv[++i], ","))
+                options.only.insert(entry);
+        } else if (argument == "-repeats" && value)
+            options.repeats = std::max(1, std::stoi(argv[++i]));
+        else if (argument == "-mintime" && value)
+            options.min_time = std::stod(argv[++i]);
+        else if (argument == "-seed" && value)
+            options.seed = std::stoull(argv[++i]);
+        else if (argument == "-quick")
+            options.quick = true;
+        else if (argument == "-verbose")
+            options.verbose = true;
+        else {
+            std::cerr << "Usage: curcuma_bench [-o results.json] [-threads 1,2,4] [-only xyz,rmsd,uff,eigenuff,qmdff,h4,hessian,confscan,md]" << std::endl;
+            std::cerr << "                     [-repeats 3] [-mintime 0.2] [-seed 1] [-quick] [-verbose]" << std::endl;
+            return argument == "-h" || argument == "-help" ? 0 : -1;
+        }
+    }
+    if (options.threads.empty()) {
+        for (int threads = 1; threads < MaxThreads(); threads *= 2)
+            options.threads.push_back(threads);
+        options.threads.push_back(MaxThreads());
+        if (options.quick)
+            options.threads = { 1, MaxThreads() };
+        options.threads.erase(std::unique(options.threads.begin(), options.threads.end()), options.threads.end());
+    }
+
+    /* all methods write their files into the working directory, so everything runs in a scratch directory */
+    const fs::path output = fs::absolute(options.output);
+    const fs::path scratch = fs::absolute("curcuma_bench_scratch");
+    const fs::path working = fs::current_path();
+    fs::create_directories(scratch);
+    fs::current_path(scratch);
+
+    const std::time_t start = std::time(nullptr);
+    if (options.Run("xyz"))
+        BenchXYZ();
+    if (options.Run("rmsd"))
+        BenchRMSD();
+    if (options.Run("uff"))
+        BenchEnergy("uff", "uff");
+    if (options.Run("eigenuff"))
+        BenchEnergy("eigenuff", "fuff");
+    if (options.Run("qmdff"))
+        BenchEnergy("qmdff", "qmdff");
+    if (options.Run("h4"))
+        BenchH4();
+    if (options.Run("hessian"))
+        BenchHessian();
+    if (options.Run("confscan"))
+        BenchConfScan();
+    if (options.Run("md"))
+        BenchMD();
+
+    fs::current_path(working);
+    fs::remove_all(scratch);
+
+    char date[32];
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&start));
+    json document = { { "date", date }, { "threads_available", MaxThreads() }, { "thread_sweep", options.threads },
+        { "seed", options.seed }, { "quick", options.quick }, { "repeats", options.repeats }, { "min_time", options.min_time }, { "results", results } };
+    std::ofstream file(output);
+    file << document.dump(2) << std::endl;
+    std::cout << "Results were written to " << output.string() << std::endl;
+    return 0;
+}
@@ -0,0 +1,342 @@
+/*
+ * <Deterministic synthetic workloads for the curcuma benchmarks.>
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "src/core/global.h"
+#include "src/core/molecule.h"
+
+#include "src/tools/counterrng.h"
+
+/* All generators only depend on their arguments and the seed. Random numbers come from CounterRNG directly
+ * (no std distributions), so the workloads are identical on every platform and standard library. */
+namespace Workloads {
+
+/*! \brief Molecule together with the chain information needed to turn torsions */
+struct Chain {
+    Molecule molecule;
+    std::vector<int> backbone; /* heavy atoms of the chain in order */
+    std::vector<int> segment; /* backbone position every atom is attached to */
+};
+
+struct Ensemble {
+    std::vector<Molecule> conformers;
+    std::vector<int> label; /* conformers with the same label are duplicates */
+    int unique = 0;
+};
+
+inline Molecule Build(const std::vector<int>& elements, const std::vector<Position>& positions, const std::string& name)
+{
+    /* Molecule::addPair checks all pairs on every call, too slow for the larger workloads */
+    Mol mol;
+    mol.m_energy = 0;
+    mol.m_spin = 0;
+    mol.m_charge = 0;
+    mol.m_number_atoms = elements.size();
+    mol.m_atoms = elements;
+    mol.m_geometry = Geometry(elements.size(), 3);
+    for (int i = 0; i < positions.size(); ++i)
+        mol.m_geometry.row(i) = positions[i].transpose();
+    Molecule molecule(mol);
+    molecule.setName(name);
+    molecule.CalculateMass();
+    return molecule;
+}
+
+/*! \brief Uniformly distributed rotation (Shoemake) */
+inline Eigen::Matrix3d RandomRotation(CounterRNG& rng)
+{
+    const double u1 = rng.Uniform(), u2 = 2 * pi * rng.Uniform(), u3 = 2 * pi * rng.Uniform();
+    const Eigen::Quaterniond q(std::sqrt(u1) * std::cos(u3), std::sqrt(1 - u1) * std::sin(u2), std::sqrt(1 - u1) * std::cos(u2), std::sqrt(u1) * std::sin(u3));
+    return q.normalized().toRotationMatrix();
+}
+
+inline Molecule RigidMotion(const Molecule& molecule, CounterRNG& rng, double translation = 5.0)
+{
+    Molecule result(molecule);
+    const Eigen::Matrix3d rotation = RandomRotation(rng);
+    const Eigen::RowVector3d shift(translation * (rng.Uniform() - 0.5), translation * (rng.Uniform() - 0.5), translation * (rng.Uniform() - 0.5));
+    Geometry geometry = molecule.getGeometry();
+    const Eigen::RowVector3d centroid = geometry.colwise().mean();
+    for (int i = 0; i < geometry.rows(); ++i)
+        geometry.row(i) = (geometry.row(i) - centroid) * rotation.transpose() + centroid + shift;
+    result.setGeometry(geometry);
+    return result;
+}
+
+/*! \brief n randomly oriented water molecules on a slightly distorted cubic grid (3n atoms, O H H ordering) */
+inline Molecule WaterCluster(int n, uint64_t seed = 1)
+{
+    CounterRNG rng(seed, 1);
+    const int side = std::ceil(std::cbrt(double(n)) - 1e-9);
+    const double spacing = 3.1, jitter = 0.1;
+    const Position hydrogen1(0.7572, 0.5865, 0), hydrogen2(-0.7572, 0.5865, 0);
+    std::vector<int> elements;
+    std::vector<Position> positions;
+    for (int i = 0; i < n; ++i) {
+        const Position oxygen(spacing * (i % side) + jitter * (rng.Uniform() - 0.5),
+            spacing * ((i / side) % side) + jitter * (rng.Uniform() - 0.5),
+            spacing * (i / (side * side)) + jitter * (rng.Uniform() - 0.5));
+        const Eigen::Matrix3d rotation = RandomRotation(rng);
+        elements.insert(elements.end(), { 8, 1, 1 });
+        positions.push_back(oxygen);
+        positions.push_back(oxygen + rotation * hydrogen1);
+        positions.push_back(oxygen + rotation * hydrogen2);
+    }
+    return Build(elements, positions, "water_" + std::to_string(n));
+}
+
+/* Planar all-trans zig-zag, atom i points up (+y) for odd i. */
+inline std::vector<Position> ZigZag(const std::vector<double>& bonds, double angle)
+{
+    const double dx = std::sin(angle / 2), dy = std::cos(angle / 2);
+    std::vector<Position> positions(1, Position(0, 0, 0));
+    for (int i = 0; i < bonds.size(); ++i)
+        positions.push_back(positions.back() + Position(bonds[i] * dx, (i % 2 ? -1 : 1) * bonds[i] * dy, 0));
+    return positions;
+}
+
+/*! \brief Unit vector from atom index of a zig-zag to its (virtual) neighbour before (-1) or after (+1) */
+inline Position ZigZagNeighbour(int index, int direction, double angle)
+{
+    const double up = index % 2 ? -1 : 1;
+    return Position(direction * std::sin(angle / 2), up * std::cos(angle / 2), 0);
+}
+
+/* Two hydrogen atoms of a CH2 group, symmetric to the plane and opposite to the bisector of the backbone.
+ * carbon is taken by value, it usually refers into positions, which grows here. */
+inline void AddMethylene(const Position carbon, int index, int position, std::vector<int>& elements, std::vector<Position>& positions, std::vector<int>& segment)
+{
+    const double outward = index % 2 ? 1 : -1;
+    const double along = std::cos(109.47 / 360.0 * pi), across = std::sin(109.47 / 360.0 * pi);
+    for (double side : { 1.0, -1.0 }) {
+        elements.push_back(1);
+        positions.push_back(carbon + 1.09 * Position(0, outward * along, side * across));
+        segment.push_back(position);
+    }
+}
+
+/*! \brief All-trans n-alkane CnH2n+2, carbons first (3n + 2 atoms) */
+inline Chain Alkane(int carbons)
+{
+    const double angle = 109.47 / 180.0 * pi;
+    Chain chain;
+    std::vector<int> elements(carbons, 6);
+    std::vector<Position> positions = ZigZag(std::vector<double>(std::max(0, carbons - 1), 1.54), angle);
+    for (int i = 0; i < carbons; ++i) {
+        chain.backbone.push_back(i);
+        chain.segment.push_back(i);
+    }
+    for (int i = 0; i < carbons; ++i)
+        AddMethylene(positions[i], i, i, elements, positions, chain.segment);
+    elements.insert(elements.end(), { 1, 1 });
+    positions.push_back(positions[0] + 1.09 * ZigZagNeighbour(0, -1, angle));
+    positions.push_back(positions[carbons - 1] + 1.09 * ZigZagNeighbour(carbons - 1, 1, angle));
+    chain.segment.insert(chain.segment.end(), { 0, carbons - 1 });
+    chain.molecule = Build(elements, positions, "alkane_" + std::to_string(carbons));
+    return chain;
+}
+
+/*! \brief Extended polyglycine H-(Gly)n-OH, 7n + 3 atoms */
+inline Chain Peptide(int residues)
+{
+    const double angle = 116.0 / 180.0 * pi;
+    Chain chain;
+    std::vector<double> bonds;
+    std::vector<int> elements;
+    for (int i = 0; i < residues; ++i) {
+        elements.insert(elements.end(), { 7, 6, 6 });
+        bonds.insert(bonds.end(), { 1.46, 1.52 });
+        if (i + 1 < residues)
+            bonds.push_back(1.33);
+    }
+    std::vector<Position> positions = ZigZag(bonds, angle);
+    const int heavy = positions.size();
+    for (int i = 0; i < heavy; ++i) {
+        chain.backbone.push_back(i);
+        chain.segment.push_back(i);
+    }
+    for (int i = 0; i < heavy; ++i) {
+        const Position outward(0, i % 2 ? 1 : -1, 0);
+        if (i % 3 == 0) { /* amide hydrogen */
+            elements.push_back(1);
+            positions.push_back(positions[i] + 1.01 * outward);
+            chain.segment.push_back(i);
+        } else if (i % 3 == 1) { /* alpha carbon */
+            AddMethylene(positions[i], i, i, elements, positions, chain.segment);
+        } else { /* carbonyl oxygen */
+            elements.push_back(8);
+            positions.push_back(positions[i] + 1.23 * outward);
+            chain.segment.push_back(i);
+        }
+    }
+    /* terminal NH2 and COOH */
+    elements.push_back(1);
+    positions.push_back(positions[0] + 1.01 * ZigZagNeighbour(0, -1, angle));
+    chain.segment.push_back(0);
+    const Position hydroxyl = positions[heavy - 1] + 1.36 * ZigZagNeighbour(heavy - 1, 1, angle);
+    elements.insert(elements.end(), { 8, 1 });
+    positions.push_back(hydroxyl);
+    positions.push_back(hydroxyl + 0.97 * ZigZagNeighbour(heavy, 1, angle));
+    chain.segment.insert(chain.segment.end(), { heavy - 1, heavy - 1 });
+    chain.molecule = Build(elements, positions, "peptide_" + std::to_string(residues));
+    return chain;
+}
+
+/*! \brief Rotate everything behind backbone bond (k, k + 1) by angle (radian) */
+inline void Torsion(Chain& chain, int k, double angle)
+{
+    Geometry geometry = chain.molecule.getGeometry();
+    const Eigen::RowVector3d origin = geometry.row(chain.backbone[k + 1]);
+    const Eigen::Vector3d axis = (origin - geometry.row(chain.backbone[k])).normalized().transpose();
+    const Eigen::Matrix3d rotation = Eigen::AngleAxisd(angle, axis).toRotationMatrix();
+    for (int i = 0; i < geometry.rows(); ++i)
+        if (chain.segment[i] > k)
+            geometry.row(i) = (geometry.row(i) - origin) * rotation.transpose() + origin;
+    chain.molecule.setGeometry(geometry);
+}
+
+/*! \brief Conformers of an n-alkane from t/g+/g- torsion patterns, each one repeated copies times
+ *
+ * Patterns equal to another one by reversing the chain or mirroring are skipped, as well as g+g- sequences
+ * (syn-pentane clashes), so the labels are the exact number of distinct conformers. The duplicates are
+ * randomly rotated and translated copies with noise (in Angstrom) added, and everything is shuffled.
+ */
+inline Ensemble AlkaneConformers(int carbons, int unique, int copies, double noise = 0.01, uint64_t seed = 1)
+{
+    CounterRNG rng(seed, 2);
+    const int torsions = std::max(0, carbons - 3);
+    std::vector<std::vector<int>> patterns;
+    long long total = 1;
+    for (int i = 0; i < torsions && total < 100000000; ++i)
+        total *= 3;
+    for (long long code = 0; code < total && patterns.size() < unique; ++code) {
+        std::vector<int> pattern(torsions);
+        long long rest = code;
+        for (int i = 0; i < torsions; ++i, rest /= 3)
+            pattern[i] = rest % 3 == 2 ? -1 : rest % 3;
+        bool clash = false;
+        for (int i = 0; i + 1 < torsions; ++i)
+            clash |= pattern[i] * pattern[i + 1] == -1;
+        std::vector<int> reversed(pattern.rbegin(), pattern.rend()), mirrored(pattern), both(reversed);
+        for (int i = 0; i < torsions; ++i) {
+            mirrored[i] *= -1;
+            both[i] *= -1;
+        }
+        auto order = [](const std::vector<int>& a, const std::vector<int>& b) { return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end()); };
+        if (clash || order(reversed, pattern) || order(mirrored, pattern) || order(both, pattern))
+            continue;
+        patterns.push_back(pattern);
+    }
+
+    Ensemble ensemble;
+    ensemble.unique = patterns.size();
+    std::vector<std::pair<Molecule, int>> all;
+    for (int p = 0; p < patterns.size(); ++p) {
+        Chain chain = Alkane(carbons);
+        for (int i = 0; i < torsions; ++i)
+            if (patterns[p][i])
+                Torsion(chain, i + 1, patterns[p][i] * 2 * pi / 3);
+        for (int c = 0; c <= copies; ++c) {
+            Molecule copy = c ? RigidMotion(chain.molecule, rng) : chain.molecule;
+            if (c && noise > 0) {
+                Geometry geometry = copy.getGeometry();
+                for (int i = 0; i < geometry.rows(); ++i)
+                    for (int j = 0; j < 3; ++j)
+                        geometry(i, j) += noise * (2 * rng.Uniform() - 1);
+                copy.setGeometry(geometry);
+            }
+            copy.setName(fmt::format("conformer_{}_{}", p, c));
+            all.emplace_back(copy, p);
+        }
+    }
+    for (int i = all.size() - 1; i > 0; --i)
+        std::swap(all[i], all[std::min<int>(i, rng.Uniform() * (i + 1))]);
+    for (const auto& entry : all) {
+        ensemble.conformers.push_back(entry.first);
+        ensemble.label.push_back(entry.second);
+    }
+    return ensemble;
+}
+
+/*! \brief Crown shaped cycloalkane (CH2)n with an n-alkane threaded through its centre along the ring axis */
+inline Molecule HostGuest(int ring, int guest)
+{
+    ring = std::max(ring, 12);
+    const double radius = 1.54 / (2 * std::sin(pi / ring));
+    const double along = std::cos(109.47 / 360.0 * pi), across = std::sin(109.47 / 360.0 * pi);
+    std::vector<int> elements;
+    std::vector<Position> positions;
+    for (int k = 0; k < ring; ++k) {
+        const double phi = 2 * pi * k / ring, z = k % 2 ? 0.25 : -0.25;
+        const Position radial(std::cos(phi), std::sin(phi), 0);
+        elements.push_back(6);
+        positions.push_back(radius * radial + Position(0, 0, z));
+    }
+    for (int k = 0; k < ring; ++k) {
+        const Position radial(positions[k](0) / radius, positions[k](1) / radius, 0);
+        for (double side : { 1.0, -1.0 }) {
+            elements.push_back(1);
+            positions.push_back(positions[k] + 1.09 * (along * radial + Position(0, 0, side * across)));
+        }
+    }
+    Chain chain = Alkane(guest);
+    const Geometry geometry = chain.molecule.getGeometry();
+    const Eigen::RowVector3d centroid = geometry.colwise().mean();
+    for (int i = 0; i < geometry.rows(); ++i) {
+        const Eigen::RowVector3d p = geometry.row(i) - centroid;
+        elements.push_back(chain.molecule.Atom(i).first);
+        positions.push_back(Position(p(2), p(1), -p(0)));
+    }
+    return Build(elements, positions, fmt::format("hostguest_{}_{}", ring, guest));
+}
+
+/*! \brief Randomly rotated copy of a water cluster with the molecules and the hydrogen atoms of each molecule shuffled */
+inline Molecule ShuffledWaterCluster(const Molecule& cluster, uint64_t seed = 1)
+{
+    CounterRNG rng(seed, 3);
+    const int waters = cluster.AtomCount() / 3;
+    std::vector<int> order(waters);
+    for (int i = 0; i < waters; ++i)
+        order[i] = i;
+    for (int i = waters - 1; i > 0; --i)
+        std::swap(order[i], order[std::min<int>(i, rng.Uniform() * (i + 1))]);
+    std::vector<int> elements;
+    std::vector<Position> positions;
+    for (int w : order) {
+        const bool swap = rng.Uniform() < 0.5;
+        for (int atom : { 3 * w, 3 * w + (swap ? 2 : 1), 3 * w + (swap ? 1 : 2) }) {
+            elements.push_back(cluster.Atom(atom).first);
+            positions.push_back(cluster.Atom(atom).second);
+        }
+    }
+    return RigidMotion(Build(elements, positions, cluster.Name() + "_shuffled"), rng);
+}
+}
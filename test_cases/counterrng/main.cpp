@@ -0,0 +1,51 @@
+/*
+ * <CounterRNG Test application within curcuma.>
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/tools/counterrng.h"
+
+#include <iostream>
+
+int main(int argc, char** argv)
+{
+    const uint64_t seed = 42, stream = 3;
+    const int steps = 5;
+
+    /* short steps end inside the first block of four words, long ones beyond it */
+    for (int draws : { 2, 4, 6 }) {
+        CounterRNG advancing(seed, stream);
+        for (int step = 0; step < steps; ++step) {
+            advancing.setStep(step);
+
+            CounterRNG direct(seed, stream);
+            CounterRNG::State state = direct.getState();
+            state.step = step;
+            direct.setState(state);
+
+            for (int i = 0; i < draws; ++i) {
+                const auto a = advancing(), b = direct();
+                if (a != b) {
+                    std::cout << "CounterRNG test failed at step " << step << ", draw " << i << " (" << a << " != " << b << ")." << std::endl;
+                    return -1;
+                }
+            }
+        }
+    }
+    std::cout << "CounterRNG test passed." << std::endl;
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * <Ring perception Test application within curcuma.>
+ * Copyright (C) 2024 Conrad Hübler <Conrad.Huebler@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "src/core/topology.h"
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+std::vector<std::vector<int>> Graph(int atoms, const std::vector<std::pair<int, int>>& bonds)
+{
+    std::vector<std::vector<int>> stored_bonds(atoms);
+    for (const auto& bond : bonds) {
+        stored_bonds[bond.first].push_back(bond.second);
+        stored_bonds[bond.second].push_back(bond.first);
+    }
+    return stored_bonds;
+}
+
+bool Check(const std::string& name, const std::vector<std::vector<int>>& stored_bonds, int sssr, int relevant, int size)
+{
+    const Topology::RingSet rings = Topology::PerceiveRings(stored_bonds, stored_bonds.size());
+    bool passed = int(rings.sssr.size()) == sssr && int(rings.relevant.size()) == relevant;
+    for (const auto& ring : rings.relevant)
+        passed = passed && int(ring.size()) == size;
+    std::cout << name << ": " << rings.sssr.size() << " SSSR rings, " << rings.relevant.size() << " relevant cycles " << (passed ? "passed" : "failed") << std::endl;
+    return passed;
+}
+
+int main(int argc, char** argv)
+{
+    bool passed = true;
+
+    /* bridgeheads 0 and 1, three bridges of two atoms, three equivalent six-membered rings */
+    passed = Check("bicyclo[2.2.2]octane", Graph(8, { { 0, 2 }, { 2, 3 }, { 3, 1 }, { 0, 4 }, { 4, 5 }, { 5, 1 }, { 0, 6 }, { 6, 7 }, { 7, 1 } }), 2, 3, 6) && passed;
+
+    /* the six-membered envelope is the sum of both five-membered rings and not relevant */
+    passed = Check("norbornane", Graph(7, { { 0, 2 }, { 2, 3 }, { 3, 1 }, { 0, 4 }, { 4, 5 }, { 5, 1 }, { 0, 6 }, { 6, 1 } }), 2, 2, 5) && passed;
+
+    /* six faces, five of them form a basis */
+    passed = Check("cubane", Graph(8, { { 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 }, { 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 4 }, { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 } }), 5, 6, 4) && passed;
+
+    return passed ? 0 : -1;
+}